@@ -241,6 +241,7 @@ static class HelpManUI : public UIInstance {
 					ImGui::BulletText("F1  - Open this Help");
 					ImGui::BulletText("F7  - Open ImGUI Demo");
 					ImGui::BulletText("F8  - Show Profiler");
+					ImGui::BulletText("F9  - Export profiler trace (last 10 s, when tracing is on)");
 					ImGui::BulletText("F10 - Show FPS Overlay");
 				}
 				ImGui::EndChild();
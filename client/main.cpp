@@ -10,6 +10,9 @@
 
 #include "_ui_list.hpp"
 
+#include <cstdlib>
+#include <ctime>
+
 static bool need_handle_exit_cond() {							 // exit requested
 	if (pb::screen::_GetCurrent()) {											 // if have screen
 		return pb::screen::_GetCurrent()->exit_req() == 0;	 // exit if requiest handler returns 0
@@ -19,6 +22,13 @@ static bool need_handle_exit_cond() {							 // exit requested
 	return false;	 // do not exit app, continue drawing and etc.
 }
 
+/** writes last seconds of the profiler trace to trace_<unix time>.json */
+static void export_trace(double seconds) {
+	char path[64];
+	snprintf(path, sizeof(path), "trace_%lld.json", (long long)time(nullptr));
+	pb::prof::export_trace(path, seconds);
+}
+
 // debug shortcuts
 static void extra_keys(SDL_Event& e) {
 	if (e.type == SDL_KEYDOWN) {
@@ -26,6 +36,7 @@ static void extra_keys(SDL_Event& e) {
 		if (e.key.keysym.sym == SDLK_F1) show_help_window = !show_help_window;
 		if (e.key.keysym.sym == SDLK_F7) show_demo_window = !show_demo_window;
 		if (e.key.keysym.sym == SDLK_F8) show_profiler = !show_profiler;
+		if (e.key.keysym.sym == SDLK_F9 && pb::prof::is_tracing()) export_trace(10);
 		if (e.key.keysym.sym == SDLK_F10) show_fps_overlay = !show_fps_overlay;
 	}
 }
@@ -116,6 +127,20 @@ extern void _free_client();
 
 int main() {
 	auto ctx = pb::prof::init_thread_data();
+	ctx.set_name("Main");
+	ctx.set_spike_detection(true);
+	if (const char* v = getenv("PB_TRACE"); v && *v && *v != '0') pb::prof::set_tracing(true);
+	if (const char* v = getenv("PB_SPIKE_MS"); v && atof(v) > 0) {
+		pb::prof::SpikeConfig spikes;
+		spikes.budget = atof(v) / 1000.0;
+		pb::prof::set_spike_detector(spikes);
+	}
+	// frame summaries for tools/prof_view, without the profiler window
+	if (const char* v = getenv("PB_PROF_STREAM"); v) pb::prof::start_stream(v);
+	// headless stats for tools/prof_compare : at exit, and every N seconds if set
+	const char* dump_path = getenv("PB_PROF_DUMP");
+	double dump_interval = 0, last_dump = pb::prof::prof_clock();
+	if (const char* v = getenv("PB_PROF_DUMP_INTERVAL"); v && dump_path && *dump_path) dump_interval = atof(v);
 	{
 		PROFILING_SCOPE("Init::ALL");
         pb::_init_client();
@@ -199,10 +224,18 @@ int main() {
 
 		// step profiler in this thread
 		ctx.step();
+		if (dump_interval > 0 && pb::prof::prof_clock() - last_dump >= dump_interval) {
+			pb::prof::dump_stats(dump_path);
+			last_dump = pb::prof::prof_clock();
+		}
+		pb::client_settings.tick(); // changed settings, batched
 		pb::client_settings.db.assert_owned();
 	}
 
 	// finalization
+	if (pb::prof::is_tracing()) export_trace(10);
+	if (dump_path && *dump_path) pb::prof::dump_stats(dump_path);
+	pb::prof::stop_stream();
 	pb::screen::_FreeAll(); // free all UI and screen stuff
 
 	ImGui_ImplOpenGL3_Shutdown();
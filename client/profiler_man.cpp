@@ -19,13 +19,20 @@
  */
 
 #include "hashmap.hpp"
+#include "memory.hpp"
+#include "sync.hpp"
 #define PROFILER_DEFINE_EXT
 #include "profiler.hpp"
 
 #include <engine/base.hpp>
 #include <sstream>
 #include <vector>
-#include <set>
+#include <array>
+#include <algorithm>
+#include <cstdio>
+#include <cfloat>
+#include <cstring>
+#include <ctime>
 
 #include "imgui.h"
 #include "hashtable.h"
@@ -36,7 +43,7 @@ namespace pb {
 
 namespace screen {
 
-using ZonePair = std::pair<const std::string*, prof::prof_stats>;
+using ZonePair = std::pair<const prof::ZoneDesc*, prof::prof_stats>;
 
 struct compare_zones {
 	bool operator()(const ZonePair& a, const ZonePair& b) const {
@@ -46,36 +53,140 @@ struct compare_zones {
 	}
 };
 
-using ZoneSet = std::multiset<std::pair<const std::string*, prof::prof_stats>, compare_zones>;
+using ZoneList = std::vector<ZonePair>;
+
+/** p50, p95, p99 of the call duration, by zone ID */
+using Percentiles = std::array<float, 3>;
+static constexpr double PERCENTILES[] = {0.5, 0.95, 0.99};
 
 /** utility  functions*/
-static ImColor get_str_color(const std::string& s) {
+static ImColor get_str_color(std::string_view s) {
 	size_t hash = pb::murmurhash(s);
 	const ImVec4 col = ImVec4(((hash&127)+127)/255.0, (((hash>>8)&127)+127)/255.0, (((hash>>16)&127)+127)/255.0, 1.0);
 	return col;
 }
 
-static void add_calltable_row(const ZoneSet& zones) {
+static void add_calltable_row(const ZoneList& zones, const std::vector<Percentiles>& pct) {
 	for (auto &z : zones) {
-		ImGui::PushID(std::hash<const std::string*>{}(z.first));
+		ImGui::PushID(z.first->id);
 
 		// Text and Tree nodes are less high than framed widgets, using AlignTextToFramePadding() we add vertical spacing to make the tree lines
 		// equal high.
 		ImGui::TableNextRow();
 		ImGui::TableSetColumnIndex(0);
 		ImGui::AlignTextToFramePadding();
-		ImGui::TextColored(get_str_color(*z.first), "%s", z.first->c_str());
+		ImGui::TextColored(get_str_color(z.first->name), "%s", z.first->name);
 		ImGui::TableSetColumnIndex(1);
 		ImGui::Text("%f", z.second.sumtime);
 		ImGui::TableSetColumnIndex(2);
 		ImGui::Text("%f", z.second.owntime);
 		ImGui::TableSetColumnIndex(3);
 		ImGui::Text("%i", z.second.ncalls);
+		for (int i = 0; i < 3; i++) {
+			ImGui::TableSetColumnIndex(4 + i);
+			if (z.first->id < pct.size()) ImGui::Text("%.3f", pct[z.first->id][i] * 1000.0);
+		}
+		ImGui::TableSetColumnIndex(7);
+		ImGui::Text("%u", z.second.allocs);
+		ImGui::TableSetColumnIndex(8);
+		ImGui::Text("%.1f", z.second.alloc_bytes / 1024.0);
+		ImGui::TableSetColumnIndex(9);
+		ImGui::Text("%u", z.second.frees);
 
 		ImGui::PopID();
 	}
 }
 
+/** counter or gauge over the history, oldest first */
+struct ValuePlot {
+	const prof::ZoneDesc* zone;
+	std::vector<float> v;
+};
+
+/** call tree node, averaged over the frames */
+struct TreeNode {
+	const prof::ZoneDesc* zone; // nullptr for the root
+	uint32_t parent;
+	double total = 0, own = 0, calls = 0; // per frame, ms
+	std::vector<uint32_t> children;
+};
+
+/** perf counters of the zone, summed over all calls */
+struct PerfRow {
+	const prof::ZoneDesc* zone;
+	int ncalls;
+	uint64_t v[prof::PERF_COUNTERS];
+};
+
+static void add_perftable_rows(const std::vector<PerfRow>& rows, prof::PerfKind kind) {
+	for (auto& r : rows) {
+		double n = r.ncalls;
+		ImGui::TableNextRow();
+		ImGui::TableSetColumnIndex(0);
+		ImGui::TextColored(get_str_color(r.zone->name), "%s", r.zone->name);
+		ImGui::TableSetColumnIndex(1);
+		ImGui::Text("%i", r.ncalls);
+		if (kind == prof::PerfKind::HARDWARE) {
+			ImGui::TableSetColumnIndex(2);
+			ImGui::Text("%.2f", r.v[prof::PERF_CYCLES] ? double(r.v[prof::PERF_INSTRUCTIONS]) / r.v[prof::PERF_CYCLES] : 0.0);
+			for (int c = prof::PERF_L1D_MISSES; c <= prof::PERF_BRANCH_MISSES; c++) {
+				ImGui::TableSetColumnIndex(c + 1);
+				ImGui::Text("%.1f", r.v[c] / n);
+			}
+		} else {
+			ImGui::TableSetColumnIndex(2);
+			ImGui::Text("%.3f", r.v[prof::PERF_TASK_CLOCK] / n * 1e-6);
+			ImGui::TableSetColumnIndex(3);
+			ImGui::Text("%.2f", r.v[prof::PERF_PAGE_FAULTS] / n);
+			ImGui::TableSetColumnIndex(4);
+			ImGui::Text("%.2f", r.v[prof::PERF_CONTEXT_SWITCHES] / n);
+		}
+	}
+}
+
+static void add_sampletable_rows(const std::vector<prof::SampleEntry>& samples, uint64_t total) {
+	for (auto& s : samples) {
+		const char* zone = s.zone ? s.zone->name : "<no zone>";
+		ImGui::TableNextRow();
+		ImGui::TableSetColumnIndex(0);
+		ImGui::TextColored(get_str_color(zone), "%s", zone);
+		ImGui::TableSetColumnIndex(1);
+		ImGui::TextUnformatted(s.function.c_str());
+		ImGui::TableSetColumnIndex(2);
+		ImGui::Text("%llu", (unsigned long long)s.count);
+		ImGui::TableSetColumnIndex(3);
+		ImGui::Text("%.1f%%", total ? s.count * 100.0 / total : 0.0);
+	}
+}
+
+/** memory of all the MemoryTags : maps, caches, etc. */
+static void add_memtable_rows() {
+	for (const MemoryTag* t = MemoryTag::first(); t; t = t->next()) {
+		ImGui::TableNextRow();
+		ImGui::TableSetColumnIndex(0);
+		ImGui::Text("%s", t->name());
+		ImGui::TableSetColumnIndex(1);
+		ImGui::Text("%.1f KiB", t->bytes() / 1024.0);
+		ImGui::TableSetColumnIndex(2);
+		ImGui::Text("%zu", t->blocks());
+	}
+}
+
+/** contention of all the LockTags. Waits are also in the calls list, as zones with the same names */
+static void add_locktable_rows() {
+	for (const LockTag* t = LockTag::first(); t; t = t->next()) {
+		ImGui::TableNextRow();
+		ImGui::TableSetColumnIndex(0);
+		ImGui::Text("%s", t->name());
+		ImGui::TableSetColumnIndex(1);
+		ImGui::Text("%llu", (unsigned long long)t->contended());
+		ImGui::TableSetColumnIndex(2);
+		ImGui::Text("%.3f ms", t->wait_time() * 1e3);
+		ImGui::TableSetColumnIndex(3);
+		ImGui::Text("%.3f ms", t->max_wait_time() * 1e3);
+	}
+}
+
 static std::string id_to_string(prof::ThreadID id) {
 	std::stringstream strm;
 	strm << id;
@@ -89,46 +200,223 @@ bool show_profiler = false;
 /** Implementation */
 static class Profiler : public UIInstance {
 	bool pause;
-	bool force_short_stats = false;
 	bool need_refresh = false;
-	bool short_stats = false;
+	float trace_window = 10; // seconds
+	float spike_budget = 50; // ms
+	float spike_ratio = 3; // of the median frame
 	// threads
 	prof::ThreadID current_thread;
+	const prof::ThreadHistory* history = nullptr;
 	std::vector<prof::ThreadID> threrads;
-	// history
+	// history : zones with calls, for every position. Only rewritten positions are read again
 	size_t history_pos = 0;
-	std::vector<prof::StatsStorage2> data = std::vector<prof::StatsStorage2>(prof::history_size());	 // full stats
-	// most heavier zones (short stats)
-	ZoneSet zones;
+	ZoneList data[prof::HISTORY_LEN];
+	uint32_t versions[prof::HISTORY_LEN] = {};
+	// most heavier zones at history_pos
+	ZoneList zones;
+	// percentiles in the last histogram window
+	std::vector<Percentiles> percentiles;
+	uint32_t window_version = 1;
+	// perf counters at history_pos
+	std::vector<PerfRow> perf_rows;
+	prof::PerfKind perf_kind = prof::PerfKind::NONE;
+	// frame times and counters/gauges over the history, oldest first
+	std::vector<float> frame_plot;
+	std::vector<ValuePlot> value_plots;
+	// call tree, averaged over the last tree_frames frames
+	std::vector<TreeNode> tree;
+	int tree_frames = 16;
+	uint32_t tree_focus = 0; // clicked node : is drawn on the full width
+	// sampling mode results, all threads
+	std::vector<prof::SampleEntry> samples;
+	uint64_t samples_total = 0;
 	private:
+	void select_thread(prof::ThreadID id) {
+		current_thread = id;
+		history = prof::get_history(id);
+		for (auto& v : versions) v = 1; // odd version never exists : read everything
+		window_version = 1;
+		need_refresh = true;
+	}
+	/** true if position is changed */
+	bool read_position(size_t i) {
+		prof::HistoryView view(history, i);
+		if (view.version() == versions[i]) return false;
+		data[i].clear();
+		for (size_t j = 0; j < view.size(); j++) {
+			prof::prof_stats v = view.stats(j);
+			const prof::ZoneDesc* zone = view.zone(j);
+			if (v.ncalls > 0 && zone->kind == prof::ZoneKind::ZONE) data[i].emplace_back(zone, v); // values are in their own tab
+		}
+		versions[i] = view.valid() ? view.version() : 1; // torn : read again next time
+		return true;
+	}
 	void refresh_data(prof::ThreadData& prof) {
 	if (pause && !need_refresh) return;
 	need_refresh = false;
 
 	prof::get_threads(threrads);
-	zones.clear();
-
-	if (short_stats || force_short_stats) {	 // short
-		data[history_pos] = prof::get_summary(current_thread, history_pos);
-	} else {
-		// full
-		PROFILING_SCOPE_X("Prof_refresh_data_long", prof);
-		size_t i = history_pos;
-		size_t dst = prof::get_current_position(current_thread);
-		size_t size = prof::history_size();
-		if (dst >= size) throw "wat";
-		while (i != dst) {
-			data[i] = prof::get_summary(current_thread, i);
-			i++;
-			if (i >= size) i = 0;
+	if (!history) return;
+
+	PROFILING_SCOPE_X("Prof_refresh_data", prof);
+	for (size_t i = 0; i < prof::HISTORY_LEN; i++) read_position(i);
+
+	history_pos = prof::get_current_position(history);
+	zones = data[history_pos];
+	std::sort(zones.begin(), zones.end(), compare_zones());
+	read_percentiles();
+	read_perf();
+	read_tree();
+	read_values();
+}
+	void read_perf() {
+		prof::HistoryView view(history, history_pos);
+		perf_kind = view.perf_kind();
+		perf_rows.clear();
+		if (perf_kind == prof::PerfKind::NONE) return;
+		for (size_t i = 0; i < view.size(); i++) {
+			prof::prof_stats s = view.stats(i);
+			if (s.ncalls <= 0) continue;
+			PerfRow& r = perf_rows.emplace_back(PerfRow{view.zone(i), s.ncalls, {}});
+			for (int c = 0; c < prof::PERF_COUNTERS; c++) r.v[c] = view.perf(i, c);
+		}
+	}
+	void read_values() {
+		prof::HistoryView last(history, history_pos);
+		std::vector<size_t> index; // in the view
+		value_plots.clear();
+		for (size_t i = 0; i < last.size(); i++) {
+			const prof::ZoneDesc* zone = last.zone(i);
+			if (!zone || zone->kind == prof::ZoneKind::ZONE) continue;
+			index.push_back(i);
+			value_plots.push_back(ValuePlot{zone, {}});
+		}
+		frame_plot.clear();
+		for (size_t k = 0; k < prof::HISTORY_LEN; k++) {
+			prof::HistoryView view(history, (history_pos + 1 + k) % prof::HISTORY_LEN);
+			if (view.version() == 0) continue; // not written yet
+			frame_plot.push_back(view.frame_time() * 1000.0);
+			for (size_t j = 0; j < index.size(); j++) value_plots[j].v.push_back(view.stats(index[j]).value);
 		}
-		data[dst] = prof::get_summary(current_thread, i);
-		history_pos = i;
 	}
+	void draw_values() {
+		ImGui::TextDisabled("Counters and gauges (ThreadData::counter()/gauge()) against the frame time");
+		ImVec2 size(-1, 60);
+		if (frame_plot.empty()) return;
+		char overlay[64];
+		snprintf(overlay, sizeof(overlay), "%.2f ms", frame_plot.back());
+		ImGui::PlotLines("Frame time", frame_plot.data(), frame_plot.size(), 0, overlay, 0, FLT_MAX, size);
+		for (auto& p : value_plots) {
+			if (p.v.empty()) continue;
+			snprintf(overlay, sizeof(overlay), "%s : %g", p.zone->kind == prof::ZoneKind::COUNTER ? "per frame" : "now", p.v.back());
+			ImGui::PlotLines(p.zone->name, p.v.data(), p.v.size(), 0, overlay, FLT_MAX, FLT_MAX, size);
+		}
+	}
+	void read_tree() {
+		size_t count = prof::HistoryView(history, history_pos).node_count();
+		tree.assign(count, TreeNode{});
+		int frames = 0;
+		std::vector<prof::prof_stats> v(count);
+		for (int k = 0; k < tree_frames; k++) {
+			size_t pos = (history_pos + prof::HISTORY_LEN - k) % prof::HISTORY_LEN;
+			prof::HistoryView view;
+			for (int attempt = 0; attempt < 4; attempt++) { // torn : retry, then skip
+				view = prof::HistoryView(history, pos);
+				size_t n = std::min(count, view.node_count());
+				for (size_t i = 0; i < n; i++) v[i] = view.node_stats(i);
+				if (view.valid()) break;
+			}
+			if (!view.valid() || view.version() == 0) continue;
+			frames++;
+			for (size_t i = 0; i < count; i++) {
+				tree[i].total += v[i].sumtime;
+				tree[i].own += v[i].owntime;
+				tree[i].calls += v[i].ncalls;
+			}
+		}
 
-	// sort
-	for (auto &p : data[history_pos]) {zones.emplace(p);}
-}
+		prof::HistoryView view(history, history_pos);
+		for (size_t i = 0; i < count; i++) {
+			TreeNode& t = tree[i];
+			if (frames) t.total *= 1000.0 / frames, t.own *= 1000.0 / frames, t.calls /= frames;
+			t.zone = i ? prof::get_zone(view.node_zone(i)) : nullptr;
+			t.parent = view.node_parent(i);
+			if (i && t.calls > 0) tree[t.parent].children.push_back(i);
+		}
+		// by name : layout doesn't jump around from frame to frame
+		for (auto& t : tree) std::sort(t.children.begin(), t.children.end(), [this](uint32_t a, uint32_t b) {
+			return strcmp(tree[a].zone ? tree[a].zone->name : "", tree[b].zone ? tree[b].zone->name : "") < 0;
+		});
+		if (tree_focus >= tree.size()) tree_focus = 0;
+	}
+	/** icicle chart : node is as wide as it's total time, children are below it */
+	float draw_node(ImDrawList* dl, uint32_t n, float x, float y, float w, float row) {
+		const TreeNode& t = tree[n];
+		if (w < 2) return y;
+		const char* name = t.zone ? t.zone->name : "<all zones>";
+		ImVec2 a(x, y), b(x + w - 1, y + row - 1);
+		dl->AddRectFilled(a, b, t.zone ? (ImU32)get_str_color(name) : IM_COL32(160, 160, 160, 255));
+		if (w > 20) {
+			dl->PushClipRect(a, b, true);
+			dl->AddText(ImVec2(x + 3, y + (row - ImGui::GetFontSize()) * 0.5f), IM_COL32_BLACK, name);
+			dl->PopClipRect();
+		}
+		if (ImGui::IsWindowHovered() && ImGui::IsMouseHoveringRect(a, b)) {
+			double focus = tree[tree_focus].total;
+			ImGui::SetTooltip("%s\nTotal : %.3f ms (%.1f%%)\nOwn : %.3f ms\nCalls : %.1f\n%s:%i", name, t.total,
+				focus > 0 ? t.total * 100.0 / focus : 0.0, t.own, t.calls,
+				t.zone && t.zone->file ? t.zone->file : "", t.zone ? t.zone->line : 0);
+			if (ImGui::IsMouseClicked(ImGuiMouseButton_Left)) tree_focus = n;
+		}
+
+		float bottom = y + row;
+		for (uint32_t c : t.children) {
+			float cw = t.total > 0 ? w * float(tree[c].total / t.total) : 0;
+			bottom = std::max(bottom, draw_node(dl, c, x, y + row, cw, row));
+			x += cw;
+		}
+		return bottom;
+	}
+	void draw_tree() {
+		ImGui::SetNextItemWidth(150);
+		ImGui::SliderInt("##tree_frames", &tree_frames, 1, prof::HISTORY_LEN, "avg of %i frames");
+		ImGui::SameLine();
+		if (ImGui::Button("Reset zoom")) tree_focus = 0;
+		ImGui::SameLine();
+		ImGui::TextDisabled("click to zoom in");
+		if (tree.empty()) return;
+
+		// path to the focused node
+		std::vector<uint32_t> path;
+		for (uint32_t n = tree_focus; n; n = tree[n].parent) path.push_back(n);
+		for (auto it = path.rbegin(); it != path.rend(); it++) {
+			ImGui::SameLine();
+			ImGui::Text("> %s", tree[*it].zone ? tree[*it].zone->name : "?");
+		}
+
+		ImGui::BeginChild("##flame", ImVec2(0, 0), ImGuiChildFlags_None, ImGuiWindowFlags_HorizontalScrollbar);
+		ImDrawList* dl = ImGui::GetWindowDrawList();
+		ImVec2 pos = ImGui::GetCursorScreenPos();
+		float width = ImGui::GetContentRegionAvail().x;
+		float row = ImGui::GetFrameHeight();
+		float bottom = draw_node(dl, tree_focus, pos.x, pos.y, width, row);
+		ImGui::Dummy(ImVec2(width, bottom - pos.y)); // scroll area
+		ImGui::EndChild();
+	}
+	/** from the last complete window. Changes once per HIST_WINDOW frames */
+	void read_percentiles() {
+		size_t pos = (history_pos + prof::HISTORY_LEN - (history_pos + 1) % prof::HIST_WINDOW) % prof::HISTORY_LEN;
+		prof::HistoryView view(history, pos);
+		if (view.version() == window_version) return;
+
+		percentiles.assign(prof::zones_count(), Percentiles{});
+		for (size_t i = 0; i < view.size(); i++) {
+			uint32_t id = view.zone_id(i);
+			if (id >= percentiles.size()) continue;
+			for (int j = 0; j < 3; j++) percentiles[id][j] = view.percentile(i, PERCENTILES[j]);
+		}
+		window_version = view.valid() ? view.version() : 1;
+	}
 	void call_plotter() {
 	ImDrawList *draw_list = ImGui::GetWindowDrawList();
 	const ImVec2 pos = ImGui::GetCursorScreenPos();
@@ -140,13 +428,13 @@ static class Profiler : public UIInstance {
 
 	for (int i = 0; i < (int)prof::history_size(); i++) {
 		ImVec2 p = pos;
-		p.x += i * per_item;
+		p.x += ((i - (int)history_pos - 1 + (int)prof::history_size()) % (int)prof::history_size()) * per_item; // oldest on the left
 		const float range = scr.y - 5;
 		//p.y = range;
 
 		for (auto item : data[i]) {
 			float item_v = (item.second.owntime / max_v) * range;
-			draw_list->AddRectFilled(ImVec2(p.x, p.y), ImVec2(p.x + per_item, p.y + item_v), get_str_color(*item.first));
+			draw_list->AddRectFilled(ImVec2(p.x, p.y), ImVec2(p.x + per_item, p.y + item_v), get_str_color(item.first->name));
 			p.y += item_v;
 		}
 	}
@@ -178,8 +466,57 @@ void operator()(int) override {
 	if (!pause) ImGui::EndDisabled();
 	ImGui::SameLine();
 
-	if (ImGui::Button((std::string("Force short stats :") + (force_short_stats? "[+]" : "[-]")).c_str())) {
-		force_short_stats = !force_short_stats;
+	// trace mode
+	bool tracing = prof::is_tracing();
+	if (ImGui::Checkbox("Trace", &tracing)) prof::set_tracing(tracing);
+	ImGui::SameLine();
+	ImGui::SetNextItemWidth(120);
+	ImGui::SliderFloat("##trace_window", &trace_window, 1, 60, "last %.0f s");
+	ImGui::SameLine();
+	if (!tracing) ImGui::BeginDisabled();
+	if (ImGui::Button("Export trace")) {
+		char path[64];
+		snprintf(path, sizeof(path), "trace_%lld.json", (long long)time(nullptr));
+		prof::export_trace(path, trace_window);
+	}
+	if (!tracing) ImGui::EndDisabled();
+	if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+		ImGui::SetTooltip("Chrome trace JSON : open in ui.perfetto.dev. F9 exports last 10 s");
+	ImGui::SameLine();
+
+	bool perf_counters = prof::is_perf_counters();
+	if (ImGui::Checkbox("Perf counters", &perf_counters)) prof::set_perf_counters(perf_counters);
+	if (ImGui::IsItemHovered()) ImGui::SetTooltip("perf_event_open() counters per zone. Costs a syscall per zone call!");
+	ImGui::SameLine();
+
+	bool alloc_tracking = prof::is_alloc_tracking();
+	if (ImGui::Checkbox("Allocs", &alloc_tracking)) prof::set_alloc_tracking(alloc_tracking);
+	if (ImGui::IsItemHovered()) ImGui::SetTooltip("Count operator new/delete in the zones (own, without subzones)");
+	ImGui::SameLine();
+
+	bool sampling = prof::is_sampling();
+	if (ImGui::Checkbox("Sampling", &sampling)) prof::set_sampling(sampling);
+	if (ImGui::IsItemHovered()) ImGui::SetTooltip("SIGPROF backtraces every 1 ms of thread CPU time. See 'Samples' tab");
+
+	// spike detector
+	prof::SpikeConfig spikes = prof::get_spike_detector();
+	bool detect = spikes.budget > 0 || spikes.ratio > 0;
+	bool changed = ImGui::Checkbox("Spikes", &detect);
+	if (ImGui::IsItemHovered()) ImGui::SetTooltip("Writes frames around the slow frames to spike_*.json (and the trace, if it is on)");
+	ImGui::SameLine();
+	ImGui::SetNextItemWidth(120);
+	changed |= ImGui::SliderFloat("##spike_budget", &spike_budget, 1, 200, "> %.0f ms");
+	ImGui::SameLine();
+	ImGui::SetNextItemWidth(120);
+	changed |= ImGui::SliderFloat("##spike_ratio", &spike_ratio, 1.5, 10, "or > %.1fx median");
+	if (changed) {
+		spikes.budget = detect ? spike_budget / 1000.0 : 0;
+		spikes.ratio = detect ? spike_ratio : 0;
+		prof::set_spike_detector(spikes);
+	}
+	if (size_t count = prof::spikes_count()) {
+		ImGui::SameLine();
+		ImGui::Text("%zu spikes, last : %s", count, prof::last_spike_path().c_str());
 	}
 
 	// get data
@@ -192,9 +529,7 @@ void operator()(int) override {
 			std::string str("Thread ");
 			str += id_to_string(v);
 			if (ImGui::Selectable(str.c_str(), v == current_thread)) {
-				current_thread = v;
-				need_refresh = true;
-				history_pos = 0;
+				select_thread(v);
 			}
 		}
 		ImGui::EndChild();
@@ -213,29 +548,123 @@ void operator()(int) override {
 		ImGui::Separator();
 		if (ImGui::BeginTabBar("##Tabs", ImGuiTabBarFlags_None)) {
 			if (ImGui::BeginTabItem("Calls List")) {
-				short_stats = true;
-				if (ImGui::BeginTable("##split", 4, ImGuiTableFlags_BordersOuter | ImGuiTableFlags_Resizable | ImGuiTableFlags_ScrollY)) {
+				if (ImGui::BeginTable("##split", 10, ImGuiTableFlags_BordersOuter | ImGuiTableFlags_Resizable | ImGuiTableFlags_ScrollY)) {
 					ImGui::TableSetupScrollFreeze(0, 1);
 					ImGui::TableSetupColumn("Zone name");
 					ImGui::TableSetupColumn("Total time");
 					ImGui::TableSetupColumn("Own time");
 					ImGui::TableSetupColumn("Call count");
+					ImGui::TableSetupColumn("p50, ms");
+					ImGui::TableSetupColumn("p95, ms");
+					ImGui::TableSetupColumn("p99, ms");
+					ImGui::TableSetupColumn("Allocs");
+					ImGui::TableSetupColumn("Alloc KiB");
+					ImGui::TableSetupColumn("Frees");
 					ImGui::TableHeadersRow();
 
 					// Iterate placeholder objects (all the same data)
-					add_calltable_row(zones);
+					add_calltable_row(zones, percentiles);
 
 					ImGui::EndTable();
 				}
 				ImGui::EndTabItem();
 			}
 			if (ImGui::BeginTabItem("Plotter")) {
-				short_stats = false;
 				ImGui::TextWrapped("Pause and see 'Call list' for associated colors");
 				call_plotter();
 
 				ImGui::EndTabItem();
 			}
+			if (ImGui::BeginTabItem("Values")) {
+				draw_values();
+				ImGui::EndTabItem();
+			}
+			if (ImGui::BeginTabItem("Call Tree")) {
+				draw_tree();
+				ImGui::EndTabItem();
+			}
+			if (ImGui::BeginTabItem("Counters")) {
+				if (perf_kind == prof::PerfKind::NONE) {
+					ImGui::TextWrapped("No perf counters in this thread : enable 'Perf counters' above");
+				} else if (ImGui::BeginTable("##perf", perf_kind == prof::PerfKind::HARDWARE ? 6 : 5,
+						ImGuiTableFlags_BordersOuter | ImGuiTableFlags_Resizable | ImGuiTableFlags_ScrollY)) {
+					ImGui::TableSetupScrollFreeze(0, 1);
+					ImGui::TableSetupColumn("Zone name");
+					ImGui::TableSetupColumn("Call count");
+					if (perf_kind == prof::PerfKind::HARDWARE) {
+						ImGui::TableSetupColumn("IPC");
+						ImGui::TableSetupColumn("L1D miss/call");
+						ImGui::TableSetupColumn("LLC miss/call");
+						ImGui::TableSetupColumn("Branch miss/call");
+					} else { // no hardware events : software ones
+						ImGui::TableSetupColumn("Task clock ms/call");
+						ImGui::TableSetupColumn("Page faults/call");
+						ImGui::TableSetupColumn("Ctx switches/call");
+					}
+					ImGui::TableHeadersRow();
+					add_perftable_rows(perf_rows, perf_kind);
+					ImGui::EndTable();
+				}
+				ImGui::EndTabItem();
+			}
+			if (ImGui::BeginTabItem("Samples")) {
+				if (!pause || need_refresh || samples.empty()) {
+					PROFILING_SCOPE_X("Prof_get_samples", prof);
+					prof::get_samples(samples);
+					samples_total = 0;
+					for (auto& s : samples) samples_total += s.count;
+				}
+				ImGui::Text("%llu samples, all threads", (unsigned long long)samples_total);
+				ImGui::SameLine();
+				if (ImGui::Button("Clear")) {
+					prof::clear_samples();
+					samples.clear();
+					samples_total = 0;
+				}
+				ImGui::SameLine();
+				if (ImGui::Button("Export folded stacks")) {
+					char path[64];
+					snprintf(path, sizeof(path), "samples_%lld.folded", (long long)time(nullptr));
+					prof::export_folded(path);
+				}
+				if (ImGui::IsItemHovered()) ImGui::SetTooltip("For flamegraph.pl or speedscope.app");
+				if (ImGui::BeginTable("##samples", 4, ImGuiTableFlags_BordersOuter | ImGuiTableFlags_Resizable | ImGuiTableFlags_ScrollY)) {
+					ImGui::TableSetupScrollFreeze(0, 1);
+					ImGui::TableSetupColumn("Zone name");
+					ImGui::TableSetupColumn("Function");
+					ImGui::TableSetupColumn("Samples");
+					ImGui::TableSetupColumn("Share");
+					ImGui::TableHeadersRow();
+					add_sampletable_rows(samples, samples_total);
+					ImGui::EndTable();
+				}
+				ImGui::EndTabItem();
+			}
+			if (ImGui::BeginTabItem("Memory")) {
+				if (ImGui::BeginTable("##memory", 3, ImGuiTableFlags_BordersOuter | ImGuiTableFlags_Resizable | ImGuiTableFlags_ScrollY)) {
+					ImGui::TableSetupScrollFreeze(0, 1);
+					ImGui::TableSetupColumn("Memory tag");
+					ImGui::TableSetupColumn("Used");
+					ImGui::TableSetupColumn("Blocks");
+					ImGui::TableHeadersRow();
+					add_memtable_rows();
+					ImGui::EndTable();
+				}
+				ImGui::EndTabItem();
+			}
+			if (ImGui::BeginTabItem("Locks")) {
+				if (ImGui::BeginTable("##locks", 4, ImGuiTableFlags_BordersOuter | ImGuiTableFlags_Resizable | ImGuiTableFlags_ScrollY)) {
+					ImGui::TableSetupScrollFreeze(0, 1);
+					ImGui::TableSetupColumn("Lock");
+					ImGui::TableSetupColumn("Contended");
+					ImGui::TableSetupColumn("Waited");
+					ImGui::TableSetupColumn("Max wait");
+					ImGui::TableHeadersRow();
+					add_locktable_rows();
+					ImGui::EndTable();
+				}
+				ImGui::EndTabItem();
+			}
 			ImGui::EndTabBar();
 		}
 		ImGui::EndChild();
@@ -0,0 +1,556 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Sharded hash map with lock-free reads
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include "base.hpp"
+#include "hashmap.hpp"
+#include "memory.hpp"
+#include "sync.hpp"
+
+namespace pb {
+
+namespace impl {
+
+	/** writer locks of the shards of all maps. Made on the first use */
+	inline LockTag& shard_lock_tag() {
+		static LockTag tag("Lock::ConcurrentHashMap shard");
+		return tag;
+	}
+
+	/** trivially copyable type <-> machine word, to store it in the std::atomic */
+	template <typename T>
+	inline uint64_t to_word(const T& v) {
+		uint64_t w = 0;
+		memcpy(&w, &v, sizeof(T));
+		return w;
+	}
+
+	template <typename T>
+	inline T from_word(uint64_t w) {
+		T v;
+		memcpy(&v, &w, sizeof(T));
+		return v;
+	}
+
+};	// namespace impl
+
+/**
+ * Epoch based memory reclamation.
+ *
+ * Readers pin() current epoch while they use shared objects. Objects, that were
+ * unlinked from the shared structure, are retire()d instead of being deleted, and
+ * collect() deletes them when no reader from the epoch they were retired in is left.
+ *
+ * Only two epochs are alive at once : collect() does not advance the epoch while
+ * readers of the previous one are still there.
+ */
+class EpochReclaimer : public Static {
+	public:
+	using Deleter = void (*)(void*);
+
+	/** RAII pin. Objects retired while it is alive won't be deleted */
+	class Guard : public Moveable {
+		const EpochReclaimer* r = nullptr;
+		std::atomic<size_t>* counter = nullptr;
+		public:
+		Guard() = default;
+		Guard(const EpochReclaimer* src) : r(src) { counter = r->enter(); }
+		Guard(Guard&& src) : r(src.r), counter(src.counter) { src.r = nullptr; }
+		~Guard() { if (r) counter->fetch_sub(1, std::memory_order_release); }
+	};
+
+	protected:
+	struct Retired {
+		void* ptr;
+		Deleter del;
+	};
+
+	/** readers are counted per epoch parity, in few stripes, so reader threads don't fight for one cache line */
+	static constexpr size_t STRIPES = 8;
+	struct alignas(64) Readers {
+		std::atomic<size_t> n[2] = {0, 0};
+	};
+
+	mutable std::atomic<uint64_t> epoch = 0;
+	mutable Readers readers[STRIPES];
+	std::mutex lock;	// protects retired lists
+	std::vector<Retired> retired[2];	// retired in the epoch of this parity
+
+	static size_t stripe() {
+		static std::atomic<size_t> next = 0;
+		thread_local size_t v = next.fetch_add(1, std::memory_order_relaxed) % STRIPES;
+		return v;
+	}
+
+	std::atomic<size_t>* enter() const {
+		auto& r = readers[stripe()];
+		while (true) {
+			uint64_t e = epoch.load();
+			r.n[e & 1].fetch_add(1);
+			if (epoch.load() == e) return &r.n[e & 1];
+			r.n[e & 1].fetch_sub(1); // epoch changed under us, counter may be already checked
+		}
+	}
+
+	bool has_readers(unsigned parity) const {
+		for (auto& r : readers) {
+			if (r.n[parity].load() != 0) return true;
+		}
+		return false;
+	}
+
+	public:
+	EpochReclaimer() = default;
+	~EpochReclaimer() {
+		for (auto& list : retired) {
+			for (auto& v : list) v.del(v.ptr);
+		}
+	}
+
+	inline Guard pin() const { return Guard(this); }
+
+	/** delete object later, when no reader can see it anymore */
+	void retire(void* ptr, Deleter del) {
+		std::lock_guard l(lock);
+		retired[epoch.load() & 1].push_back(Retired{ptr, del});
+	}
+
+	template <typename T>
+	void retire(T* ptr) {
+		retire((void*)ptr, [](void* p) { delete (T*)p; });
+	}
+
+	/** deletes everything safe to delete, and advances the epoch if possible. Does not block */
+	void collect() {
+		std::vector<Retired> list;
+		{
+			std::lock_guard l(lock);
+			uint64_t e = epoch.load();
+			unsigned prev = unsigned((e + 1) & 1);
+			if (has_readers(prev)) return; // try again later
+			list.swap(retired[prev]);
+			epoch.store(e + 1); // readers of the new epoch go into the empty parity
+		}
+		for (auto& v : list) v.del(v.ptr);
+	}
+
+	/** count of objects waiting for deletion */
+	size_t pending() {
+		std::lock_guard l(lock);
+		return retired[0].size() + retired[1].size();
+	}
+};
+
+/**
+ * Hash map for many reader threads and rare writers.
+ *
+ * Keys are spread between SHARDS independent open addressing tables. Writers take
+ * the mutex of the shard, readers don't lock anything : they read the table optimistically
+ * and validate the result with the sequence counter of the shard (seqlock), retrying
+ * if writer touched the shard meanwhile.
+ *
+ * Keys and values must be trivially copyable, and not bigger than 8 bytes (coordinates, pointers,
+ * ids). Tables replaced by rehash are deleted through the EpochReclaimer of the map : values that
+ * are pointers may be retire()d the same way, so readers can keep using them under pin().
+ *
+ * Shards shrink by themselves, when less than 1/8 of the buckets is used after erase.
+ */
+template <typename KeyT, typename ValueT, typename HashT = Hash<KeyT>, size_t SHARDS = 16, typename AllocT = MallocAllocator>
+class ConcurrentHashMap : public Static {
+	static_assert(std::is_trivially_copyable_v<KeyT> && sizeof(KeyT) <= sizeof(uint64_t));
+	static_assert(std::is_trivially_copyable_v<ValueT> && sizeof(ValueT) <= sizeof(uint64_t));
+	static_assert(SHARDS > 0 && (SHARDS & (SHARDS - 1)) == 0, "SHARDS must be power of two");
+
+	protected:
+	/** Robin Hood table, the same as HashMap one, but with atomic slots. dist = 0 means empty bucket */
+	struct Table {
+		struct Slot {
+			std::atomic<uint64_t> key;
+			std::atomic<uint64_t> value;
+			std::atomic<uint32_t> dist;	// distance from home bucket + 1
+		};
+		size_t mask;
+		Slot*  slots;
+		[[no_unique_address]] AllocT alloc;
+
+		Table(size_t num_buckets, const AllocT& src) : mask(num_buckets - 1), alloc(src) {
+			slots = (Slot*)alloc.allocate(num_buckets * sizeof(Slot));
+			if (!slots) throw std::bad_alloc();
+			for (size_t i = 0; i <= mask; i++) {
+				new(slots + i) Slot();
+				slots[i].dist.store(0, std::memory_order_relaxed);
+			}
+		}
+		~Table() { alloc.deallocate(slots, (mask + 1) * sizeof(Slot)); } // Slot is trivially destructible
+
+		size_t memory_usage() const { return sizeof(Table) + (mask + 1) * sizeof(Slot); }
+	};
+
+	struct alignas(64) Shard {
+		mutable TaggedMutex lock{impl::shard_lock_tag()};	// writers only
+		std::atomic<uint32_t> seq = 0;	// odd while writer changes the table
+		std::atomic<Table*> table = nullptr;
+		std::atomic<size_t> count = 0;
+	};
+
+	HashT _hasher;
+	[[no_unique_address]] AllocT _alloc;
+	Shard _shards[SHARDS];
+	EpochReclaimer _reclaimer;
+
+	static constexpr size_t MIN_BUCKETS = 16;
+	static constexpr int SHARD_SHIFT = std::countr_zero(SHARDS);
+
+	public:
+	using Guard = EpochReclaimer::Guard;
+
+	ConcurrentHashMap() = default;
+	explicit ConcurrentHashMap(const AllocT& alloc) : _alloc(alloc) {}
+	~ConcurrentHashMap() {
+		for (auto& s : _shards) delete s.table.load();
+	}
+
+	/** pin, to use values after the lookup. See EpochReclaimer */
+	inline Guard pin() const { return _reclaimer.pin(); }
+
+	/** delete value later, when no reader may see it anymore */
+	template <typename T>
+	void retire(T* ptr) { _reclaimer.retire(ptr); }
+
+	/** deletes retired tables and values, when it's safe. Call from time to time */
+	void collect() { _reclaimer.collect(); }
+
+	/** lock-free. Returns false if there is no such key */
+	bool find(const KeyT& key, ValueT& out) const {
+		size_t hash = _hasher(key);
+		const Shard& s = shard(hash);
+		uint64_t k = impl::to_word(key);
+		Guard g = pin();
+		while (true) {
+			uint32_t seq = s.seq.load(std::memory_order_acquire);
+			if (seq & 1) { // writer is there
+				impl::cpu_relax();
+				continue;
+			}
+			uint64_t v = 0;
+			bool found = false;
+			const Table* t = s.table.load(std::memory_order_acquire);
+			if (t) found = probe(t, hash, k, v);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (s.seq.load(std::memory_order_relaxed) == seq) {
+				if (found) out = impl::from_word<ValueT>(v);
+				return found;
+			}
+		}
+	}
+
+	/** lock-free. Returns value or default one */
+	ValueT get_or_return_default(const KeyT& key) const {
+		ValueT v = ValueT();
+		find(key, v);
+		return v;
+	}
+
+	bool contains(const KeyT& key) const {
+		ValueT v;
+		return find(key, v);
+	}
+
+	/** returns false if key already exists (and does nothing then) */
+	bool insert(const KeyT& key, const ValueT& value) {
+		size_t hash = _hasher(key);
+		Shard& s = shard(hash);
+		std::lock_guard l(s.lock);
+		uint64_t k = impl::to_word(key);
+		if (find_bucket(s.table.load(std::memory_order_relaxed), hash, k) != (size_t)-1) return false;
+		WriteSection w(s);
+		insert_new(s, hash, k, impl::to_word(value));
+		return true;
+	}
+
+	void insert_or_assign(const KeyT& key, const ValueT& value) {
+		size_t hash = _hasher(key);
+		Shard& s = shard(hash);
+		std::lock_guard l(s.lock);
+		WriteSection w(s);
+		size_t bucket = find_bucket(s.table.load(std::memory_order_relaxed), hash, impl::to_word(key));
+		if (bucket != (size_t)-1) {
+			s.table.load(std::memory_order_relaxed)->slots[bucket].value.store(impl::to_word(value), std::memory_order_relaxed);
+		} else {
+			insert_new(s, hash, impl::to_word(key), impl::to_word(value));
+		}
+	}
+
+	/** returns false if there was no such key. Old value is written into old, if not null */
+	bool erase(const KeyT& key, ValueT* old = nullptr) {
+		size_t hash = _hasher(key);
+		Shard& s = shard(hash);
+		std::lock_guard l(s.lock);
+		Table* t = s.table.load(std::memory_order_relaxed);
+		size_t bucket = find_bucket(t, hash, impl::to_word(key));
+		if (bucket == (size_t)-1) return false;
+		if (old) *old = impl::from_word<ValueT>(t->slots[bucket].value.load(std::memory_order_relaxed));
+		WriteSection w(s);
+		erase_bucket(s, t, bucket);
+		if (is_sparse(s, t)) shrink(s, t);
+		return true;
+	}
+
+	/**
+	 * Erases all elements, for which pred(const KeyT&, ValueT&) returns true.
+	 * Every element is visited exactly once. Predicate may change the value, and must not touch this map.
+	 * Shards are processed one by one, so lookups of other shards are not blocked.
+	 * Returns count of erased elements.
+	 */
+	template <typename F>
+	size_t erase_if(F&& pred) {
+		size_t erased = 0;
+		for (auto& s : _shards) {
+			std::lock_guard l(s.lock);
+			Table* t = s.table.load(std::memory_order_relaxed);
+			if (!t) continue;
+
+			// start right after the empty bucket : elements are never moved back over it,
+			// so erasing never brings already visited element in front of us
+			size_t start = 0;
+			while (t->slots[start].dist.load(std::memory_order_relaxed) != 0) start++;
+
+			for (size_t n = 0; n <= t->mask;) {
+				size_t i = (start + 1 + n) & t->mask;
+				auto& slot = t->slots[i];
+				if (slot.dist.load(std::memory_order_relaxed) == 0) {
+					n++;
+					continue;
+				}
+				KeyT key = impl::from_word<KeyT>(slot.key.load(std::memory_order_relaxed));
+				ValueT value = impl::from_word<ValueT>(slot.value.load(std::memory_order_relaxed));
+				bool del = pred(static_cast<const KeyT&>(key), value);
+				if (del) {
+					WriteSection w(s);
+					erase_bucket(s, t, i);
+					erased++;
+					// next element may be shifted in here, look at the same bucket again
+				} else {
+					if (impl::to_word(value) != slot.value.load(std::memory_order_relaxed)) {
+						WriteSection w(s);
+						slot.value.store(impl::to_word(value), std::memory_order_relaxed);
+					}
+					n++;
+				}
+			}
+			if (is_sparse(s, t)) {
+				WriteSection w(s);
+				shrink(s, t);
+			}
+		}
+		return erased;
+	}
+
+	/** calls f(const KeyT&, const ValueT&) for every element. Shard is locked for writers meanwhile */
+	template <typename F>
+	void for_each(F&& f) const {
+		for (auto& s : _shards) {
+			std::lock_guard l(s.lock);
+			const Table* t = s.table.load(std::memory_order_relaxed);
+			if (!t) continue;
+			for (size_t i = 0; i <= t->mask; i++) {
+				auto& slot = t->slots[i];
+				if (slot.dist.load(std::memory_order_relaxed) == 0) continue;
+				f(impl::from_word<KeyT>(slot.key.load(std::memory_order_relaxed)),
+					impl::from_word<ValueT>(slot.value.load(std::memory_order_relaxed)));
+			}
+		}
+	}
+
+	size_t size() const {
+		size_t n = 0;
+		for (auto& s : _shards) n += s.count.load(std::memory_order_relaxed);
+		return n;
+	}
+
+	bool empty() const { return size() == 0; }
+
+	/** bytes of the current tables. Retired ones, that are not deleted yet, are not counted */
+	size_t memory_usage() const {
+		size_t n = sizeof(*this);
+		for (auto& s : _shards) {
+			std::lock_guard l(s.lock);
+			const Table* t = s.table.load(std::memory_order_relaxed);
+			if (t) n += t->memory_usage();
+		}
+		return n;
+	}
+
+	/** removes everything. Values are NOT retired, do that yourself if needed */
+	void clear() {
+		for (auto& s : _shards) {
+			std::lock_guard l(s.lock);
+			Table* t = s.table.load(std::memory_order_relaxed);
+			if (!t) continue;
+			WriteSection w(s);
+			s.table.store(nullptr, std::memory_order_release);
+			s.count.store(0, std::memory_order_relaxed);
+			_reclaimer.retire(t);
+		}
+	}
+
+	protected:
+	/** bumps sequence counter of the shard around the changes. Shard lock must be held */
+	struct WriteSection {
+		Shard& s;
+		uint32_t seq;
+		WriteSection(Shard& src) : s(src) {
+			seq = s.seq.load(std::memory_order_relaxed);
+			s.seq.store(seq + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+		}
+		~WriteSection() { s.seq.store(seq + 2, std::memory_order_release); }
+	};
+
+	/** highest bits choose the shard, lowest - the bucket */
+	static inline size_t shard_index(size_t hash) { return SHARDS == 1 ? 0 : size_t(uint64_t(hash) >> (64 - SHARD_SHIFT)); }
+	inline Shard& shard(size_t hash) { return _shards[shard_index(hash)]; }
+	inline const Shard& shard(size_t hash) const { return _shards[shard_index(hash)]; }
+
+	/** reader side. Table may change under our feet : never trust it, never loop forever */
+	static bool probe(const Table* t, size_t hash, uint64_t key, uint64_t& out) {
+		size_t bucket = hash & t->mask;
+		for (uint32_t dist = 1; dist <= t->mask + 1; dist++, bucket = (bucket + 1) & t->mask) {
+			auto& slot = t->slots[bucket];
+			uint32_t d = slot.dist.load(std::memory_order_relaxed);
+			if (d < dist) return false; // empty or richer one : our key would be here
+			if (slot.key.load(std::memory_order_relaxed) == key) {
+				out = slot.value.load(std::memory_order_relaxed);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/** writer side, shard lock must be held */
+	static size_t find_bucket(const Table* t, size_t hash, uint64_t key) {
+		if (!t) return (size_t)-1;
+		size_t bucket = hash & t->mask;
+		for (uint32_t dist = 1;; dist++, bucket = (bucket + 1) & t->mask) {
+			auto& slot = t->slots[bucket];
+			if (slot.dist.load(std::memory_order_relaxed) < dist) return (size_t)-1;
+			if (slot.key.load(std::memory_order_relaxed) == key) return bucket;
+		}
+	}
+
+	/** Robin Hood insert of the new key. Inside of WriteSection */
+	void insert_new(Shard& s, size_t hash, uint64_t key, uint64_t value) {
+		Table* t = s.table.load(std::memory_order_relaxed);
+		size_t count = s.count.load(std::memory_order_relaxed) + 1;
+		if (!t || count + count / 2 > t->mask + 1) t = grow(s, t);
+
+		size_t bucket = hash & t->mask;
+		uint32_t dist = 1;
+		while (true) {
+			auto& slot = t->slots[bucket];
+			uint32_t d = slot.dist.load(std::memory_order_relaxed);
+			if (d == 0) {
+				slot.key.store(key, std::memory_order_relaxed);
+				slot.value.store(value, std::memory_order_relaxed);
+				slot.dist.store(dist, std::memory_order_relaxed);
+				break;
+			}
+			if (d < dist) { // take the place, and carry evicted element further
+				uint64_t k = slot.key.load(std::memory_order_relaxed);
+				uint64_t v = slot.value.load(std::memory_order_relaxed);
+				slot.key.store(key, std::memory_order_relaxed);
+				slot.value.store(value, std::memory_order_relaxed);
+				slot.dist.store(dist, std::memory_order_relaxed);
+				key = k, value = v, dist = d;
+			}
+			bucket = (bucket + 1) & t->mask;
+			dist++;
+		}
+		s.count.store(count, std::memory_order_relaxed);
+	}
+
+	/** backward shift erase. Inside of WriteSection */
+	void erase_bucket(Shard& s, Table* t, size_t bucket) {
+		while (true) {
+			size_t next = (bucket + 1) & t->mask;
+			auto& src = t->slots[next];
+			uint32_t d = src.dist.load(std::memory_order_relaxed);
+			if (d <= 1) break; // empty or at home
+			auto& dst = t->slots[bucket];
+			dst.key.store(src.key.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			dst.value.store(src.value.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			dst.dist.store(d - 1, std::memory_order_relaxed);
+			bucket = next;
+		}
+		t->slots[bucket].dist.store(0, std::memory_order_relaxed);
+		s.count.store(s.count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+	}
+
+	/** new table of double size is published, old one is retired. Inside of WriteSection */
+	Table* grow(Shard& s, Table* old) {
+		return resize(s, old, old ? (old->mask + 1) * 2 : MIN_BUCKETS);
+	}
+
+	/** less than 1/8 of the table is used */
+	static bool is_sparse(const Shard& s, const Table* t) {
+		return t && t->mask + 1 > MIN_BUCKETS && s.count.load(std::memory_order_relaxed) * 8 < t->mask + 1;
+	}
+
+	/** rebuilds the table to fit the elements. Inside of WriteSection */
+	void shrink(Shard& s, Table* t) {
+		size_t count = s.count.load(std::memory_order_relaxed);
+		if (count == 0) {
+			s.table.store(nullptr, std::memory_order_relaxed);
+			_reclaimer.retire(t);
+			return;
+		}
+		size_t num_buckets = MIN_BUCKETS;
+		while (num_buckets < count + count / 2 + 1) num_buckets *= 2;
+		resize(s, t, num_buckets);
+	}
+
+	/** new table is published, old one is retired. Inside of WriteSection */
+	Table* resize(Shard& s, Table* old, size_t num_buckets) {
+		Table* t = new Table(num_buckets, _alloc);
+		size_t count = s.count.load(std::memory_order_relaxed);
+		s.table.store(t, std::memory_order_release); // initialized table. Readers will retry anyway
+		s.count.store(0, std::memory_order_relaxed);
+		if (old) {
+			for (size_t i = 0; i <= old->mask; i++) {
+				auto& slot = old->slots[i];
+				if (slot.dist.load(std::memory_order_relaxed) == 0) continue;
+				size_t hash = _hasher(impl::from_word<KeyT>(slot.key.load(std::memory_order_relaxed)));
+				insert_new(s, hash, slot.key.load(std::memory_order_relaxed), slot.value.load(std::memory_order_relaxed));
+			}
+			_reclaimer.retire(old);
+		}
+		assert(s.count.load(std::memory_order_relaxed) == count);
+		(void)count;
+		return t;
+	}
+};
+
+};	// namespace pb
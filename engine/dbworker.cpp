@@ -0,0 +1,328 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Asynchronous database : writer thread with batched transactions, reader threads
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "dbworker.hpp"
+
+#include <cstdio>
+#include <string>
+
+#define PROFILER_DEFINE_EXT
+#include "profiler.hpp"
+#include "doctest.h"
+#include "printf.h"
+
+namespace pb {
+
+bool DatabaseWorker::open(sqlite::Database& db, bool readonly) {
+	db = sqlite::connect_or_create(path.c_str());
+	if (!db) return false;
+	sqlite3_busy_timeout(db, cfg.busy_timeout_ms);
+
+	char sql[64];
+	snprintf_(sql, sizeof(sql), "PRAGMA cache_size = -%i", cfg.cache_kib);
+	db.execute(sql).supress();
+	if (readonly) return db.execute("PRAGMA query_only = 1") == SQLITE_DONE;
+
+	std::string mode;
+	sqlite::CachedStatement stmt;
+	if (db.prepare("PRAGMA journal_mode = WAL", stmt).check() && stmt.iterate() == SQLITE_ROW)
+		mode = stmt.result().get<std::string>(0);
+	stmt.give_back();
+	if (mode != "wal") LOG_WARN("Database %s : journal mode is %s, not WAL", path.c_str(), mode.c_str());
+	snprintf_(sql, sizeof(sql), "PRAGMA synchronous = %s", cfg.synchronous);
+	return db.execute(sql) == SQLITE_DONE;
+}
+
+bool DatabaseWorker::init(const char* p, const DatabaseConfig& c) {
+	uninit();
+	path = p;
+	cfg = c;
+	if (cfg.max_batch < 1) cfg.max_batch = 1;
+	if (!open(writer, false)) {
+		LOG_ERROR("Can't open database %s : %s", p, writer ? sqlite3_errmsg(writer) : "?");
+		writer.close();
+		return false;
+	}
+	// up front : a reader without the connection would fail all it's jobs
+	reader_dbs.resize(cfg.readers);
+	for (auto& db : reader_dbs) {
+		if (open(db, true)) continue;
+		LOG_ERROR("Can't open database %s for reading : %s", p, db ? sqlite3_errmsg(db) : "?");
+		reader_dbs.clear();
+		writer.close();
+		return false;
+	}
+
+	stop = false;
+	writer_dead = false;
+	writer_thread = std::thread([this]() { writer_main(); });
+	for (int i = 0; i < cfg.readers; i++) {
+		reader_threads.emplace_back([this, i]() { reader_main(i); });
+	}
+	return true;
+}
+
+void DatabaseWorker::uninit() {
+	if (!writer_thread.joinable()) return;
+	stop = true;
+	write_signal.fetch_add(1, std::memory_order_release);
+	write_signal.notify_all();
+	read_signal.fetch_add(1, std::memory_order_release);
+	read_signal.notify_all();
+	writer_thread.join(); // after all the writes
+	for (auto& t : reader_threads) t.join();
+	reader_threads.clear();
+	reader_dbs.clear();
+
+	ReadJob* job;
+	while (reads.try_pop(job)) delete job; // their futures get broken_promise
+	std::vector<WriteJob*> none;
+	fail_writes(none); // only if the writer is dead
+	writer.close();
+}
+
+std::future<bool> DatabaseWorker::write(WriteFunc fn) {
+	WriteJob* job = new WriteJob{std::move(fn), {}};
+	std::future<bool> result = job->done.get_future();
+	write_pending.fetch_add(1, std::memory_order_relaxed);
+	// full queue : the writer is far behind. Wait for it, writes can't be dropped
+	for (uint32_t n = 0; !writes.try_push(job); n++) {
+		if (writer_dead.load()) {
+			fail_write(job);
+			return result;
+		}
+		impl::spin_wait(n);
+	}
+	// pushed after the dead writer drained the queue : nobody else will
+	if (writer_dead.load()) {
+		std::vector<WriteJob*> none;
+		fail_writes(none);
+		return result;
+	}
+	write_signal.fetch_add(1, std::memory_order_release);
+	write_signal.notify_one();
+	return result;
+}
+
+void DatabaseWorker::push_read(ReadJob* job) {
+	for (uint32_t n = 0; !reads.try_push(job); n++) impl::spin_wait(n);
+	read_signal.fetch_add(1, std::memory_order_release);
+	read_signal.notify_one();
+}
+
+void DatabaseWorker::sync() {
+	write([](sqlite::Database&) { return true; }).wait();
+}
+
+/*
+ * Changes of the failed job (returned false, or threw : LOG_FATAL, raise())
+ * are rolled back to it's savepoint. If the commit itself fails, all jobs of
+ * the batch fail.
+ */
+void DatabaseWorker::run_batch(std::vector<WriteJob*>& batch) {
+	PROFILING_SCOPE("DB::Write batch");
+	std::vector<bool> ok(batch.size(), false);
+	bool began = writer.execute("BEGIN IMMEDIATE") == SQLITE_DONE;
+	if (began) {
+		for (size_t i = 0; i < batch.size(); i++) {
+			if (writer.execute("SAVEPOINT job") != SQLITE_DONE) continue;
+			try {
+				ok[i] = batch[i]->fn(writer);
+			} catch (...) {
+				LOG_ERROR("Database %s : write job failed!", path.c_str());
+				ok[i] = false;
+			}
+			if (!ok[i]) writer.execute("ROLLBACK TO job").supress();
+			writer.execute("RELEASE job").supress();
+		}
+	}
+	bool committed = began && writer.execute("COMMIT") == SQLITE_DONE;
+	if (!committed) {
+		LOG_ERROR("Database %s : batch of %zu writes failed : %s", path.c_str(), batch.size(), sqlite3_errmsg(writer));
+		if (began) writer.execute("ROLLBACK").supress();
+	}
+
+	// not pending anymore BEFORE the waiter wakes up
+	size_t count = batch.size();
+	write_pending.fetch_sub(count, std::memory_order_relaxed);
+	for (size_t i = 0; i < count; i++) {
+		batch[i]->done.set_value(committed && ok[i]);
+		delete batch[i];
+	}
+	batch.clear();
+	PROFILING_COUNTER("DB::Writes", count);
+}
+
+void DatabaseWorker::fail_write(WriteJob* job) {
+	write_pending.fetch_sub(1, std::memory_order_relaxed);
+	job->done.set_value(false);
+	delete job;
+}
+
+void DatabaseWorker::fail_writes(std::vector<WriteJob*>& batch) {
+	for (WriteJob* job : batch) fail_write(job);
+	batch.clear();
+	WriteJob* job;
+	while (writes.try_pop(job)) fail_write(job);
+}
+
+/*
+ * Signal is read BEFORE the last look into the queue : push after that look
+ * changes it, so wait() returns at once. No lost wakeups.
+ */
+void DatabaseWorker::writer_main() {
+	auto prof_ctx = prof::make_thread_data();
+	prof_ctx.master.set_name("DB writer");
+	std::vector<WriteJob*> batch;
+
+	try {
+		while (true) {
+			WriteJob* job;
+			while (batch.size() < cfg.max_batch && writes.try_pop(job)) batch.push_back(job);
+			if (!batch.empty()) {
+				PROFILING_GAUGE("DB::Write queue", pending_writes());
+				run_batch(batch); // clears it
+				continue;
+			}
+
+			uint32_t seen = write_signal.load(std::memory_order_acquire);
+			if (writes.try_pop(job)) {
+				batch.push_back(job);
+				continue;
+			}
+			if (stop.load(std::memory_order_acquire)) break; // everything is written
+			prof_ctx.master.step(); // going to sleep : flush stats
+			write_signal.wait(seen, std::memory_order_acquire);
+		}
+	} catch (...) {
+		LOG_ERROR("Database %s : writer thread failed!", path.c_str());
+		// BEFORE the drain : write() checks it after the push
+		writer_dead = true;
+		fail_writes(batch);
+	}
+}
+
+void DatabaseWorker::reader_main(int index) {
+	auto prof_ctx = prof::make_thread_data();
+	prof_ctx.master.set_name("DB reader");
+	sqlite::Database& db = reader_dbs[index];
+
+	try {
+		while (true) {
+			uint32_t seen = read_signal.load(std::memory_order_acquire);
+			ReadJob* job;
+			if (reads.try_pop(job)) {
+				std::unique_ptr<ReadJob> owned(job);
+				PROFILING_SCOPE("DB::Read");
+				job->fn(db); // packaged_task : exceptions of the job go into it's future
+				continue;
+			}
+			if (stop.load(std::memory_order_acquire)) break;
+			prof_ctx.master.step(); // going to sleep : flush stats
+			read_signal.wait(seen, std::memory_order_acquire);
+		}
+	} catch (...) {
+		LOG_ERROR("Database %s : reader %i failed!", path.c_str(), index);
+	}
+}
+
+TEST_CASE("DatabaseWorker") {
+	auto prof_ctx = prof::make_thread_data();
+	const char* path = "pb_test_dbworker.db";
+	auto cleanup = [path]() {
+		remove(path);
+		remove((std::string(path) + "-wal").c_str());
+		remove((std::string(path) + "-shm").c_str());
+	};
+	cleanup();
+
+	static DatabaseWorker db;
+	DatabaseConfig cfg;
+	cfg.max_batch = 16;
+	REQUIRE(db.init(path, cfg));
+	auto created = db.write([](sqlite::Database& d) {
+		return d.execute("CREATE TABLE t (k INTEGER PRIMARY KEY, v)") == SQLITE_DONE;
+	});
+
+	std::vector<std::future<bool>> results;
+	for (int i = 0; i < 100; i++) results.push_back(db.write([i](sqlite::Database& d) {
+		sqlite::CachedStatement stmt;
+		if (!d.prepare("INSERT INTO t(k, v) VALUES (?1, ?2)", stmt).check()) return false;
+		stmt.bind(i, i * 2);
+		return stmt.execute() == SQLITE_DONE;
+	}));
+	// fails after the insert : only it's own changes are rolled back
+	auto failed = db.write([](sqlite::Database& d) {
+		d.execute("INSERT INTO t(k, v) VALUES (1000, 0)").supress();
+		return false;
+	});
+	auto duplicate = db.write([](sqlite::Database& d) { return d.execute("INSERT INTO t(k, v) VALUES (5, 0)") == SQLITE_DONE; });
+	// LOG_FATAL in the job : it's changes are rolled back, the writer survives
+	auto fatal = db.write([](sqlite::Database& d) {
+		d.execute("INSERT INTO t(k, v) VALUES (1001, 0)").supress();
+		sqlite::CachedStatement stmt;
+		d.prepare("INSERT INTO nowhere VALUES (1)", stmt).raise();
+		return true;
+	});
+
+	REQUIRE(created.get());
+	for (auto& r : results) REQUIRE(r.get());
+	REQUIRE(!failed.get());
+	REQUIRE(!duplicate.get());
+	REQUIRE(!fatal.get());
+	db.sync();
+	REQUIRE(db.pending_writes() == 0);
+
+	auto count = [](sqlite::Database& d) {
+		sqlite::CachedStatement stmt;
+		if (!d.prepare("SELECT count(*), sum(v) FROM t", stmt).check() || stmt.iterate() != SQLITE_ROW) return -1;
+		return stmt.result().get<int>(0) * 100000 + stmt.result().get<int>(1);
+	};
+	std::vector<std::future<int>> reads;
+	for (int i = 0; i < 8; i++) reads.push_back(db.read(count));
+	for (auto& r : reads) REQUIRE(r.get() == 100 * 100000 + 9900);
+
+	db.uninit();
+	cleanup();
+}
+
+TEST_CASE("DatabaseWorker dead writer") {
+	// as if the writer thread failed with the job in it's batch and one in the queue
+	static struct : public DatabaseWorker {
+		void kill() {
+			std::vector<WriteJob*> batch;
+			writes.try_pop(batch.emplace_back());
+			writer_dead = true;
+			fail_writes(batch);
+		}
+	} db;
+	auto running = db.write([](sqlite::Database&) { return true; });
+	auto queued = db.write([](sqlite::Database&) { return true; });
+	db.kill();
+	REQUIRE(running.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+	REQUIRE(!running.get());
+	REQUIRE(!queued.get());
+	auto late = db.write([](sqlite::Database&) { return true; });
+	REQUIRE(late.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+	REQUIRE(!late.get());
+	db.sync(); // doesn't hang
+	REQUIRE(db.pending_writes() == 0);
+}
+
+};	// namespace pb
@@ -0,0 +1,131 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Asynchronous database : writer thread with batched transactions, reader threads
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "base.hpp"
+#include "raiisqlite.hpp"
+#include "sync.hpp"
+
+namespace pb {
+
+struct DatabaseConfig {
+	int readers = 2; // threads (and connections) for read()
+	const char* synchronous = "NORMAL"; // WAL + NORMAL : commits may be lost on power loss, but never corrupted
+	int cache_kib = 16 * 1024; // page cache of every connection
+	int busy_timeout_ms = 5000;
+	size_t max_batch = 256; // write jobs in one transaction
+};
+
+/**
+ * Database in WAL mode, that is never touched by the calling thread :
+ * write() jobs are executed by ONE writer thread. Everything that is queued
+ * when it wakes up goes into one transaction (one fsync), every job in it's
+ * own savepoint, so a failed job doesn't roll back the others.
+ * read() jobs are executed by the reader threads, each with it's own
+ * connection : WAL lets them read while the writer writes. They see only
+ * committed data.
+ *
+ * Queues are lock-free, so write()/read() never wait for the database.
+ * Results come back through the futures.
+ *
+ * Jobs may use Database::prepare() : every connection has it's own statement cache.
+ */
+class DatabaseWorker : public Static {
+ public:
+	/** write job. Return false to roll back it's changes */
+	using WriteFunc = std::function<bool(sqlite::Database&)>;
+
+ protected:
+	struct WriteJob {
+		WriteFunc fn;
+		std::promise<bool> done;
+	};
+	struct ReadJob {
+		std::function<void(sqlite::Database&)> fn;
+	};
+	static constexpr size_t QUEUE_LEN = 1024;
+
+	DatabaseConfig cfg;
+	std::string path;
+	BoundedQueue<WriteJob*, QUEUE_LEN> writes;
+	BoundedQueue<ReadJob*, QUEUE_LEN> reads;
+	// bumped after every push : threads sleep on them with atomic wait()
+	std::atomic<uint32_t> write_signal = 0;
+	std::atomic<uint32_t> read_signal = 0;
+	std::atomic<size_t> write_pending = 0; // queued or running
+	std::atomic<bool> stop = false;
+	std::atomic<bool> writer_dead = false; // writer thread failed : write() fails at once
+	sqlite::Database writer; // owned by the writer thread
+	std::vector<sqlite::Database> reader_dbs; // [i] is owned by the reader thread i
+	std::thread writer_thread;
+	std::vector<std::thread> reader_threads;
+
+ public:
+	DatabaseWorker() = default;
+	~DatabaseWorker() { uninit(); }
+
+	/** opens (or creates) the database and all the connections, and starts the threads. false on error */
+	bool init(const char* path, const DatabaseConfig& cfg = DatabaseConfig());
+
+	/** executes all queued writes, and stops the threads. No write()/read() while and after it! */
+	void uninit();
+
+	/**
+	 * queues the write job. Future is true, if the job succeeded AND it's transaction is committed.
+	 * If the writer thread is dead, future is false at once.
+	 */
+	std::future<bool> write(WriteFunc fn);
+
+	/** queues the read job. Future gets what it returns */
+	template <class F>
+	auto read(F&& fn) -> std::future<std::invoke_result_t<F&, sqlite::Database&>> {
+		using R = std::invoke_result_t<F&, sqlite::Database&>;
+		auto task = std::make_shared<std::packaged_task<R(sqlite::Database&)>>(std::forward<F>(fn));
+		auto result = task->get_future();
+		push_read(new ReadJob{[task](sqlite::Database& db) { (*task)(db); }});
+		return result;
+	}
+
+	/** waits, until everything written before is committed */
+	void sync();
+
+	/** write jobs, that are not committed yet */
+	size_t pending_writes() const { return write_pending.load(std::memory_order_relaxed); }
+
+ protected:
+	void push_read(ReadJob* job);
+	bool open(sqlite::Database& db, bool readonly);
+	void writer_main();
+	void reader_main(int index);
+	void run_batch(std::vector<WriteJob*>& batch);
+	void fail_write(WriteJob* job);
+	/** fails the batch and everything queued : nobody will run them */
+	void fail_writes(std::vector<WriteJob*>& batch);
+};
+
+};	// namespace pb
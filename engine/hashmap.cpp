@@ -0,0 +1,200 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Hash table tests
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "concurrent_hashmap.hpp"
+#include "hashmap.hpp"
+#include "random.h"
+#include "doctest.h"
+
+TEST_CASE("HashMap") {
+	pb::HashMap<uint32_t, uint32_t> map;
+	std::unordered_map<uint32_t, uint32_t> ref;
+	pb::RNG rng(12345);
+
+	// small key range : plenty of hits, misses, erases and reused buckets
+	for (int i = 0; i < 200000; i++) {
+		uint32_t key = uint32_t(rng.get()) % 4096;
+		switch (uint32_t(rng.get()) % 4) {
+			case 0: case 1:
+				map[key] = i;
+				ref[key] = i;
+				break;
+			case 2:
+				REQUIRE(map.erase(key) == (ref.erase(key) != 0));
+				break;
+			default: {
+				auto it = map.find(key);
+				auto rit = ref.find(key);
+				REQUIRE((it == map.end()) == (rit == ref.end()));
+				if (rit != ref.end()) REQUIRE(it->second == rit->second);
+			}
+		}
+		REQUIRE(map.size() == ref.size());
+	}
+
+	// erase while iterating
+	size_t cnt = 0;
+	for (auto it = map.begin(); it != map.end();) {
+		if (it->first & 1) {
+			REQUIRE(ref.erase(it->first) == 1);
+			it = map.erase(it);
+		} else {
+			++it;
+			cnt++;
+		}
+	}
+	REQUIRE(cnt == ref.size());
+	REQUIRE(map.size() == ref.size());
+	for (auto& [k, v] : ref) REQUIRE(map.get_or_return_default(k) == v);
+
+	// batched lookups and inserts agree with the sequential ones
+	std::vector<uint32_t> keys, values;
+	for (uint32_t k = 0; k < 5000; k++) {
+		keys.push_back(k);
+		values.push_back(k * 3);
+	}
+	size_t old_size = map.size();
+	size_t inserted = map.insert_many(keys.data(), values.data(), keys.size());
+	REQUIRE(map.size() == old_size + inserted);
+	std::vector<uint32_t*> found(keys.size());
+	REQUIRE(map.find_many(keys.data(), keys.size(), found.data()) == keys.size());
+	for (size_t i = 0; i < keys.size(); i++) {
+		REQUIRE(found[i] == map.try_get(keys[i]));
+		if (!ref.count(keys[i])) REQUIRE(*found[i] == values[i]);
+	}
+	uint32_t missing[] = {100000, 5, 200000};
+	std::vector<decltype(map)::iterator> its(3);
+	REQUIRE(map.find_many(missing, 3, its.data()) == 1);
+	REQUIRE((its[0] == map.end() && its[1] == map.find(5u) && its[2] == map.end()));
+	{ // bigger than PREFETCH_MIN : batches with the prefetches
+		pb::HashMap<uint32_t, uint32_t> big;
+		std::vector<uint32_t> big_keys;
+		for (uint32_t k = 0; k < 300000; k++) big_keys.push_back(k * 7);
+		big.insert_many(big_keys.data(), big_keys.data(), big_keys.size());
+		big_keys.push_back(1); // missing
+		std::vector<uint32_t*> big_found(big_keys.size());
+		REQUIRE(big.find_many(big_keys.data(), big_keys.size(), big_found.data()) == big_keys.size() - 1);
+		for (size_t i = 0; i < big_keys.size(); i++) REQUIRE(big_found[i] == big.try_get(big_keys[i]));
+	}
+
+	// memory accounting and shrinking
+	static pb::MemoryTag tag("test map");
+	{
+		pb::HashMap<uint32_t, uint32_t, pb::Hash<uint32_t>, pb::HashMapEqualTo<uint32_t>, pb::TaggedAllocator> tagged{pb::TaggedAllocator(tag)};
+		for (uint32_t k = 0; k < 100000; k++) tagged.insert(k, k);
+		REQUIRE(tag.blocks() == 1);
+		REQUIRE(tag.bytes() + sizeof(tagged) == tagged.memory_usage());
+		size_t big = tagged.memory_usage();
+		for (uint32_t k = 0; k < 100000; k++) {
+			if (k % 64) tagged.erase(k);
+		}
+		tagged.shrink_to_fit();
+		REQUIRE(tagged.memory_usage() * 16 < big);
+		REQUIRE(tag.bytes() + sizeof(tagged) == tagged.memory_usage());
+		for (uint32_t k = 0; k < 100000; k++) REQUIRE(tagged.contains(k) == (k % 64 == 0));
+		tagged.clear();
+		tagged.shrink_to_fit();
+		REQUIRE(tagged.bucket_count() == 0);
+		REQUIRE(!tagged.contains(0u));
+		tagged.insert(1, 1); // usable after that
+		REQUIRE(tagged.get_or_return_default(1u) == 1);
+
+		auto moved = std::move(tagged); // allocator goes with the buckets
+		REQUIRE(moved.get_or_return_default(1u) == 1);
+		REQUIRE(tagged.empty());
+		REQUIRE(tag.bytes() + sizeof(moved) == moved.memory_usage());
+		tagged.insert(2, 2); // old one is still usable, and counted
+		REQUIRE(tag.blocks() == 2);
+	}
+	REQUIRE(tag.bytes() == 0);
+	REQUIRE(tag.blocks() == 0);
+
+	pb::HashSet<std::string> set;
+	REQUIRE(set.insert("hello").second);
+	REQUIRE(!set.insert("hello").second);
+	REQUIRE(set.contains(std::string("hello")));
+	set.clear();
+	REQUIRE(set.empty());
+}
+
+TEST_CASE("ConcurrentHashMap") {
+	pb::ConcurrentHashMap<uint32_t, uint64_t> map;
+	std::atomic<bool> stop = false;
+	std::atomic<size_t> bad = 0;
+	auto value_of = [](uint32_t k) { return uint64_t(k) * 7 + 1; };
+
+	// readers must never see value, that was not written for this key
+	std::vector<std::thread> readers;
+	for (int i = 0; i < 3; i++) {
+		readers.emplace_back([&, i]() {
+			pb::RNG rng(i);
+			while (!stop.load()) {
+				uint32_t key = uint32_t(rng.get()) % 8192;
+				uint64_t v;
+				if (map.find(key, v)) {
+					if (v != value_of(key)) bad++;
+				}
+			}
+		});
+	}
+
+	std::unordered_map<uint32_t, uint64_t> ref;
+	pb::RNG rng(777);
+	for (int i = 0; i < 100000; i++) {
+		uint32_t key = uint32_t(rng.get()) % 8192;
+		if (rng.get() & 1) {
+			REQUIRE(map.insert(key, value_of(key)) == ref.emplace(key, value_of(key)).second);
+		} else {
+			REQUIRE(map.erase(key) == (ref.erase(key) != 0));
+		}
+		if (i % 1000 == 0) map.collect();
+	}
+	stop = true;
+	for (auto& t : readers) t.join();
+	REQUIRE(bad == 0);
+	REQUIRE(map.size() == ref.size());
+
+	// every element is visited once
+	size_t visited = 0;
+	size_t erased = map.erase_if([&](const uint32_t& k, uint64_t& v) {
+		visited++;
+		REQUIRE(v == value_of(k));
+		return (k & 1) != 0;
+	});
+	REQUIRE(visited == ref.size());
+	std::erase_if(ref, [](auto& p) { return (p.first & 1) != 0; });
+	REQUIRE(map.size() == ref.size());
+	REQUIRE(erased + ref.size() == visited);
+	for (auto& [k, v] : ref) REQUIRE(map.get_or_return_default(k) == v);
+
+	// empty shards give their tables back
+	size_t used = map.memory_usage();
+	map.erase_if([](const uint32_t&, uint64_t&) { return true; });
+	map.collect();
+	REQUIRE(map.empty());
+	REQUIRE(map.memory_usage() < used);
+	REQUIRE(map.insert(1, value_of(1)));
+	REQUIRE(map.get_or_return_default(1) == value_of(1));
+}
@@ -6,21 +6,50 @@
 //   publish, and distribute this file as you see fit.
 
 // edited a little for my purposes
+// ...and then a lot : buckets have control bytes with 7 bits of the hash now,
+// probed by 16 at once (SSE2/NEON), keys are placed Robin Hood style with
+// backward shift on erase, and HashMap/HashSet share one implementation.
 
 #pragma once
 
+#include <bit>
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
 #include <stdint.h>
 #include <iterator>
 #include <string_view>
+#include <type_traits>
 #include <utility>
 #include <cassert>
 
+#include "memory.hpp"
+
+// define PB_HASHMAP_NO_SIMD to force portable scalar group matching
+#if !defined(PB_HASHMAP_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64))
+#include <emmintrin.h>
+#define PB_HASHMAP_SSE2 1
+#elif !defined(PB_HASHMAP_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#include <arm_neon.h>
+#define PB_HASHMAP_NEON 1
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PB_PREFETCH(p) __builtin_prefetch((const void*)(p))
+#elif PB_HASHMAP_SSE2
+#define PB_PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define PB_PREFETCH(p) ((void)(p))
+#endif
+
 namespace pb {
 
 #define DCHECK_EQ_F(a, b) assert(a == b)
 #define DCHECK_NE_F(a, b) assert(a != b)
 #define DCHECK_LT_F(a, b) assert(a < b)
+#define DCHECK_F(a) assert(a)
 
 inline size_t murmurhash(const std::string_view& obj) noexcept {
 	size_t seed = obj.size();
@@ -43,232 +72,383 @@ struct HashMapEqualTo
 	}
 };
 
+namespace impl {
+
+static constexpr uint64_t HASH_K0 = 0xa0761d6478bd642fULL;
+static constexpr uint64_t HASH_K1 = 0xe7037ed1a0b428dbULL;
+
+/// 64x64 -> 128 bit multiply, folded back into 64 bits. Every bit of the result depends on every bit of the arguments
+inline uint64_t mul_fold(uint64_t a, uint64_t b) noexcept {
+#if defined(__SIZEOF_INT128__)
+	__uint128_t r = (__uint128_t)a * b;
+	return uint64_t(r) ^ uint64_t(r >> 64);
+#else
+	uint64_t ha = a >> 32, hb = b >> 32, la = uint32_t(a), lb = uint32_t(b);
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), c = t < rl;
+	uint64_t lo = t + (rm1 << 32);
+	c += lo < t;
+	uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+	return lo ^ hi;
+#endif
+}
+
+inline uint64_t read64(const unsigned char* p) noexcept { uint64_t v; memcpy(&v, p, 8); return v; }
+inline uint64_t read32(const unsigned char* p) noexcept { uint32_t v; memcpy(&v, p, 4); return v; }
+
+} // namespace impl
+
+/// Integer mixer : one (wide) multiply. For keys up to 8 bytes
+inline size_t hash_int(uint64_t v) noexcept {
+	return impl::mul_fold(v ^ impl::HASH_K0, impl::HASH_K1);
+}
+
+/// Hashes memory by 8 byte words, 16 bytes per multiply. For strings and big keys
+inline size_t hash_bytes(const void* data, size_t len) noexcept {
+	auto p = (const unsigned char*)data;
+	uint64_t h = impl::HASH_K0 ^ len;
+	uint64_t a = 0, b = 0;
+	size_t n = len;
+	for (; n > 16; n -= 16, p += 16) {
+		h = impl::mul_fold(impl::read64(p) ^ impl::HASH_K1, impl::read64(p + 8) ^ h);
+	}
+	// last (up to) 16 bytes. Overlapping reads, no byte loops
+	if (n > 8) {
+		a = impl::read64(p);
+		b = impl::read64(p + n - 8);
+	} else if (n >= 4) {
+		a = impl::read32(p);
+		b = impl::read32(p + n - 4);
+	} else if (n > 0) {
+		a = (uint64_t(p[0]) << 16) | (uint64_t(p[n >> 1]) << 8) | p[n - 1];
+	}
+	return impl::mul_fold(impl::HASH_K1 ^ len, impl::mul_fold(a ^ impl::HASH_K1, b ^ h));
+}
+
+/// Default hasher of HashMap and HashSet, picked at compile time :
+/// - strings are hashed with hash_bytes()
+/// - small (up to 8 bytes) plain keys without padding go through hash_int()
+/// - bigger plain keys without padding are hashed with hash_bytes()
+/// - everything else falls back to std::hash
+template<typename T>
+struct Hash {
+	size_t operator()(const T& v) const noexcept {
+		if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+			std::string_view s = v;
+			return hash_bytes(s.data(), s.size());
+		} else if constexpr (std::has_unique_object_representations_v<T> && sizeof(T) <= sizeof(uint64_t)) {
+			uint64_t x = 0;
+			memcpy(&x, &v, sizeof(T));
+			return hash_int(x);
+		} else if constexpr (std::has_unique_object_representations_v<T>) {
+			return hash_bytes(&v, sizeof(T));
+		} else {
+			return std::hash<T>()(v);
+		}
+	}
+};
+
 template<typename _Tp>
 struct hash_obj { // hashes object using it's content
-  size_t operator()(_Tp* __p) const noexcept { return murmurhash(std::string_view((char*)(__p), sizeof(_Tp))); }
+	static_assert(std::is_trivially_copyable_v<_Tp>);
+	size_t operator()(const _Tp& __p) const noexcept {
+		if constexpr (sizeof(_Tp) <= sizeof(uint64_t)) {
+			uint64_t x = 0;
+			memcpy(&x, &__p, sizeof(_Tp));
+			return hash_int(x);
+		} else {
+			return hash_bytes(&__p, sizeof(_Tp));
+		}
+	}
 };
 
-/// A cache-friendly hash table with open addressing, linear probing and power-of-two capacity
-template <typename KeyT, typename ValueT, typename HashT = std::hash<KeyT>, typename EqT = HashMapEqualTo<KeyT>>
-class HashMap
+namespace impl {
+
+/// Control byte of the bucket.
+/// Filled buckets keep 7 bits of the key hash (0..127) instead of the state,
+/// so most of the mismatches are rejected without touching the keys at all.
+/// There are no "deleted" buckets : erase() shifts the rest of the chain back instead.
+enum Ctrl : int8_t
 {
-private:
-	using MyType = HashMap<KeyT, ValueT, HashT, EqT>;
+	CTRL_EMPTY = -128,
+};
 
-	using PairT = std::pair<KeyT, ValueT>;
+inline bool ctrl_is_full(int8_t c) { return c >= 0; }
+
+/// Home bucket is taken from the low bits of the hash, and control byte is 7 high bits of it, multiplied
+/// by golden ratio (high bits of the product depend on all the bits of the hash, even if the hash is weak)
+inline int8_t hash_h2(size_t hash) { return int8_t((uint64_t(hash) * 0x9E3779B97F4A7C15ULL) >> 57); }
+
+/// Control bytes of 16 consecutive buckets, matched all at once.
+class Group
+{
 public:
-	using size_type       = size_t;
-	using value_type      = PairT;
-	using reference       = PairT&;
-	using const_reference = const PairT&;
+	static constexpr size_t WIDTH = 16;
+	using Mask = uint64_t; // set bit(s) for every matched bucket. Walk it with index() and next()
+
+#if PB_HASHMAP_SSE2
+	static constexpr int SHIFT = 0; // one bit per bucket
+
+	explicit Group(const int8_t* ctrl) : _ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl))) { }
+
+	Mask match(int8_t h2) const
+	{
+		return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), _ctrl));
+	}
 
-	class iterator
+	/// empty is the only state with the high bit set
+	Mask match_empty() const
 	{
-	public:
-		using iterator_category = std::forward_iterator_tag;
-		using difference_type   = size_t;
-		using distance_type     = size_t;
-		using value_type        = std::pair<KeyT, ValueT>;
-		using pointer           = value_type*;
-		using reference         = value_type&;
+		return (uint32_t)_mm_movemask_epi8(_ctrl);
+	}
 
-		iterator() { }
+private:
+	__m128i _ctrl;
+#elif PB_HASHMAP_NEON
+	static constexpr int SHIFT = 2; // four bits per bucket
 
-		iterator(MyType* hash_map, size_t bucket) : _map(hash_map), _bucket(bucket)
-		{
-		}
+	explicit Group(const int8_t* ctrl) : _ctrl(vld1q_s8(ctrl)) { }
 
-		iterator& operator++()
-		{
-			this->goto_next_element();
-			return *this;
-		}
+	Mask match(int8_t h2) const
+	{
+		return to_mask(vceqq_s8(vdupq_n_s8(h2), _ctrl));
+	}
 
-		iterator operator++(int)
-		{
-			size_t old_index = _bucket;
-			this->goto_next_element();
-			return iterator(_map, old_index);
-		}
+	/// empty is the only state with the high bit set
+	Mask match_empty() const
+	{
+		return to_mask(vcltzq_s8(_ctrl));
+	}
 
-		reference operator*() const
-		{
-			return _map->_pairs[_bucket];
-		}
+private:
+	// there is no movemask on NEON : narrow every byte into a nibble, and keep one bit of it
+	static Mask to_mask(uint8x16_t v)
+	{
+		uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(v), 4);
+		return vget_lane_u64(vreinterpret_u64_u8(n), 0) & 0x8888888888888888ULL;
+	}
 
-		pointer operator->() const
-		{
-			return _map->_pairs + _bucket;
-		}
+	int8x16_t _ctrl;
+#else
+	static constexpr int SHIFT = 0;
 
-		bool operator==(const iterator& rhs) const
-		{
-			DCHECK_EQ_F(_map, rhs._map);
-			return this->_bucket == rhs._bucket;
-		}
+	explicit Group(const int8_t* ctrl) { memcpy(_ctrl, ctrl, WIDTH); }
 
-		bool operator!=(const iterator& rhs) const
-		{
-			DCHECK_EQ_F(_map, rhs._map);
-			return this->_bucket != rhs._bucket;
-		}
+	Mask match(int8_t h2) const
+	{
+		Mask m = 0;
+		for (size_t i = 0; i < WIDTH; ++i) { m |= Mask(_ctrl[i] == h2) << i; }
+		return m;
+	}
 
-	private:
-		void goto_next_element()
-		{
-			DCHECK_LT_F(_bucket, _map->_num_buckets);
-			do {
-				_bucket++;
-			} while (_bucket < _map->_num_buckets && _map->_states[_bucket] != State::FILLED);
-		}
+	/// empty is the only state with the high bit set
+	Mask match_empty() const
+	{
+		Mask m = 0;
+		for (size_t i = 0; i < WIDTH; ++i) { m |= Mask(_ctrl[i] < 0) << i; }
+		return m;
+	}
+
+private:
+	int8_t _ctrl[WIDTH];
+#endif
+
+public:
+	/// bucket (in this group) of the first match
+	static size_t index(Mask m) { return size_t(std::countr_zero(m)) >> SHIFT; }
+
+	/// drop the first match
+	static Mask next(Mask m) { return m & (m - 1); }
+};
+
+/// how to get the key out of the stored slot
+struct KeyOfPair
+{
+	template<typename PairT>
+	static const auto& get(const PairT& p) { return p.first; }
+};
 
-	//private:
-	//	friend class MyType;
-	public:
-		MyType* _map;
-		size_t  _bucket;
-	};
+struct KeyOfSelf
+{
+	template<typename KeyT>
+	static const KeyT& get(const KeyT& k) { return k; }
+};
+
+template <typename TableT, typename ValueT>
+class HashIterator
+{
+public:
+	using iterator_category = std::forward_iterator_tag;
+	using difference_type   = size_t;
+	using distance_type     = size_t;
+	using value_type        = ValueT;
+	using pointer           = value_type*;
+	using reference         = value_type&;
+
+	HashIterator() { }
 
-	class const_iterator
+	HashIterator(TableT* table, size_t bucket) : _map(table), _bucket(bucket)
 	{
-	public:
-		using iterator_category = std::forward_iterator_tag;
-		using difference_type   = size_t;
-		using distance_type     = size_t;
-		using value_type        = const std::pair<KeyT, ValueT>;
-		using pointer           = value_type*;
-		using reference         = value_type&;
+	}
 
-		const_iterator() { }
+	/// iterator -> const_iterator
+	template <typename OtherT, typename OtherV>
+	requires (!std::is_same_v<OtherT, TableT> && std::is_convertible_v<OtherT*, TableT*>)
+	HashIterator(const HashIterator<OtherT, OtherV>& proto) : _map(proto._map), _bucket(proto._bucket)
+	{
+	}
 
-		const_iterator(iterator proto) : _map(proto._map), _bucket(proto._bucket)
-		{
-		}
+	HashIterator& operator++()
+	{
+		this->goto_next_element();
+		return *this;
+	}
 
-		const_iterator(const MyType* hash_map, size_t bucket) : _map(hash_map), _bucket(bucket)
-		{
-		}
+	HashIterator operator++(int)
+	{
+		size_t old_index = _bucket;
+		this->goto_next_element();
+		return HashIterator(_map, old_index);
+	}
 
-		const_iterator& operator++()
-		{
-			this->goto_next_element();
-			return *this;
-		}
+	reference operator*() const
+	{
+		return _map->_slots[_bucket];
+	}
 
-		const_iterator operator++(int)
-		{
-			size_t old_index = _bucket;
-			this->goto_next_element();
-			return const_iterator(_map, old_index);
-		}
+	pointer operator->() const
+	{
+		return _map->_slots + _bucket;
+	}
 
-		reference operator*() const
-		{
-			return _map->_pairs[_bucket];
-		}
+	bool operator==(const HashIterator& rhs) const
+	{
+		DCHECK_EQ_F(_map, rhs._map);
+		return this->_bucket == rhs._bucket;
+	}
 
-		pointer operator->() const
-		{
-			return _map->_pairs + _bucket;
-		}
+	bool operator!=(const HashIterator& rhs) const
+	{
+		DCHECK_EQ_F(_map, rhs._map);
+		return this->_bucket != rhs._bucket;
+	}
 
-		bool operator==(const const_iterator& rhs) const
-		{
-			DCHECK_EQ_F(_map, rhs._map);
-			return this->_bucket == rhs._bucket;
-		}
+private:
+	void goto_next_element()
+	{
+		DCHECK_LT_F(_bucket, _map->_num_slots);
+		do {
+			_bucket++;
+		} while (_bucket < _map->_num_slots && !ctrl_is_full(_map->_ctrl[_bucket]));
+	}
 
-		bool operator!=(const const_iterator& rhs) const
-		{
-			DCHECK_EQ_F(_map, rhs._map);
-			return this->_bucket != rhs._bucket;
-		}
+//private:
+//	friend class MyType;
+public:
+	TableT* _map;
+	size_t  _bucket;
+};
 
-	private:
-		void goto_next_element()
-		{
-			DCHECK_LT_F(_bucket, _map->_num_buckets);
-			do {
-				_bucket++;
-			} while (_bucket < _map->_num_buckets && _map->_states[_bucket] != State::FILLED);
-		}
+/// Open addressing, group probing, Robin Hood placement and power-of-two capacity.
+/// Common part of HashMap and HashSet, don't use it directly.
+///
+/// Keys are kept ordered by their home buckets, and every key is stored as close to
+/// it's home as possible : there is no empty bucket between the home and the key.
+/// Probing never wraps around the end of the table, chains that do not fit into the
+/// home buckets continue into few overflow buckets after them.
+template <typename SlotT, typename KeyT, typename KeyOfT, typename HashT, typename EqT, typename AllocT>
+class HashTable
+{
+	template <typename, typename> friend class HashIterator;
+protected:
+	using MyType = HashTable<SlotT, KeyT, KeyOfT, HashT, EqT, AllocT>;
+	static_assert(alignof(SlotT) <= alignof(std::max_align_t), "slots are allocated with the malloc() alignment");
 
-	//private:
-	//	friend class MyType;
-	public:
-		const MyType* _map;
-		size_t        _bucket;
-	};
+	static constexpr uint8_t DIST_SAT = 255;    // _dists value for "this far or further, ask the hash"
+	static constexpr size_t MAX_OVERFLOW = 64; // overflow buckets, when hash works as expected
+	static constexpr size_t BATCH = 16;        // keys in flight in find_many() and insert_many()
+	static constexpr size_t PREFETCH_MIN = 2u << 20; // bytes : smaller tables are likely in L2, find_many() just loops
+
+public:
+	using size_type      = size_t;
+	using iterator       = HashIterator<MyType, SlotT>;
+	using const_iterator = HashIterator<const MyType, const SlotT>;
 
 	// ------------------------------------------------------------------------
 
-	HashMap() = default;
+	HashTable() = default;
 
-	HashMap(const HashMap& other)
+	explicit HashTable(const AllocT& alloc) : _alloc(alloc) {}
+
+	HashTable(const HashTable& other) : _alloc(other._alloc)
 	{
 		reserve(other.size());
-		insert(other.cbegin(), other.cend());
+		insert_slots(other.cbegin(), other.cend());
 	}
 
-	HashMap(HashMap&& other)
+	// allocator is copied : it may have no default constructor (TaggedAllocator)
+	HashTable(HashTable&& other) : _hasher(other._hasher), _eq(other._eq), _alloc(other._alloc)
 	{
-		*this = std::move(other);
+		std::swap(_ctrl,        other._ctrl);
+		std::swap(_dists,       other._dists);
+		std::swap(_slots,       other._slots);
+		std::swap(_num_buckets, other._num_buckets);
+		std::swap(_num_slots,   other._num_slots);
+		std::swap(_num_filled,  other._num_filled);
+		std::swap(_mask,        other._mask);
 	}
 
-	HashMap& operator=(const HashMap& other)
+	HashTable& operator=(const HashTable& other)
 	{
+		if (this == &other) { return *this; }
 		clear();
 		reserve(other.size());
-		insert(other.cbegin(), other.cend());
+		insert_slots(other.cbegin(), other.cend());
 		return *this;
 	}
 
-	void operator=(HashMap&& other)
+	HashTable& operator=(HashTable&& other)
 	{
 		this->swap(other);
+		return *this;
 	}
 
-	~HashMap()
+	~HashTable()
 	{
-		for (size_t bucket=0; bucket<_num_buckets; ++bucket) {
-			if (_states[bucket] == State::FILLED) {
-				_pairs[bucket].~PairT();
+		for (size_t bucket=0; bucket<_num_slots; ++bucket) {
+			if (ctrl_is_full(_ctrl[bucket])) {
+				_slots[bucket].~SlotT();
 			}
 		}
-		free(_states);
-		free(_pairs);
+		if (_slots) {
+			_alloc.deallocate(_slots, block_size(_num_slots));
+		}
 	}
 
-	void swap(HashMap& other)
+	void swap(HashTable& other)
 	{
-		std::swap(_hasher,           other._hasher);
-		std::swap(_eq,               other._eq);
-		std::swap(_states,           other._states);
-		std::swap(_pairs,            other._pairs);
-		std::swap(_num_buckets,      other._num_buckets);
-		std::swap(_num_filled,       other._num_filled);
-		std::swap(_max_probe_length, other._max_probe_length);
-		std::swap(_mask,             other._mask);
+		std::swap(_hasher,      other._hasher);
+		std::swap(_eq,          other._eq);
+		std::swap(_alloc,       other._alloc);
+		std::swap(_ctrl,        other._ctrl);
+		std::swap(_dists,       other._dists);
+		std::swap(_slots,       other._slots);
+		std::swap(_num_buckets, other._num_buckets);
+		std::swap(_num_slots,   other._num_slots);
+		std::swap(_num_filled,  other._num_filled);
+		std::swap(_mask,        other._mask);
 	}
 
 	// -------------------------------------------------------------
 
 	iterator begin()
 	{
-		size_t bucket = 0;
-		while (bucket<_num_buckets && _states[bucket] != State::FILLED) {
-			++bucket;
-		}
-		return iterator(this, bucket);
+		return iterator(this, first_filled());
 	}
 
 	const_iterator cbegin() const
 	{
-		size_t bucket = 0;
-		while (bucket<_num_buckets && _states[bucket] != State::FILLED) {
-			++bucket;
-		}
-		return const_iterator(this, bucket);
+		return const_iterator(this, first_filled());
 	}
 
 	const_iterator begin() const
@@ -278,12 +458,12 @@ public:
 
 	iterator end()
 	{
-		return iterator(this, _num_buckets);
+		return iterator(this, _num_slots);
 	}
 
 	const_iterator cend() const
 	{
-		return const_iterator(this, _num_buckets);
+		return const_iterator(this, _num_slots);
 	}
 
 	const_iterator end() const
@@ -313,6 +493,13 @@ public:
 		return static_cast<float>(_num_filled) / static_cast<float>(_num_buckets);
 	}
 
+	/// Bytes of the table itself : buckets and control bytes.
+	/// Memory, owned by the keys and values (strings, vectors...) is not counted.
+	size_t memory_usage() const
+	{
+		return sizeof(*this) + (_slots ? block_size(_num_slots) : 0);
+	}
+
 	// ------------------------------------------------------------
 
 	template<typename KeyLike>
@@ -348,247 +535,344 @@ public:
 		return find_filled_bucket(k) != (size_t)-1 ? 1 : 0;
 	}
 
-	/// Returns the matching ValueT or nullptr if k isn't found.
+	/// Looks up n keys at once : hashes a batch of keys and prefetches their home buckets first,
+	/// so cache misses of the different lookups overlap. out[i] is end() if keys[i] isn't found.
+	/// Tables smaller than PREFETCH_MIN are looked up one by one : there are no misses to overlap.
+	/// Returns count of found keys.
 	template<typename KeyLike>
-	ValueT* try_get(const KeyLike& k)
-	{
-		auto bucket = find_filled_bucket(k);
-		if (bucket != (size_t)-1) {
-			return &_pairs[bucket].second;
-		} else {
-			return nullptr;
+	size_t find_many(const KeyLike* keys, size_t n, iterator* out)
+	{
+		size_t found = 0;
+		if (block_size(_num_slots) < PREFETCH_MIN) {
+			for (size_t i = 0; i < n; i++) {
+				size_t bucket = find_filled_bucket(keys[i]);
+				out[i] = iterator(this, bucket == (size_t)-1 ? _num_slots : bucket);
+				found += bucket != (size_t)-1;
+			}
+			return found;
+		}
+		size_t buckets[BATCH];
+		for (size_t i = 0; i < n; i += BATCH) {
+			size_t cnt = n - i < BATCH ? n - i : BATCH;
+			find_batch(keys + i, cnt, buckets);
+			for (size_t j = 0; j < cnt; j++) {
+				out[i + j] = iterator(this, buckets[j] == (size_t)-1 ? _num_slots : buckets[j]);
+				found += buckets[j] != (size_t)-1;
+			}
 		}
+		return found;
 	}
 
-	/// Const version of the above
+	// -------------------------------------------------------
+
+	/// Erase an element from the hash table.
+	/// return false if element was not found
 	template<typename KeyLike>
-	const ValueT* try_get(const KeyLike& k) const
+	bool erase(const KeyLike& key)
 	{
-		auto bucket = find_filled_bucket(k);
+		auto bucket = find_filled_bucket(key);
 		if (bucket != (size_t)-1) {
-			return &_pairs[bucket].second;
+			erase_bucket(bucket);
+			return true;
 		} else {
-			return nullptr;
+			return false;
 		}
 	}
 
-	/// Convenience function.
-	template<typename KeyLike>
-	const ValueT get_or_return_default(const KeyLike& k) const
+	/// Erase an element using an iterator.
+	/// Returns an iterator to the next element (or end()).
+	/// Elements are only moved back into the erased bucket, and never across the end of the table,
+	/// so erasing while iterating visits every element exactly once.
+	iterator erase(iterator it)
 	{
-		const ValueT* ret = try_get(k);
-		if (ret) {
-			return *ret;
-		} else {
-			return ValueT();
+		DCHECK_EQ_F(it._map, this);
+		DCHECK_LT_F(it._bucket, _num_slots);
+		erase_bucket(it._bucket);
+		if (is_filled(it._bucket)) {
+			return it; // next element was shifted in here
 		}
+		return ++it;
 	}
 
-	// -----------------------------------------------------
-
-	/// Returns a pair consisting of an iterator to the inserted element
-	/// (or to the element that prevented the insertion)
-	/// and a bool denoting whether the insertion took place.
-	std::pair<iterator, bool> insert(const KeyT& key, const ValueT& value)
+	/// Remove all elements, keeping full capacity.
+	void clear()
 	{
-		check_expand_need();
-
-		auto bucket = find_or_allocate(key);
-
-		if (_states[bucket] == State::FILLED) {
-			return { iterator(this, bucket), false };
-		} else {
-			_states[bucket] = State::FILLED;
-			new(_pairs + bucket) PairT(key, value);
-			_num_filled++;
-			return { iterator(this, bucket), true };
+		for (size_t bucket=0; bucket<_num_slots; ++bucket) {
+			if (ctrl_is_full(_ctrl[bucket])) {
+				_slots[bucket].~SlotT();
+			}
 		}
+		if (_ctrl) {
+			memset(_ctrl, CTRL_EMPTY, _num_slots + Group::WIDTH);
+		}
+		_num_filled = 0;
 	}
 
-	std::pair<iterator, bool> insert(const std::pair<KeyT, ValueT>& p)
+	/// Make room for this many elements
+	void reserve(size_t num_elems)
 	{
-		return insert(p.first, p.second);
+		if (num_elems + num_elems/2 + 1 <= _num_buckets) {
+			return;
+		}
+		rehash(buckets_for(num_elems));
 	}
 
-	void insert(const_iterator begin, const_iterator end)
+	/// Reallocate to the smallest table, that fits all the elements, or free everything if empty.
+	/// Tables never shrink by themselves : call this after mass erase (GC sweep etc.)
+	void shrink_to_fit()
 	{
-		// TODO: reserve space exactly once.
-		for (; begin != end; ++begin) {
-			insert(begin->first, begin->second);
+		if (empty()) {
+			if (_slots) {
+				_alloc.deallocate(_slots, block_size(_num_slots));
+			}
+			_ctrl  = nullptr;
+			_dists = nullptr;
+			_slots = nullptr;
+			_num_buckets = _num_slots = _mask = 0;
+			return;
+		}
+		size_t num_buckets = buckets_for(_num_filled);
+		if (num_buckets < _num_buckets) {
+			rehash(num_buckets);
 		}
 	}
 
-	/// Same as above, but contains(key) MUST be false
-	void insert_unique(KeyT&& key, ValueT&& value)
+protected:
+	/// Power of two count of buckets for this many elements, with load <= 2/3
+	static size_t buckets_for(size_t num_elems)
 	{
-		DCHECK_F(!contains(key));
-		check_expand_need();
-		auto bucket = find_empty_bucket(key);
-		_states[bucket] = State::FILLED;
-		new(_pairs + bucket) PairT(std::move(key), std::move(value));
-		_num_filled++;
+		size_t required_buckets = num_elems + num_elems/2 + 1;
+		size_t num_buckets = Group::WIDTH;
+		while (num_buckets < required_buckets) { num_buckets *= 2; }
+		return num_buckets;
 	}
 
-	void insert_unique(std::pair<KeyT, ValueT>&& p)
+	/// slots, control bytes and distances live in one allocated block, in this order
+	static size_t block_size(size_t num_slots)
 	{
-		insert_unique(std::move(p.first), std::move(p.second));
+		return num_slots * sizeof(SlotT) + num_slots + Group::WIDTH + num_slots;
 	}
 
-	void insert_or_assign(const KeyT& key, ValueT&& value)
+	// Can we fit another element?
+	void check_expand_need()
 	{
-		check_expand_need();
+		reserve(_num_filled + 1);
+	}
 
-		auto bucket = find_or_allocate(key);
+	bool is_filled(size_t bucket) const
+	{
+		return ctrl_is_full(_ctrl[bucket]);
+	}
 
-		// Check if inserting a new value rather than overwriting an old entry
-		if (_states[bucket] == State::FILLED) {
-			_pairs[bucket].second = value;
-		} else {
-			_states[bucket] = State::FILLED;
-			new(_pairs + bucket) PairT(key, value);
-			_num_filled++;
+	size_t first_filled() const
+	{
+		size_t bucket = 0;
+		while (bucket<_num_slots && !ctrl_is_full(_ctrl[bucket])) {
+			++bucket;
 		}
+		return bucket;
 	}
 
-	/// Return the old value or ValueT() if it didn't exist.
-	ValueT set_get(const KeyT& key, const ValueT& new_value)
+	/// distance of the filled bucket from the home bucket of it's key
+	size_t dist_at(size_t bucket) const
 	{
-		check_expand_need();
+		if (_dists[bucket] != DIST_SAT) { return _dists[bucket]; }
+		return bucket - (_hasher(KeyOfT::get(_slots[bucket])) & _mask); // too far, it's not worth to store that
+	}
 
-		auto bucket = find_or_allocate(key);
+	void set_filled(size_t bucket, int8_t h2, size_t dist)
+	{
+		_ctrl[bucket]  = h2;
+		_dists[bucket] = dist < DIST_SAT ? uint8_t(dist) : DIST_SAT;
+	}
 
-		// Check if inserting a new value rather than overwriting an old entry
-		if (_states[bucket] == State::FILLED) {
-			ValueT old_value = _pairs[bucket].second;
-			_pairs[bucket] = new_value.second;
-			return old_value;
-		} else {
-			_states[bucket] = State::FILLED;
-			new(_pairs + bucket) PairT(key, new_value);
-			_num_filled++;
-			return ValueT();
-		}
+	/// move filled bucket into the empty one
+	void move_bucket(size_t src, size_t dst, size_t dist)
+	{
+		new(_slots + dst) SlotT(std::move(_slots[src]));
+		_slots[src].~SlotT();
+		set_filled(dst, _ctrl[src], dist);
 	}
 
-	/// Like std::map<KeyT,ValueT>::operator[].
-	ValueT& operator[](const KeyT& key)
+	/// Construct slot for the key that is NOT in the table yet.
+	/// Returns bucket where the slot is now.
+	template<typename... Args>
+	size_t emplace_new(size_t hash, Args&&... args)
 	{
 		check_expand_need();
 
-		auto bucket = find_or_allocate(key);
-
-		/* Check if inserting a new value rather than overwriting an old entry */
-		if (_states[bucket] != State::FILLED) {
-			_states[bucket] = State::FILLED;
-			new(_pairs + bucket) PairT(key, ValueT());
-			_num_filled++;
+		// Robin Hood : take the place of the first key, that is closer to it's home than we are to ours
+		size_t bucket = hash & _mask;
+		size_t dist = 0;
+		while (is_filled(bucket) && dist_at(bucket) >= dist) {
+			bucket++;
+			dist++;
+		}
+
+		// ...and move the rest of the chain one bucket further
+		size_t last = bucket;
+		for (;; last += Group::WIDTH) {
+			auto empty = Group(_ctrl + last).match_empty();
+			if (empty) {
+				last += Group::index(empty);
+				break;
+			}
+		}
+		if (last >= _num_slots) { // out of overflow buckets
+			rehash(_num_buckets);
+			return emplace_new(hash, std::forward<Args>(args)...);
+		}
+		for (size_t i = last; i > bucket; i--) {
+			move_bucket(i - 1, i, dist_at(i - 1) + 1);
 		}
 
-		return _pairs[bucket].second;
+		new(_slots + bucket) SlotT(std::forward<Args>(args)...);
+		set_filled(bucket, hash_h2(hash), dist);
+		_num_filled++;
+		return bucket;
 	}
 
-	// -------------------------------------------------------
+	/// find_filled_bucket() for every key, with prefetches of the home buckets first. n <= BATCH
+	template<typename KeyLike>
+	void find_batch(const KeyLike* keys, size_t n, size_t* buckets) const
+	{
+		size_t hashes[BATCH];
+		if (empty()) {
+			for (size_t i = 0; i < n; i++) { buckets[i] = (size_t)-1; }
+			return;
+		}
+		for (size_t i = 0; i < n; i++) {
+			hashes[i] = _hasher(keys[i]);
+			PB_PREFETCH(_ctrl + (hashes[i] & _mask));
+			PB_PREFETCH(_slots + (hashes[i] & _mask));
+		}
+		for (size_t i = 0; i < n; i++) {
+			buckets[i] = find_filled_bucket(keys[i], hashes[i]);
+		}
+	}
 
-	/// Erase an element from the hash table.
-	/// return false if element was not found
-	bool erase(const KeyT& key)
+	/// Inserts keys, that are not in the table yet, with prefetches. make_slot(i) returns slot for keys[i].
+	/// Returns count of inserted keys
+	template<typename MakeSlot>
+	size_t insert_batch(const KeyT* keys, size_t n, MakeSlot&& make_slot)
 	{
-		auto bucket = find_filled_bucket(key);
-		if (bucket != (size_t)-1) {
-			_states[bucket] = State::ACTIVE;
-			_pairs[bucket].~PairT();
-			_num_filled -= 1;
-			return true;
-		} else {
-			return false;
+		reserve(_num_filled + n);
+		size_t hashes[BATCH];
+		size_t inserted = 0;
+		for (size_t i = 0; i < n; i += BATCH) {
+			size_t cnt = n - i < BATCH ? n - i : BATCH;
+			for (size_t j = 0; j < cnt; j++) {
+				hashes[j] = _hasher(keys[i + j]);
+				PB_PREFETCH(_ctrl + (hashes[j] & _mask));
+				PB_PREFETCH(_slots + (hashes[j] & _mask));
+			}
+			for (size_t j = 0; j < cnt; j++) {
+				if (find_filled_bucket(keys[i + j], hashes[j]) == (size_t)-1) {
+					emplace_new(hashes[j], make_slot(i + j));
+					inserted++;
+				}
+			}
 		}
+		return inserted;
 	}
 
-	/// Erase an element using an iterator.
-	/// Returns an iterator to the next element (or end()).
-	iterator erase(iterator it)
+	/// Backward shift : keys after the erased one, that are not at their home, move one bucket back.
+	/// No tombstones, chains stay as short as they were without the erased key.
+	void erase_bucket(size_t bucket)
 	{
-		DCHECK_EQ_F(it._map, this);
-		DCHECK_LT_F(it._bucket, _num_buckets);
-		_states[it._bucket] = State::ACTIVE;
-		_pairs[it._bucket].~PairT();
+		_slots[bucket].~SlotT();
+		while (is_filled(bucket + 1) && _dists[bucket + 1] != 0) {
+			move_bucket(bucket + 1, bucket, dist_at(bucket + 1) - 1);
+			bucket++;
+		}
+		_ctrl[bucket] = CTRL_EMPTY;
 		_num_filled -= 1;
-		return ++it;
 	}
 
-	/// Remove all elements, keeping full capacity.
-	void clear()
+	void insert_slots(const_iterator begin, const_iterator end)
 	{
-		for (size_t bucket=0; bucket<_num_buckets; ++bucket) {
-			if (_states[bucket] == State::FILLED) {
-				_states[bucket] = State::INACTIVE;
-				_pairs[bucket].~PairT();
+		for (; begin != end; ++begin) {
+			auto hash = _hasher(KeyOfT::get(*begin));
+			if (find_filled_bucket(KeyOfT::get(*begin), hash) == (size_t)-1) {
+				emplace_new(hash, *begin);
 			}
 		}
-		_num_filled = 0;
-		_max_probe_length = -1;
 	}
 
-	/// Make room for this many elements
-	void reserve(size_t num_elems)
+	/// Rebuild the table with this many home buckets.
+	/// Keys are counted per home bucket first, so every key is moved right into it's final place.
+	void rehash(size_t num_buckets)
 	{
-		size_t required_buckets = num_elems + num_elems/2 + 1;
-		if (required_buckets <= _num_buckets) {
-			return;
+		size_t mask = num_buckets - 1;
+		size_t hashes_size = (_num_slots + 1) * sizeof(size_t);
+		size_t starts_size = num_buckets * sizeof(size_t);
+		auto hashes = (size_t*)_alloc.allocate(hashes_size);
+		auto starts = (size_t*)_alloc.allocate(starts_size);
+		auto free_temp = [&]() {
+			_alloc.deallocate(hashes, hashes_size);
+			_alloc.deallocate(starts, starts_size);
+		};
+		if (!hashes || !starts) {
+			free_temp();
+			throw std::bad_alloc();
+		}
+		memset(starts, 0, starts_size);
+
+		for (size_t src_bucket=0; src_bucket<_num_slots; src_bucket++) {
+			if (ctrl_is_full(_ctrl[src_bucket])) {
+				hashes[src_bucket] = _hasher(KeyOfT::get(_slots[src_bucket]));
+				starts[hashes[src_bucket] & mask]++;
+			}
+		}
+		size_t used = 0; // count -> first bucket of the keys with this home
+		for (size_t home = 0; home < num_buckets; home++) {
+			size_t cnt = starts[home];
+			starts[home] = used > home ? used : home;
+			used = starts[home] + cnt;
 		}
-		size_t num_buckets = 4;
-		while (num_buckets < required_buckets) { num_buckets *= 2; }
 
-		auto new_states = (State*)malloc(num_buckets * sizeof(State));
-		auto new_pairs  = (PairT*)malloc(num_buckets * sizeof(PairT));
+		// keep some overflow buckets for the inserts, and more of them if they are actually used
+		size_t overflow = used > num_buckets ? used - num_buckets : 0;
+		size_t spare = num_buckets / 4 < MAX_OVERFLOW ? num_buckets / 4 : MAX_OVERFLOW;
+		size_t num_slots = num_buckets + overflow + (overflow > spare ? overflow : spare);
 
-		if (!new_states || !new_pairs) {
-			free(new_states);
-			free(new_pairs);
+		auto new_slots = (SlotT*)_alloc.allocate(block_size(num_slots));
+		if (!new_slots) {
+			free_temp();
 			throw std::bad_alloc();
 		}
+		auto new_ctrl  = (int8_t*)(new_slots + num_slots);
+		auto new_dists = (uint8_t*)(new_ctrl + num_slots + Group::WIDTH);
 
-		//auto old_num_filled  = _num_filled;
-		auto old_num_buckets = _num_buckets;
-		auto old_states      = _states;
-		auto old_pairs       = _pairs;
+		auto old_num_slots = _num_slots;
+		auto old_ctrl      = _ctrl;
+		auto old_slots     = _slots;
 
-		_num_filled  = 0;
 		_num_buckets = num_buckets;
-		_mask        = _num_buckets - 1;
-		_states      = new_states;
-		_pairs       = new_pairs;
-
-		std::fill_n(_states, num_buckets, State::INACTIVE);
-
-		_max_probe_length = -1;
-
-		for (size_t src_bucket=0; src_bucket<old_num_buckets; src_bucket++) {
-			if (old_states[src_bucket] == State::FILLED) {
-				auto& src_pair = old_pairs[src_bucket];
-
-				auto dst_bucket = find_empty_bucket(src_pair.first);
-				DCHECK_NE_F(dst_bucket, (size_t)-1);
-				DCHECK_NE_F(_states[dst_bucket], State::FILLED);
-				_states[dst_bucket] = State::FILLED;
-				new(_pairs + dst_bucket) PairT(std::move(src_pair));
-				_num_filled += 1;
-
-				src_pair.~PairT();
+		_num_slots   = num_slots;
+		_mask        = mask;
+		_ctrl        = new_ctrl;
+		_dists       = new_dists;
+		_slots       = new_slots;
+
+		memset(_ctrl, CTRL_EMPTY, num_slots + Group::WIDTH);
+
+		for (size_t src_bucket=0; src_bucket<old_num_slots; src_bucket++) {
+			if (ctrl_is_full(old_ctrl[src_bucket])) {
+				auto& src = old_slots[src_bucket];
+				auto home = hashes[src_bucket] & mask;
+				auto dst_bucket = starts[home]++;
+				DCHECK_LT_F(dst_bucket, num_slots);
+				new(_slots + dst_bucket) SlotT(std::move(src));
+				set_filled(dst_bucket, old_ctrl[src_bucket], dst_bucket - home);
+				src.~SlotT();
 			}
 		}
 
-		//DCHECK_EQ_F(old_num_filled, _num_filled);
-
-		free(old_states);
-		free(old_pairs);
-	}
-
-private:
-	// Can we fit another element?
-	void check_expand_need()
-	{
-		reserve(_num_filled + 1);
+		if (old_slots) {
+			_alloc.deallocate(old_slots, block_size(old_num_slots));
+		}
+		free_temp();
 	}
 
 	// Find the bucket with this key, or return (size_t)-1
@@ -596,390 +880,235 @@ private:
 	size_t find_filled_bucket(const KeyLike& key) const
 	{
 		if (empty()) { return (size_t)-1; } // Optimization
-
-		auto hash_value = _hasher(key);
-		for (int offset=0; offset<=_max_probe_length; ++offset) {
-			auto bucket = (hash_value + offset) & _mask;
-			if (_states[bucket] == State::FILLED) {
-				if (_eq(_pairs[bucket].first, key)) {
-					return bucket;
-				}
-			} else if (_states[bucket] == State::INACTIVE) {
-				return (size_t)-1; // End of the chain!
-			}
-		}
-		return (size_t)-1;
+		return find_filled_bucket(key, _hasher(key));
 	}
 
-	// Find the bucket with this key, or return a good empty bucket to place the key in.
-	// In the latter case, the bucket is expected to be filled.
-	size_t find_or_allocate(const KeyT& key)
-	{
-		auto hash_value = _hasher(key);
-		size_t hole = (size_t)-1;
-		int offset=0;
-		for (; offset<=_max_probe_length; ++offset) {
-			auto bucket = (hash_value + offset) & _mask;
-
-			if (_states[bucket] == State::FILLED) {
-				if (_eq(_pairs[bucket].first, key)) {
+	template<typename KeyLike>
+	size_t find_filled_bucket(const KeyLike& key, size_t hash_value) const
+	{
+		if (!_ctrl) { return (size_t)-1; }
+
+		auto h2 = hash_h2(hash_value);
+		// Chain of the key ends at the first empty bucket after it's home.
+		// Control bytes after the last bucket are always empty, so it always ends.
+		for (size_t pos = hash_value & _mask; ; pos += Group::WIDTH) {
+			Group group(_ctrl + pos);
+			for (auto m = group.match(h2); m; m = Group::next(m)) {
+				auto bucket = pos + Group::index(m);
+				if (_eq(KeyOfT::get(_slots[bucket]), key)) {
 					return bucket;
 				}
-			} else if (_states[bucket] == State::INACTIVE) {
-				return bucket;
-			} else {
-				// ACTIVE: keep searching
-				if (hole == (size_t)-1) {
-					hole = bucket;
-				}
-			}
-		}
-
-		// No key found - but maybe a hole for it
-
-		DCHECK_EQ_F(offset, _max_probe_length+1);
-
-		if (hole != (size_t)-1) {
-			return hole;
-		}
-
-		// No hole found within _max_probe_length
-		for (; ; ++offset) {
-			auto bucket = (hash_value + offset) & _mask;
-
-			if (_states[bucket] != State::FILLED) {
-				_max_probe_length = offset;
-				return bucket;
 			}
-		}
-	}
-
-	// key is not in this map. Find a place to put it.
-	size_t find_empty_bucket(const KeyT& key)
-	{
-		auto hash_value = _hasher(key);
-		for (int offset=0; ; ++offset) {
-			auto bucket = (hash_value + offset) & _mask;
-			if (_states[bucket] != State::FILLED) {
-				if (offset > _max_probe_length) {
-					_max_probe_length = offset;
-				}
-				return bucket;
+			if (group.match_empty()) {
+				return (size_t)-1; // End of the chain!
 			}
 		}
 	}
 
-private:
-	enum class State : uint8_t
-	{
-		INACTIVE, // Never been touched
-		ACTIVE,   // Is inside a search-chain, but is empty
-		FILLED    // Is set with key/value
-	};
-
-	HashT   _hasher;
-	EqT     _eq;
-	State*  _states           = nullptr;
-	PairT*  _pairs            = nullptr;
-	size_t  _num_buckets      =  0;
-	size_t  _num_filled       =  0;
-	int     _max_probe_length = -1; // Our longest bucket-brigade is this long. ONLY when we have zero elements is this ever negative (-1).
-	size_t  _mask             = 0;  // _num_buckets minus one
+protected:
+	HashT    _hasher;
+	EqT      _eq;
+	[[no_unique_address]] AllocT _alloc;
+	int8_t*  _ctrl        = nullptr; // _num_slots + Group::WIDTH control bytes. The last Group::WIDTH are always empty
+	uint8_t* _dists       = nullptr; // distance from the home bucket, for filled buckets. See DIST_SAT
+	SlotT*   _slots       = nullptr;
+	size_t   _num_buckets = 0; // home buckets
+	size_t   _num_slots   = 0; // home and overflow buckets
+	size_t   _num_filled  = 0;
+	size_t   _mask        = 0; // _num_buckets minus one
 };
 
-/// A cache-friendly hash set with open addressing, linear probing and power-of-two capacity
-template <typename KeyT, typename HashT = std::hash<KeyT>, typename EqT = HashMapEqualTo<KeyT>>
-class HashSet
+} // namespace impl
+
+/// A cache-friendly hash table with open addressing, group probing, Robin Hood placement and power-of-two capacity
+template <typename KeyT, typename ValueT, typename HashT = Hash<KeyT>, typename EqT = HashMapEqualTo<KeyT>,
+	typename AllocT = MallocAllocator>
+class HashMap : public impl::HashTable<std::pair<KeyT, ValueT>, KeyT, impl::KeyOfPair, HashT, EqT, AllocT>
 {
 private:
-	using MyType = HashSet<KeyT, HashT, EqT>;
+	using MyType = HashMap<KeyT, ValueT, HashT, EqT, AllocT>;
+	using Base   = impl::HashTable<std::pair<KeyT, ValueT>, KeyT, impl::KeyOfPair, HashT, EqT, AllocT>;
 
+	using PairT = std::pair<KeyT, ValueT>;
 public:
 	using size_type       = size_t;
-	using value_type      = KeyT;
-	using reference       = KeyT&;
-	using const_reference = const KeyT&;
-
-	class iterator
-	{
-	public:
-		using iterator_category = std::forward_iterator_tag;
-		using difference_type   = size_t;
-		using distance_type     = size_t;
-		using value_type        = KeyT;
-		using pointer           = value_type*;
-		using reference         = value_type&;
-
-		iterator() { }
-
-		iterator(MyType* hash_set, size_t bucket) : _set(hash_set), _bucket(bucket)
-		{
-		}
-
-		iterator& operator++()
-		{
-			this->goto_next_element();
-			return *this;
-		}
-
-		iterator operator++(int)
-		{
-			size_t old_index = _bucket;
-			this->goto_next_element();
-			return iterator(_set, old_index);
-		}
-
-		reference operator*() const
-		{
-			return _set->_keys[_bucket];
-		}
-
-		pointer operator->() const
-		{
-			return _set->_keys + _bucket;
-		}
-
-		bool operator==(const iterator& rhs) const
-		{
-			DCHECK_EQ_F(_set, rhs._set);
-			return this->_bucket == rhs._bucket;
-		}
-
-		bool operator!=(const iterator& rhs) const
-		{
-			DCHECK_EQ_F(_set, rhs._set);
-			return this->_bucket != rhs._bucket;
-		}
+	using value_type      = PairT;
+	using reference       = PairT&;
+	using const_reference = const PairT&;
+	using iterator        = typename Base::iterator;
+	using const_iterator  = typename Base::const_iterator;
 
-	private:
-		void goto_next_element()
-		{
-			DCHECK_LT_F(_bucket, _set->_num_buckets);
-			do {
-				_bucket++;
-			} while (_bucket < _set->_num_buckets && _set->_states[_bucket] != State::FILLED);
-		}
+	using Base::Base;
 
-	//private:
-	//	friend class MyType;
-	public:
-		MyType* _set;
-		size_t  _bucket;
-	};
+	// ------------------------------------------------------------
 
-	class const_iterator
+	/// Returns the matching ValueT or nullptr if k isn't found.
+	template<typename KeyLike>
+	ValueT* try_get(const KeyLike& k)
 	{
-	public:
-		using iterator_category = std::forward_iterator_tag;
-		using difference_type   = size_t;
-		using distance_type     = size_t;
-		using value_type        = const KeyT;
-		using pointer           = value_type*;
-		using reference         = value_type&;
-
-		const_iterator() { }
-
-		const_iterator(iterator proto) : _set(proto._set), _bucket(proto._bucket)
-		{
-		}
-
-		const_iterator(const MyType* hash_set, size_t bucket) : _set(hash_set), _bucket(bucket)
-		{
-		}
-
-		const_iterator& operator++()
-		{
-			this->goto_next_element();
-			return *this;
-		}
-
-		const_iterator operator++(int)
-		{
-			size_t old_index = _bucket;
-			this->goto_next_element();
-			return const_iterator(_set, old_index);
-		}
-
-		reference operator*() const
-		{
-			return _set->_keys[_bucket];
-		}
-
-		pointer operator->() const
-		{
-			return _set->_keys + _bucket;
-		}
-
-		bool operator==(const const_iterator& rhs) const
-		{
-			DCHECK_EQ_F(_set, rhs._set);
-			return this->_bucket == rhs._bucket;
-		}
-
-		bool operator!=(const const_iterator& rhs) const
-		{
-			DCHECK_EQ_F(_set, rhs._set);
-			return this->_bucket != rhs._bucket;
-		}
-
-	private:
-		void goto_next_element()
-		{
-			DCHECK_LT_F(_bucket, _set->_num_buckets);
-			do {
-				_bucket++;
-			} while (_bucket < _set->_num_buckets && _set->_states[_bucket] != State::FILLED);
+		auto bucket = this->find_filled_bucket(k);
+		if (bucket != (size_t)-1) {
+			return &this->_slots[bucket].second;
+		} else {
+			return nullptr;
 		}
-
-	//private:
-	//	friend class MyType;
-	public:
-		const MyType* _set;
-		size_t        _bucket;
-	};
-
-	// ------------------------------------------------------------------------
-
-	HashSet() = default;
-
-	HashSet(const HashSet& other)
-	{
-		reserve(other.size());
-		insert(other.cbegin(), other.cend());
 	}
 
-	HashSet(HashSet&& other)
+	/// Const version of the above
+	template<typename KeyLike>
+	const ValueT* try_get(const KeyLike& k) const
 	{
-		*this = std::move(other);
+		auto bucket = this->find_filled_bucket(k);
+		if (bucket != (size_t)-1) {
+			return &this->_slots[bucket].second;
+		} else {
+			return nullptr;
+		}
 	}
 
-	HashSet& operator=(const HashSet& other)
+	/// Convenience function.
+	template<typename KeyLike>
+	const ValueT get_or_return_default(const KeyLike& k) const
 	{
-		clear();
-		reserve(other.size());
-		insert(other.cbegin(), other.cend());
-		return *this;
+		const ValueT* ret = try_get(k);
+		if (ret) {
+			return *ret;
+		} else {
+			return ValueT();
+		}
 	}
 
-	void operator=(HashSet&& other)
-	{
-		this->swap(other);
-	}
+	// -----------------------------------------------------
 
-	~HashSet()
+	/// Returns a pair consisting of an iterator to the inserted element
+	/// (or to the element that prevented the insertion)
+	/// and a bool denoting whether the insertion took place.
+	std::pair<iterator, bool> insert(const KeyT& key, const ValueT& value)
 	{
-		for (size_t bucket=0; bucket<_num_buckets; ++bucket) {
-			if (_states[bucket] == State::FILLED) {
-				_keys[bucket].~KeyT();
-			}
+		auto hash = this->_hasher(key);
+		auto bucket = this->find_filled_bucket(key, hash);
+
+		if (bucket != (size_t)-1) {
+			return { iterator(this, bucket), false };
+		} else {
+			bucket = this->emplace_new(hash, key, value);
+			return { iterator(this, bucket), true };
 		}
-		free(_states);
-		free(_keys);
 	}
 
-	void swap(HashSet& other)
+	std::pair<iterator, bool> insert(const std::pair<KeyT, ValueT>& p)
 	{
-		std::swap(_hasher,           other._hasher);
-		std::swap(_eq,               other._eq);
-		std::swap(_states,           other._states);
-		std::swap(_keys,             other._keys);
-		std::swap(_num_buckets,      other._num_buckets);
-		std::swap(_num_filled,       other._num_filled);
-		std::swap(_max_probe_length, other._max_probe_length);
-		std::swap(_mask,             other._mask);
+		return insert(p.first, p.second);
 	}
 
-	// -------------------------------------------------------------
-
-	iterator begin()
+	void insert(const_iterator begin, const_iterator end)
 	{
-		size_t bucket = 0;
-		while (bucket<_num_buckets && _states[bucket] != State::FILLED) {
-			++bucket;
-		}
-		return iterator(this, bucket);
+		// TODO: reserve space exactly once.
+		this->insert_slots(begin, end);
 	}
 
-	const_iterator cbegin() const
-	{
-		size_t bucket = 0;
-		while (bucket<_num_buckets && _states[bucket] != State::FILLED) {
-			++bucket;
+	/// Looks up n keys at once, see HashTable::find_many(). out[i] is nullptr if keys[i] isn't found.
+	/// Returns count of found keys.
+	template<typename KeyLike>
+	size_t find_many(const KeyLike* keys, size_t n, ValueT** out)
+	{
+		size_t buckets[Base::BATCH];
+		size_t found = 0;
+		for (size_t i = 0; i < n; i += Base::BATCH) {
+			size_t cnt = n - i < Base::BATCH ? n - i : Base::BATCH;
+			this->find_batch(keys + i, cnt, buckets);
+			for (size_t j = 0; j < cnt; j++) {
+				out[i + j] = buckets[j] == (size_t)-1 ? nullptr : &this->_slots[buckets[j]].second;
+				found += buckets[j] != (size_t)-1;
+			}
 		}
-		return const_iterator(this, bucket);
+		return found;
 	}
 
-	const_iterator begin() const
-	{
-		return cbegin();
-	}
+	using Base::find_many;
 
-	iterator end()
+	/// Inserts n keys with their values, unless key already exists. Space is reserved once,
+	/// and home buckets are prefetched in batches. Returns count of inserted elements.
+	size_t insert_many(const KeyT* keys, const ValueT* values, size_t n)
 	{
-		return iterator(this, _num_buckets);
+		return this->insert_batch(keys, n, [&](size_t i) { return PairT(keys[i], values[i]); });
 	}
 
-	const_iterator cend() const
+	/// Same as above, but contains(key) MUST be false
+	void insert_unique(KeyT&& key, ValueT&& value)
 	{
-		return const_iterator(this, _num_buckets);
+		DCHECK_F(!this->contains(key));
+		auto hash = this->_hasher(key);
+		this->emplace_new(hash, std::move(key), std::move(value));
 	}
 
-	const_iterator end() const
+	void insert_unique(std::pair<KeyT, ValueT>&& p)
 	{
-		return cend();
+		insert_unique(std::move(p.first), std::move(p.second));
 	}
 
-	size_t size() const
+	void insert_or_assign(const KeyT& key, ValueT&& value)
 	{
-		return _num_filled;
-	}
+		auto hash = this->_hasher(key);
+		auto bucket = this->find_filled_bucket(key, hash);
 
-	bool empty() const
-	{
-		return _num_filled==0;
-	}
-
-	// Returns the number of buckets.
-	size_t bucket_count() const
-	{
-		return _num_buckets;
+		// Check if inserting a new value rather than overwriting an old entry
+		if (bucket != (size_t)-1) {
+			this->_slots[bucket].second = std::move(value);
+		} else {
+			this->emplace_new(hash, key, std::move(value));
+		}
 	}
 
-	/// Returns average number of elements per bucket.
-	float load_factor() const
+	/// Return the old value or ValueT() if it didn't exist.
+	ValueT set_get(const KeyT& key, const ValueT& new_value)
 	{
-		return static_cast<float>(_num_filled) / static_cast<float>(_num_buckets);
-	}
-
-	// ------------------------------------------------------------
+		auto hash = this->_hasher(key);
+		auto bucket = this->find_filled_bucket(key, hash);
 
-	iterator find(const KeyT& key)
-	{
-		auto bucket = this->find_filled_bucket(key);
-		if (bucket == (size_t)-1) {
-			return this->end();
+		// Check if inserting a new value rather than overwriting an old entry
+		if (bucket != (size_t)-1) {
+			ValueT old_value = this->_slots[bucket].second;
+			this->_slots[bucket].second = new_value;
+			return old_value;
+		} else {
+			this->emplace_new(hash, key, new_value);
+			return ValueT();
 		}
-		return iterator(this, bucket);
 	}
 
-	const_iterator find(const KeyT& key) const
+	/// Like std::map<KeyT,ValueT>::operator[].
+	ValueT& operator[](const KeyT& key)
 	{
-		auto bucket = this->find_filled_bucket(key);
+		auto hash = this->_hasher(key);
+		auto bucket = this->find_filled_bucket(key, hash);
+
+		/* Check if inserting a new value rather than overwriting an old entry */
 		if (bucket == (size_t)-1) {
-			return this->end();
+			bucket = this->emplace_new(hash, key, ValueT());
 		}
-		return const_iterator(this, bucket);
-	}
 
-	bool contains(const KeyT& k) const
-	{
-		return find_filled_bucket(k) != (size_t)-1;
+		return this->_slots[bucket].second;
 	}
+};
 
-	size_t count(const KeyT& k) const
-	{
-		return find_filled_bucket(k) != (size_t)-1 ? 1 : 0;
-	}
+/// A cache-friendly hash set with open addressing, group probing, Robin Hood placement and power-of-two capacity
+template <typename KeyT, typename HashT = Hash<KeyT>, typename EqT = HashMapEqualTo<KeyT>, typename AllocT = MallocAllocator>
+class HashSet : public impl::HashTable<KeyT, KeyT, impl::KeyOfSelf, HashT, EqT, AllocT>
+{
+private:
+	using MyType = HashSet<KeyT, HashT, EqT, AllocT>;
+	using Base   = impl::HashTable<KeyT, KeyT, impl::KeyOfSelf, HashT, EqT, AllocT>;
+
+public:
+	using size_type       = size_t;
+	using value_type      = KeyT;
+	using reference       = KeyT&;
+	using const_reference = const KeyT&;
+	using iterator        = typename Base::iterator;
+	using const_iterator  = typename Base::const_iterator;
+
+	using Base::Base;
 
 	// -----------------------------------------------------
 
@@ -989,16 +1118,13 @@ public:
 	/// and a bool denoting whether the insertion took place.
 	std::pair<iterator, bool> insert(const KeyT& key)
 	{
-		check_expand_need();
-
-		auto bucket = find_or_allocate(key);
+		auto hash = this->_hasher(key);
+		auto bucket = this->find_filled_bucket(key, hash);
 
-		if (_states[bucket] == State::FILLED) {
+		if (bucket != (size_t)-1) {
 			return { iterator(this, bucket), false };
 		} else {
-			_states[bucket] = State::FILLED;
-			new(_keys + bucket) KeyT(key);
-			_num_filled++;
+			bucket = this->emplace_new(hash, key);
 			return { iterator(this, bucket), true };
 		}
 	}
@@ -1009,16 +1135,13 @@ public:
 	/// and a bool denoting whether the insertion took place.
 	std::pair<iterator, bool> insert(KeyT&& key)
 	{
-		check_expand_need();
-
-		auto bucket = find_or_allocate(key);
+		auto hash = this->_hasher(key);
+		auto bucket = this->find_filled_bucket(key, hash);
 
-		if (_states[bucket] == State::FILLED) {
+		if (bucket != (size_t)-1) {
 			return { iterator(this, bucket), false };
 		} else {
-			_states[bucket] = State::FILLED;
-			new(_keys + bucket) KeyT(std::move(key));
-			_num_filled++;
+			bucket = this->emplace_new(hash, std::move(key));
 			return { iterator(this, bucket), true };
 		}
 	}
@@ -1032,222 +1155,28 @@ public:
 	void insert(const_iterator begin, const_iterator end)
 	{
 		// TODO: reserve space exactly once.
-		for (; begin != end; ++begin) {
-			insert(*begin);
-		}
-	}
-
-	/// Same as above, but contains(key) MUST be false
-	void insert_unique(KeyT key)
-	{
-		DCHECK_F(!contains(key));
-		check_expand_need();
-		auto bucket = find_empty_bucket(key);
-		_states[bucket] = State::FILLED;
-		new(_keys + bucket) KeyT(std::move(key));
-		_num_filled++;
-	}
-
-	// -------------------------------------------------------
-
-	/// Erase an element from the hash set.
-	/// return false if element was not found.
-	bool erase(const KeyT& key)
-	{
-		auto bucket = find_filled_bucket(key);
-		if (bucket != (size_t)-1) {
-			_states[bucket] = State::ACTIVE;
-			_keys[bucket].~KeyT();
-			_num_filled -= 1;
-			return true;
-		} else {
-			return false;
-		}
+		this->insert_slots(begin, end);
 	}
 
-	/// Erase an element using an iterator.
-	/// Returns an iterator to the next element (or end()).
-	iterator erase(iterator it)
+	/// Inserts n keys, unless key already exists. Space is reserved once,
+	/// and home buckets are prefetched in batches. Returns count of inserted keys.
+	size_t insert_many(const KeyT* keys, size_t n)
 	{
-		DCHECK_EQ_F(it._set, this);
-		DCHECK_LT_F(it._bucket, _num_buckets);
-		_states[it._bucket] = State::ACTIVE;
-		_keys[it._bucket].~KeyT();
-		_num_filled -= 1;
-		return ++it;
-	}
-
-	/// Remove all elements, keeping full capacity.
-	void clear()
-	{
-		for (size_t bucket=0; bucket<_num_buckets; ++bucket) {
-			if (_states[bucket] == State::FILLED) {
-				_states[bucket] = State::INACTIVE;
-				_keys[bucket].~KeyT();
-			}
-		}
-		_num_filled = 0;
-		_max_probe_length = -1;
+		return this->insert_batch(keys, n, [&](size_t i) { return keys[i]; });
 	}
 
-	/// Make room for this many elements
-	void reserve(size_t num_elems)
-	{
-		size_t required_buckets = num_elems + num_elems/2 + 1;
-		if (required_buckets <= _num_buckets) {
-			return;
-		}
-		size_t num_buckets = 4;
-		while (num_buckets < required_buckets) { num_buckets *= 2; }
-
-		auto new_states = (State*)malloc(num_buckets * sizeof(State));
-		auto new_keys  = (KeyT*)malloc(num_buckets * sizeof(KeyT));
-
-		if (!new_states || !new_keys) {
-			free(new_states);
-			free(new_keys);
-			throw std::bad_alloc();
-		}
-
-		// auto old_num_filled  = _num_filled;
-		auto old_num_buckets = _num_buckets;
-		auto old_states      = _states;
-		auto old_keys        = _keys;
-
-		_num_filled  = 0;
-		_num_buckets = num_buckets;
-		_mask        = _num_buckets - 1;
-		_states      = new_states;
-		_keys        = new_keys;
-
-		std::fill_n(_states, num_buckets, State::INACTIVE);
-
-		_max_probe_length = -1;
-
-		for (size_t src_bucket=0; src_bucket<old_num_buckets; src_bucket++) {
-			if (old_states[src_bucket] == State::FILLED) {
-				auto& src = old_keys[src_bucket];
-
-				auto dst_bucket = find_empty_bucket(src);
-				DCHECK_NE_F(dst_bucket, (size_t)-1);
-				DCHECK_NE_F(_states[dst_bucket], State::FILLED);
-				_states[dst_bucket] = State::FILLED;
-				new(_keys + dst_bucket) KeyT(std::move(src));
-				_num_filled += 1;
-
-				src.~KeyT();
-			}
-		}
-
-		// DCHECK_EQ_F(old_num_filled, _num_filled);
-
-		free(old_states);
-		free(old_keys);
-	}
-
-private:
-	// Can we fit another element?
-	void check_expand_need()
-	{
-		reserve(_num_filled + 1);
-	}
-
-	// Find the bucket with this key, or return (size_t)-1
-	size_t find_filled_bucket(const KeyT& key) const
-	{
-		if (empty()) { return (size_t)-1; } // Optimization
-
-		auto hash_value = _hasher(key);
-		for (int offset=0; offset<=_max_probe_length; ++offset) {
-			auto bucket = (hash_value + offset) & _mask;
-			if (_states[bucket] == State::FILLED) {
-				if (_eq(_keys[bucket], key)) {
-					return bucket;
-				}
-			} else if (_states[bucket] == State::INACTIVE) {
-				return (size_t)-1; // End of the chain!
-			}
-		}
-		return (size_t)-1;
-	}
-
-	// Find the bucket with this key, or return a good empty bucket to place the key in.
-	// In the latter case, the bucket is expected to be filled.
-	size_t find_or_allocate(const KeyT& key)
-	{
-		auto hash_value = _hasher(key);
-		size_t hole = (size_t)-1;
-		int offset=0;
-		for (; offset<=_max_probe_length; ++offset) {
-			auto bucket = (hash_value + offset) & _mask;
-
-			if (_states[bucket] == State::FILLED) {
-				if (_eq(_keys[bucket], key)) {
-					return bucket;
-				}
-			} else if (_states[bucket] == State::INACTIVE) {
-				return bucket;
-			} else {
-				// ACTIVE: keep searching
-				if (hole == (size_t)-1) {
-					hole = bucket;
-				}
-			}
-		}
-
-		// No key found - but maybe a hole for it
-		DCHECK_EQ_F(offset, _max_probe_length+1);
-
-		if (hole != (size_t)-1) {
-			return hole;
-		}
-
-		// No hole found within _max_probe_length
-		for (; ; ++offset) {
-			auto bucket = (hash_value + offset) & _mask;
-
-			if (_states[bucket] != State::FILLED) {
-				_max_probe_length = offset;
-				return bucket;
-			}
-		}
-	}
-
-	// key is not in this map. Find a place to put it.
-	size_t find_empty_bucket(const KeyT& key)
+	/// Same as above, but contains(key) MUST be false
+	void insert_unique(KeyT key)
 	{
-		auto hash_value = _hasher(key);
-		for (int offset=0; ; ++offset) {
-			auto bucket = (hash_value + offset) & _mask;
-			if (_states[bucket] != State::FILLED) {
-				if (offset > _max_probe_length) {
-					_max_probe_length = offset;
-				}
-				return bucket;
-			}
-		}
+		DCHECK_F(!this->contains(key));
+		auto hash = this->_hasher(key);
+		this->emplace_new(hash, std::move(key));
 	}
-
-private:
-	enum class State : uint8_t
-	{
-		INACTIVE, // Never been touched
-		ACTIVE,   // Is inside a search-chain, but is empty
-		FILLED    // Is set with key/value
-	};
-
-	HashT   _hasher;
-	EqT     _eq;
-	State*  _states           = nullptr;
-	KeyT*   _keys             = nullptr;
-	size_t  _num_buckets      =  0;
-	size_t  _num_filled       =  0;
-	int     _max_probe_length = -1; // Our longest bucket-brigade is this long. ONLY when we have zero elements is this ever negative (-1).
-	size_t  _mask             = 0;  // _num_buckets minus one
 };
 
 #undef DCHECK_EQ_F
 #undef DCHECK_LT_F
 #undef DCHECK_NE_F
+#undef DCHECK_F
 
-} // namespace emilib
\ No newline at end of file
+} // namespace emilib
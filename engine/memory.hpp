@@ -0,0 +1,96 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Memory accounting : named memory tags and allocators for the containers
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <atomic>
+#include <cstdlib>
+
+#include "base.hpp"
+
+namespace pb {
+
+/**
+ * Named counter of the heap memory, used by some container or subsystem.
+ * Tags register themselves in the global list on construction, and are never
+ * unregistered : make them static or global.
+ *
+ * Profiler UI shows all of them.
+ */
+class MemoryTag : public Static {
+	const char* _name;
+	std::atomic<size_t> _bytes = 0;
+	std::atomic<size_t> _blocks = 0;
+	MemoryTag* _next = nullptr;
+
+	static inline std::atomic<MemoryTag*> _head = nullptr;
+
+	public:
+	MemoryTag(const char* name) : _name(name) {
+		_next = _head.load(std::memory_order_relaxed);
+		while (!_head.compare_exchange_weak(_next, this, std::memory_order_release, std::memory_order_relaxed)) {}
+	}
+
+	inline void add(size_t bytes) {
+		_bytes.fetch_add(bytes, std::memory_order_relaxed);
+		_blocks.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	inline void sub(size_t bytes) {
+		_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+		_blocks.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	const char* name() const { return _name; }
+	size_t bytes() const { return _bytes.load(std::memory_order_relaxed); }
+	size_t blocks() const { return _blocks.load(std::memory_order_relaxed); }
+
+	/** iteration over all tags : for (auto t = MemoryTag::first(); t; t = t->next()) */
+	static const MemoryTag* first() { return _head.load(std::memory_order_acquire); }
+	const MemoryTag* next() const { return _next; }
+};
+
+/**
+ * Allocators of the containers (pb::HashMap, pb::HashSet) : raw memory blocks,
+ * aligned as malloc() does. Size of the block is passed back on deallocation.
+ */
+struct MallocAllocator {
+	void* allocate(size_t bytes) { return malloc(bytes); }
+	void deallocate(void* p, size_t) { free(p); }
+};
+
+/** MallocAllocator, that counts memory in the MemoryTag */
+class TaggedAllocator {
+	MemoryTag* tag;
+	public:
+	TaggedAllocator(MemoryTag& dst) : tag(&dst) {}
+
+	void* allocate(size_t bytes) {
+		void* p = malloc(bytes);
+		if (p) tag->add(bytes);
+		return p;
+	}
+
+	void deallocate(void* p, size_t bytes) {
+		if (!p) return;
+		tag->sub(bytes);
+		free(p);
+	}
+};
+
+};	// namespace pb
@@ -21,199 +21,57 @@
  This stuff is kinda legacy, but it works and i don't care
 */
 
-#include "base.hpp"
-#define PROFILER_DEFINE_EXT
-#include "profiler.hpp"
+#include "profiler_impl.hpp"
 #include "clock.hpp"
 
 #include <stdexcept>
-#include <thread>
-
-#include <stack>
+#include <cstring>
 #include <utility>
-#include <stdexcept>
-#include <unordered_map>
-#include <mutex>
 
-#include "engine/hashmap.hpp"
 #include <doctest.h>
 
 namespace pb {
 
 namespace prof {
 
-using Thread = std::thread;
-using StatsStorage = std::map<const std::string*, prof_stats>; // REAL stats storage
-static constexpr int HISTORY_LEN = 128; // how many history entries to keep
-
 double prof_clock() {
-	return ClockSource().time();
+	return ClockSource::time();
 }
 
-/** zone item on the stack */
-struct prof_item {
-	prof_item(prof_stats* val, double time) : val(val), time(time) {}
-	prof_item(const prof_item&) = default;
-	prof_item(prof_item&&) = default;
-	prof_item& operator=(const prof_item&) = default;
-	prof_item& operator=(prof_item&&) = default;
-	public:
-	prof_stats* val;	// where to write a results
-	double time;
-};
-
-namespace impl {
-	static ThreadID curr_id() {return ::std::this_thread::get_id();}	
-
-	class Stack : public std::stack<prof_item> {
-		using C = std::stack<prof_item>;
-		using C::C;
-		public:
-		C::container_type& container(){
-			return c;
-		}
-	};
-};
-
-/**
-
- resource and other shared thread stuff...
- 
-  */
-template <class T, class Mutex = std::mutex>
-struct ResUsage {
-	std::unique_lock<Mutex> lock;
-	T& ref;
-	public:
-	operator T& () {return ref;}
-};
-
-template<class T, class Mutex = std::mutex>
-class Resource : public T{
-	private:
-	Mutex m;
-	//T object;
-	public:
-	template<class... Args>
-	Resource(Args&&... args) : T(std::forward<Args>(args)...) {}
-	ResUsage<T, Mutex> use() {
-		return {std::unique_lock<Mutex>(m), static_cast<T&>(*this)};
-	}
-};
-
 /*
- * For debug. Turns resource aqquring and releaseing into NOOP
+ * API Implementation
  */
-template <class T>
-struct ResUsage<T, void> {
-	T& ref;
-	public:
-	operator T& () {return ref;}
-};
-
-template<class T>
-class Resource<T, void> : public T{
-	private:
-	//T object;
-	public:
-	template<class... Args>
-	Resource(Args&&... args) : T(std::forward<Args>(args)...) {}
-	ResUsage<T, void> use() {
-		return {static_cast<T&>(*this)};
+namespace impl {
+	Resource<std::map<ThreadID, DataImpl>, SpinLock> prof_data;
+	std::atomic<bool> tracing = false;
+	std::atomic<bool> perf_counters = false;
+	std::atomic<bool> sampling = false;
+	std::atomic<bool> alloc_tracking = false;
+	std::atomic<bool> spike_detect = false;
+	std::atomic<uint32_t> spike_version = 0;
+	std::atomic<bool> streaming = false;
+	Resource<SpikeState, SpinLock> spikes;
+	static uint32_t thread_counter = 0; // under prof_data lock
+
+	Registry& registry() {
+		static Registry r;
+		return r;
 	}
-};
 
+	Resource<HistoryMap, SpinLock> histories;
 
-/** per-thread profiler data. We assume that only owning thread will access this data. */
-struct DataImpl {
-	public:
-	const ThreadID key;
-	impl::Stack stack;
-	StatsStorage data;
-	int history_pos = 0; // position in the history
-	double tick_time; // when was ticked last time. if > 5 seconds, we can remove thread.
-	public:
-	DataImpl(ThreadID id) : key(id) {use();}
-	DataImpl(const DataImpl&) = default;
-	DataImpl(DataImpl&&) = default;
-	private:
-	double use() {
-		return prof_clock();
-	}
-	/** get statictics for a given zone name,
-	  * or create new one */
-	prof_stats* stat(const std::string* name) {
-		return &(data.emplace(name, prof_stats()).first)->second;
-	}
-	/** push zone call on proflier stack */
-	prof_item& push(const std::string* name) {
-		prof_stats* val = stat(name);
-		auto& v = stack.emplace(val, use());
-		if (stack.size() == 0) LOG_FATAL("What the fuck");
-		return v;
-	}
-	/** pop zone call from stack*/
-	inline prof_item pop() {
-		prof_item i = stack.top();
-		stack.pop();
-		return i;
-	}
-	/** get zone call on top of the stack */
-	inline prof_item& get() {
-		return stack.top();
-	}
-	/** is there any zone call? */
-	inline bool have() {
-		return !stack.empty();
-	}
-	public:
-	ThreadData get_wrapper() {
-		return ThreadData(*this);
-	}
-	/** API */
-	void begin(const std::string* name);
-	void end();
-	void step();
-	/** private extended */
-	void newframe();
-};
-
-/**
-SPINLOCK
-\*/
-
-	// use ONLY under very active load, and short lock period!
-	class SpinLock {
-		std::atomic_bool lo;
-		using Lock = std::unique_lock<SpinLock>;
-		public:
-		inline bool try_lock() {
-			bool unlocked = false;
-			// invalidate cache here
-			return lo.compare_exchange_weak(
-				unlocked, true, std::memory_order_acquire
-			);
-		}
-		inline void lock() {
-			while (!try_lock()) { // invalidates cache
-				// a bit more OK
-				while(lo.load(std::memory_order_acquire) != false) {}
-			}
-		}
-		inline void unlock() {
-			lo.store(false, std::memory_order_release);
+	static uint32_t register_zone(ZoneDesc* desc) {
+		auto& r = registry();
+		std::lock_guard l(r.lock);
+		uint32_t id = r.count.load(std::memory_order_relaxed);
+		if (id >= MAX_ZONES) {
+			LOG_WARN("Too many profiler zones! %s is counted as <overflow>", desc->name);
+			return r.overflow.id;
 		}
-	};
-
-/*
- * API Implementation
- */
-namespace impl {
-	static Resource<std::map<ThreadID, DataImpl>, SpinLock> prof_data;
-	using StatsHistory = std::vector<StatsStorage>;
-	using HistoryMap = std::unordered_map<ThreadID, StatsHistory>;
-	static Resource<HistoryMap, void> prof_history;
-	static Resource<pb::HashSet<std::string>, SpinLock> string_cache;
+		r.zones[id].store(desc, std::memory_order_release);
+		r.count.store(id + 1, std::memory_order_release);
+		return id;
+	}
 
 	thread_local DataImpl* _data_ref = nullptr;
 
@@ -241,7 +99,18 @@ namespace impl {
 		auto v = data.find(id); // we don't want to always call a constructor
 		if (v != data.end()) LOG_FATAL("thread was already registered!");
 
-		return data.emplace(id, DataImpl(curr_id())).first->second; // else
+		ThreadHistory* history;
+		{
+			auto huse = histories.use(); // lock
+			auto& h = huse.ref[id]; // same thread id => same history, as before
+			if (!h) h = new ThreadHistory();
+			history = h;
+		}
+		history->index.store(thread_counter, std::memory_order_relaxed);
+		history->name.store(nullptr, std::memory_order_relaxed);
+		DataImpl& res = data.try_emplace(id, id, thread_counter++, history).first->second; // else
+		_data_ref = &res;
+		return res;
 	};
 
 	void delete_thread_data(DataImpl& impl) {
@@ -254,16 +123,11 @@ namespace impl {
 
 		auto v = data.find(id); // we don't want to always call a constructor
 		if (v == data.end()) LOG_FATAL("This thread was already unregistered. You have big and bad issues... Use sanitizers");
+		_data_ref = nullptr; // thread may be registered again. Also stops SIGPROF handler
+		std::atomic_signal_fence(std::memory_order_seq_cst);
 		data.erase(v);
 	}
 
-	/** HISTORY MUST BE LOCKED! */
-	StatsHistory& get_history_data(ThreadID key, HistoryMap& history) {
-		auto it = history.find(key);
-		if (it == history.end()) return history.emplace(key, StatsHistory(HISTORY_LEN)).first->second;
-		return it->second;
-	}
-
 };
 
 /* How does it work?
@@ -286,97 +150,212 @@ namespace impl {
  * All this technique is minded by me, on paper, in one day. It
  * may work very ugly, but it works, and i don't need more :p
  *
- * NEW: String passed here MUST be a string in PROFILER STRING CACHE!
+ * NEW: zones are dense IDs of the registered ZoneDesc's now, and stats live
+ * in flat per-thread array, indexed by ID. No locks and no lookups in here!
+ * Times are raw tsc::now() ticks : they are converted to seconds by readers only.
  */
 
-void DataImpl::begin(const std::string* name) {
-	double time = prof_clock();
+void DataImpl::begin(uint32_t zone) {
+	uint64_t time = tsc::now();
 
 	// set owntime and sumtime for previous entry
 	if (have()) {
 		prof_item& prev = get();
-		prof_stats& s = *prev.val;
+		tick_stats& s = stat(prev.zone);
 
 		s.owntime += time - prev.time;
 		s.sumtime += time - prev.time;
+		nodes[prev.node].owntime += time - prev.time;
 		prev.time = time;
 	}
 
-	push(name);
-	stat(name)->ncalls++; // new call
+	if (depth < MAX_DEPTH) {
+		uint32_t node = child_node(depth > 0 ? get().node : 0, zone);
+		stack[depth] = prof_item{zone, node, time, time};
+		stat(zone).ncalls++; // new call
+		nodes[node].ncalls++;
+		trace_event(time, zone, false);
+		if (impl::perf_counters.load(std::memory_order_relaxed) || perf) [[unlikely]] perf_begin(depth);
+	}
+	depth++;
 }
 
 void DataImpl::end() {
-	double time = prof_clock();
+	uint64_t time = tsc::now();
+	if (!have()) LOG_FATAL("profiler zone end() without begin()");
 
-	prof_item item = pop();
-	prof_stats& stat = *item.val;
+	bool recorded = depth <= MAX_DEPTH;
+	prof_item item = get();
+	depth--;
+	if (!recorded) return; // too deep, was never pushed
+	trace_event(time, item.zone, true);
 
+	ZoneState& state = *zones[item.zone];
+	tick_stats& stat = state.stats;
 	stat.owntime += time - item.time;
 	stat.sumtime += time - item.time;
+	nodes[item.node].owntime += time - item.time;
+	state.hist[hist_bucket(time - item.start)]++;
+	if (perf) [[unlikely]] perf_end(depth, state);
 
 	if (have()) {	// add to summary time of the current top item
 		prof_item& prev = get();
-		auto &stat = *prev.val;
+		auto &stat = this->stat(prev.zone);
 		stat.sumtime += time - prev.time;
 		prev.time = time;
 	}
 }
 
+uint32_t DataImpl::new_node(uint32_t parent, uint32_t zone) {
+	static constexpr uint32_t OVERFLOW_NODE = MAX_NODES - 1;
+	if (nodes.size() > OVERFLOW_NODE) return OVERFLOW_NODE;
+	if (nodes.size() == OVERFLOW_NODE) { // last one : for all the calls over the limit
+		LOG_WARN("Too many profiler call tree nodes! New calls are counted as <overflow>");
+		parent = 0;
+		zone = 0; // <overflow> zone
+	}
+	alloc_muted = true;
+	uint32_t id = nodes.size();
+	nodes.push_back(CallNode{zone, parent});
+	nodes[id].next_sibling = nodes[parent].first_child;
+	nodes[parent].first_child = id;
+	alloc_muted = false;
+	return id;
+}
+
+void DataImpl::load_tree() {
+	uint32_t count = history->node_count.load(std::memory_order_acquire);
+	nodes.reserve(count > 64 ? count : 64);
+	nodes.push_back(CallNode{NO_ZONE, 0}); // root
+	for (uint32_t n = 1; n < count; n++) {
+		uint32_t parent = history->node_parent[n].load(std::memory_order_relaxed);
+		nodes.push_back(CallNode{history->node_zone[n].load(std::memory_order_relaxed), parent});
+		nodes[n].next_sibling = nodes[parent].first_child;
+		nodes[parent].first_child = n;
+	}
+	node_sums.resize(nodes.size());
+}
+
 /**
  * Clearups time in zones stack and zone data
  */
 void DataImpl::newframe() {
-	auto& vec = stack.container();
-	double time = use();
-
-	for (auto &i : stack.container() ) {
-		i.time = time; // reset time flor all zones on the stack
+	uint64_t time = use();
+	int n = depth < MAX_DEPTH ? depth : MAX_DEPTH;
+
+	for (uint32_t id : used) {
+		tick_stats& v = zones[id]->stats;
+		v = tick_stats();
+		if (zones[id]->kind == ZoneKind::COUNTER) zones[id]->value = 0;
+		memset(zones[id]->perf, 0, sizeof(zones[id]->perf));
 	}
-
-	// erase data
-	std::erase_if(data, [&vec](const auto& pair){
-		for (auto& i : vec) {
-			if (i.val == &(pair.second)) return false; // do not erase
-		}
-		return true; // do erase
-	});
-
-	// clearup
-	for (auto &pair: data) {
-		prof_stats& v = pair.second;
-		v.ncalls = 1; // this shit is already called
-		v.owntime = 0;
-		v.sumtime = 0;
+	for (CallNode& node : nodes) {
+		node.owntime = 0;
+		node.ncalls = 0;
+	}
+	for (int i = 0; i < n; i++) {
+		stack[i].time = time; // reset time flor all zones on the stack
+		stat(stack[i].zone).ncalls = 1; // this shit is already called
+		nodes[stack[i].node].ncalls = 1;
 	}
 }
 
 /**
  * AWARE OF NEW REQUIREMENT! We need to restore stack as it was before, if it is not empty!
+ *
+ * Writes frame into the next history position, under it's sequence lock.
+ * Every zone ever recorded in this thread is written, zeroes too : position
+ * still has values from HISTORY_LEN frames ago.
+ * Last position of the window also gets the latency histograms.
  */
 void DataImpl::step() {
-	{
-	auto ruse = impl::prof_history.use(); // lock
-	auto& history_map = ruse.ref;
-
-	auto& history = impl::get_history_data(key, history_map);
-	auto &dst = history[history_pos];
-	dst.clear(); // clear results
-
-	if (have()) { // alternative (slower) path  
-		dst = data; // copy
-	} else { // fastest path, when stack is empty
-		dst = std::move(data); // move
-		data.clear();
+	ThreadHistory& h = *history;
+	uint64_t now = tsc::now();
+	uint64_t frame = now - frame_start;
+	frame_start = now;
+
+	// zones, that are new to the history
+	uint32_t count = h.count.load(std::memory_order_relaxed);
+	for (uint32_t id : used) {
+		if (h.zones[id].load(std::memory_order_relaxed)) continue;
+		alloc_muted = true;
+		h.zones[id].store(new ZoneHistory(), std::memory_order_release);
+		alloc_muted = false;
+		h.ids[count].store(id, std::memory_order_relaxed);
+		h.count.store(++count, std::memory_order_release);
 	}
 
-	history_pos++;
-	if (history_pos >= HISTORY_LEN) {
-		history_pos = 0;
+	// call tree nodes, that are new to the history. Parents are published first
+	uint32_t node_count = h.node_count.load(std::memory_order_relaxed);
+	if (node_count < nodes.size()) {
+		alloc_muted = true;
+		for (uint32_t n = node_count; n < nodes.size(); n++) {
+			h.node_parent[n].store(nodes[n].parent, std::memory_order_relaxed);
+			h.node_zone[n].store(nodes[n].zone, std::memory_order_relaxed);
+			h.nodes[n].store(new NodeHistory(), std::memory_order_release);
+		}
+		node_sums.resize(nodes.size());
+		alloc_muted = false;
+		node_count = nodes.size();
+		h.node_count.store(node_count, std::memory_order_release);
 	}
+
+	uint32_t pos = h.pos.load(std::memory_order_relaxed) + 1;
+	if (pos >= HISTORY_LEN) pos = 0;
+
+	uint32_t seq = h.seq[pos].load(std::memory_order_relaxed);
+	h.seq[pos].store(seq + 1, std::memory_order_relaxed); // odd : being written
+	std::atomic_thread_fence(std::memory_order_release);
+	if (perf) h.perf_kind.store(perf->kind, std::memory_order_relaxed);
+	h.frame[pos].store(frame, std::memory_order_relaxed);
+	h.frame_end[pos].store(now, std::memory_order_relaxed);
+
+	bool window_end = pos % HIST_WINDOW == HIST_WINDOW - 1;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t id = h.ids[i].load(std::memory_order_relaxed);
+		ZoneHistory* dst = h.zones[id].load(std::memory_order_relaxed);
+		ZoneState* src = zones[id]; // may be from the previous thread with this ID
+		tick_stats v = src ? src->stats : tick_stats();
+		dst->owntime[pos].store(v.owntime, std::memory_order_relaxed);
+		dst->sumtime[pos].store(v.sumtime, std::memory_order_relaxed);
+		dst->ncalls[pos].store(v.ncalls, std::memory_order_relaxed);
+		dst->allocs[pos].store(v.allocs, std::memory_order_relaxed);
+		dst->frees[pos].store(v.frees, std::memory_order_relaxed);
+		dst->alloc_bytes[pos].store(v.alloc_bytes, std::memory_order_relaxed);
+		dst->value[pos].store(src ? src->value : 0, std::memory_order_relaxed);
+		for (int c = 0; c < PERF_COUNTERS; c++)
+			dst->perf[c][pos].store(src ? src->perf[c] : 0, std::memory_order_relaxed);
+
+		if (!window_end) continue;
+		auto& hist = dst->hist[pos / HIST_WINDOW];
+		for (uint32_t b = 0; b < HIST_BUCKETS; b++)
+			hist[b].store(src ? src->hist[b] : 0, std::memory_order_relaxed);
+		if (src) memset(src->hist, 0, sizeof(src->hist));
 	}
 
-	if (have()) newframe(); // slow path. cleanup
+	// inclusive times : children are after the parents, so sum them up from the end
+	for (uint32_t n = 0; n < node_count; n++) node_sums[n] = nodes[n].owntime;
+	for (uint32_t n = node_count - 1; n > 0; n--) node_sums[nodes[n].parent] += node_sums[n];
+	for (uint32_t n = 0; n < node_count; n++) {
+		NodeHistory* dst = h.nodes[n].load(std::memory_order_relaxed);
+		dst->owntime[pos].store(nodes[n].owntime, std::memory_order_relaxed);
+		dst->sumtime[pos].store(node_sums[n], std::memory_order_relaxed);
+		dst->ncalls[pos].store(nodes[n].ncalls, std::memory_order_relaxed);
+	}
+
+	h.seq[pos].store(seq + 2, std::memory_order_release);
+	h.pos.store(pos, std::memory_order_release);
+
+	if ((spike_watch && impl::spike_detect.load(std::memory_order_relaxed)) || spike_pos >= 0) [[unlikely]] check_spike(pos, frame);
+
+	if (impl::streaming.load(std::memory_order_relaxed)) [[unlikely]] stream_frame(frame);
+
+	if (impl::sampling.load(std::memory_order_relaxed) != sampling_on) [[unlikely]] {
+		if (sampling_on) stop_sampling();
+		else start_sampling();
+	}
+
+	newframe();
 }
 
 /** 
@@ -400,23 +379,50 @@ ThreadData get_thread_data() {
 	return data.get_wrapper();
 }
 
-/** THIS WRAPPER IS REALLY IMPORTANT NOW! */
-void ThreadData::begin(const char* name) {
-	const std::string *_cached = nullptr;
-	std::string lookup = name;
+bool has_thread_data() {
+	return impl::_data_ref;
+}
+
+ZoneDesc::ZoneDesc(const char* name, const char* file, int line, ZoneKind kind) : name(name), file(file), line(line), kind(kind) {
+	id = impl::register_zone(this);
+}
+
+const ZoneDesc& intern_zone(const char* name, ZoneKind kind) {
+	auto& r = impl::registry();
 	{
-		auto ruse = impl::string_cache.use(); // lock
-		auto& cache = ruse.ref;
-		auto v = cache.find(lookup);
-		if (v == cache.end()) {
-			_cached= &(*(cache.insert(lookup).first));
-		} else {
-			_cached = &(*v);
-		}
+		std::lock_guard l(r.lock);
+		ZoneDesc** v = r.named.try_get(std::string_view(name));
+		if (v) return **v;
 	}
-	return data.begin(_cached);
+	char* copy = strdup(name); // FOREVER
+	if (!copy) throw std::bad_alloc();
+	auto* desc = new ZoneDesc(copy, nullptr, 0, kind); // registers itself
+	std::lock_guard l(r.lock);
+	auto res = r.named.insert(std::string_view(copy), desc);
+	return *res.first->second; // if somebody was faster, his one is used, ours is leaked
 }
+
+uint32_t zones_count() {
+	return impl::registry().count.load(std::memory_order_acquire);
+}
+
+const ZoneDesc* get_zone(uint32_t id) {
+	if (id >= zones_count()) return nullptr;
+	return impl::registry().zones[id].load(std::memory_order_acquire);
+}
+
+void ThreadData::begin(const ZoneDesc& zone) {return data.begin(zone.id);}
 void ThreadData::end() {return data.end();}
+void ThreadData::counter(const ZoneDesc& desc, double delta) {data.counter(desc.id, delta);}
+void ThreadData::gauge(const ZoneDesc& desc, double value) {data.gauge(desc.id, value);}
+void ThreadData::set_name(const char* name) {
+	data.name = name;
+	data.history->name.store(name, std::memory_order_relaxed);
+}
+void ThreadData::set_spike_detection(bool enabled) {
+	data.spike_watch = enabled;
+	data.nrecent = 0; // old frames are not the baseline
+}
 void ThreadData::step() {return data.step();}
 
 /**
@@ -427,7 +433,7 @@ void ThreadData::step() {return data.step();}
 void get_threads(std::vector<ThreadID>& vec) {
 	vec.clear();
 
-	auto ruse = impl::prof_history.use(); // lock
+	auto ruse = impl::histories.use(); // lock
 	auto& history = ruse.ref;
 	vec.reserve(history.size());
 
@@ -436,6 +442,45 @@ void get_threads(std::vector<ThreadID>& vec) {
 	}
 }
 
+double HistoryView::percentile(size_t i, double q) const {
+	uint64_t hist[HIST_BUCKETS] = {};
+	add_histogram(i, hist);
+	return hist_percentile(hist, q);
+}
+
+void HistoryView::add_histogram(size_t i, uint64_t* dst) const {
+	const ZoneHistory* z = h->zones[zone_id(i)].load(std::memory_order_acquire);
+	auto& hist = z->hist[p / HIST_WINDOW];
+	for (uint32_t b = 0; b < HIST_BUCKETS; b++) dst[b] += hist[b].load(std::memory_order_relaxed);
+}
+
+double hist_percentile(const uint64_t* hist, double q) {
+	uint64_t total = 0;
+	for (uint32_t b = 0; b < HIST_BUCKETS; b++) total += hist[b];
+	if (!total) return 0;
+
+	uint64_t rank = uint64_t(q * total + 0.999999); // ceil
+	if (rank < 1) rank = 1;
+	uint64_t sum = 0;
+	uint32_t b = 0;
+	for (; b < HIST_BUCKETS - 1; b++) {
+		sum += hist[b];
+		if (sum >= rank) break;
+	}
+	return hist_bucket_value(b) * tsc::seconds_per_tick();
+}
+
+const ThreadHistory* get_history(ThreadID id) {
+	auto ruse = impl::histories.use(); // lock
+	auto v = ruse.ref.find(id);
+	return v != ruse.ref.end() ? v->second : nullptr;
+}
+
+HistoryView::HistoryView(const ThreadHistory* h, size_t pos) : h(h), p(pos) {
+	if (pos >= HISTORY_LEN) LOG_FATAL("History position is out of range!");
+	while ((seq = h->seq[p].load(std::memory_order_acquire)) & 1) pb::impl::cpu_relax(); // being written, very short
+}
+
 /** return length of history buffers (or (max position+1) in history/summary) */
 size_t history_size() {
 	return HISTORY_LEN;
@@ -444,8 +489,6 @@ size_t history_size() {
 /**
  * Get statictics about all zones in one thread at specified position in time.
  * returns whole ass copy of everything.
- * Calling this every frame is absolutely costly, but
- * it allows to minisize syncronisations :)
  * 
  * Returns no value if thread with this ID does not exist.
  * pos is in range of 0 to history_size()-1;
@@ -453,35 +496,190 @@ size_t history_size() {
 StatsStorage2 get_summary(ThreadID id, size_t pos) {
 	if (pos >= HISTORY_LEN) // error (misuse)
 		LOG_FATAL("History position is out of range!");
-	
-	StatsStorage res;
-	{
-		auto ruse = impl::prof_history.use(); // lock
-		auto& history = ruse.ref;
-
-		auto v = history.find(id);
-		if (v == history.end()) return StatsStorage2(); // invalid ThreadID
-	
-		// oh
-		res = v->second[pos];
-	}
 
-	return res; // return a copy
+	const ThreadHistory* h = get_history(id);
+	if (!h) return StatsStorage2(); // invalid ThreadID
+
+	StatsStorage2 res;
+	HistoryView view;
+	do {
+		res.clear();
+		view = HistoryView(h, pos);
+		for (size_t i = 0; i < view.size(); i++) {
+			prof_stats v = view.stats(i);
+			if (v.ncalls > 0) res.emplace(view.zone(i), v);
+		}
+	} while (!view.valid());
+	return res;
 }
 
 size_t get_current_position(ThreadID id) {
-	size_t res = 0;
+	return get_current_position(get_history(id));
+}
+
+TEST_CASE("Profiler") {
+	auto prof_ctx = make_thread_data();
+	ThreadData prof = get_thread_data();
+	static ZoneDesc outer("Test::Outer");
+	static ZoneDesc inner("Test::Inner");
+	REQUIRE(get_zone(outer.id) == &outer);
+	REQUIRE(&intern_zone("Test::Dynamic") == &intern_zone("Test::Dynamic"));
+
+	for (int i = 0; i < 3; i++) {
+		auto z = prof.make_zone(outer);
+		for (int j = 0; j < 10; j++) {
+			PROFILING_SCOPE_X("Test::Inner", prof);
+		}
+		prof.make_zone(inner);
+	}
+	prof.begin(outer); // stays open over the step()
+	prof.step();
+
+	size_t pos = get_current_position(std::this_thread::get_id());
+	auto stats = get_summary(std::this_thread::get_id(), pos);
+	REQUIRE(stats[&outer].ncalls == 4);
+	REQUIRE(stats[&inner].ncalls == 3);
+	REQUIRE(stats[&outer].sumtime >= stats[&outer].owntime);
+	size_t inner_calls = 0;
+	for (auto& [desc, st] : stats) {
+		if (strcmp(desc->name, "Test::Inner") == 0) inner_calls += st.ncalls;
+	}
+	REQUIRE(inner_calls == 3 + 30); // different callsites are different zones
+
+	const ThreadHistory* h = get_history(std::this_thread::get_id());
+	REQUIRE(h);
+	HistoryView old(h, pos);
+	REQUIRE(old.valid());
+
+	prof.step();
+	stats = get_summary(std::this_thread::get_id(), get_current_position(std::this_thread::get_id()));
+	REQUIRE(stats.size() == 1); // only the open one
+	REQUIRE(stats[&outer].ncalls == 1);
+	prof.end();
+
+	// view of the same position becomes invalid, after it is rewritten
+	for (size_t i = 0; i < HISTORY_LEN - 1; i++) prof.step();
+	REQUIRE(get_current_position(h) == pos);
+	REQUIRE(!old.valid());
+	HistoryView view(h, pos);
+	REQUIRE(view.version() != old.version());
+	for (size_t i = 0; i < view.size(); i++) REQUIRE(view.stats(i).ncalls == 0);
+}
+
+TEST_CASE("Profiler histograms") {
+	uint32_t prev = 0;
+	for (uint64_t v = 1; v < (uint64_t(1) << 36); v += v / 3 + 1) {
+		uint32_t b = hist_bucket(v);
+		REQUIRE(b >= prev); // monotonic
+		REQUIRE(hist_bucket_value(b) >= v * 0.75);
+		REQUIRE(hist_bucket_value(b) <= v * 1.25 + 1);
+		prev = b;
+	}
+	REQUIRE(hist_bucket(~uint64_t(0)) == HIST_BUCKETS - 1);
+
+	auto prof_ctx = make_thread_data();
+	ThreadData prof = get_thread_data();
+	static ZoneDesc zone("Test::Stutter");
+	const ThreadHistory* h = get_history(std::this_thread::get_id());
+
+	// align to the window start
+	while (get_current_position(h) % HIST_WINDOW != HIST_WINDOW - 1) prof.step();
+	for (size_t frame = 0; frame < HIST_WINDOW; frame++) {
+		for (int i = 0; i < 10; i++) prof.make_zone(zone);
+		if (frame == 5) {
+			auto z = prof.make_zone(zone);
+			double t = prof_clock();
+			while (prof_clock() - t < 0.002) {} // one slow call
+		}
+		prof.step();
+	}
+
+	HistoryView view(h, get_current_position(h));
+	REQUIRE(view.has_window());
+	size_t i = 0;
+	while (view.zone(i) != &zone) i++;
+	REQUIRE(view.percentile(i, 0.5) < 0.0005);
+	REQUIRE(view.percentile(i, 0.99) < 0.0005); // 161 calls : 1 slow is > p99
+	REQUIRE(view.percentile(i, 1.0) > 0.0015);
+	REQUIRE(view.valid());
+}
+
+TEST_CASE("Profiler counters and gauges") {
+	auto prof_ctx = make_thread_data();
+	ThreadData prof = get_thread_data();
+	static ZoneDesc loaded("Test::Loaded", nullptr, 0, ZoneKind::COUNTER);
+	static ZoneDesc queue("Test::Queue", nullptr, 0, ZoneKind::GAUGE);
+	const ThreadHistory* h = get_history(std::this_thread::get_id());
+
+	auto find = [&](const HistoryView& view, const ZoneDesc& z) {
+		for (size_t i = 0; i < view.size(); i++) if (view.zone(i) == &z) return view.stats(i);
+		return prof_stats();
+	};
+
+	prof.counter(loaded, 2);
+	prof.counter(loaded, 3);
+	prof.gauge(queue, 10);
+	prof.gauge(queue, 7);
+	prof.step();
+	HistoryView first(h, get_current_position(h));
+	REQUIRE(find(first, loaded).value == 5);
+	REQUIRE(find(first, loaded).ncalls == 2);
+	REQUIRE(find(first, queue).value == 7);
+
+	prof.step(); // counter starts from 0, gauge keeps it's value
+	HistoryView second(h, get_current_position(h));
+	REQUIRE(find(second, loaded).value == 0);
+	REQUIRE(find(second, queue).value == 7);
+	REQUIRE(find(second, queue).ncalls == 0);
+
+	REQUIRE(intern_zone("Test::Dynamic counter", ZoneKind::COUNTER).kind == ZoneKind::COUNTER);
+}
+
+TEST_CASE("Profiler call tree") {
+	auto prof_ctx = make_thread_data();
+	ThreadData prof = get_thread_data();
+	static ZoneDesc a("Tree::A"), b("Tree::B"), shared("Tree::Shared");
+	const ThreadHistory* h = get_history(std::this_thread::get_id());
+
+	auto spin = [](double seconds) {
+		double t = prof_clock();
+		while (prof_clock() - t < seconds) {}
+	};
 	{
-	auto ruse = impl::prof_data.use(); // lock
-	auto& data = ruse.ref;
+		auto za = prof.make_zone(a);
+		auto zs = prof.make_zone(shared);
+		spin(0.002); // expensive from A
+	}
+	for (int i = 0; i < 3; i++) {
+		auto zb = prof.make_zone(b);
+		auto zs = prof.make_zone(shared); // cheap from B
+	}
+	prof.step();
 
-	auto v = data.find(id); // we don't want to always call a constructor
-	if (v == data.end()) return 0;
-	res = v->second.history_pos;
+	HistoryView view(h, get_current_position(h));
+	uint32_t na = 0, nb = 0, from_a = 0, from_b = 0;
+	for (uint32_t n = 1; n < view.node_count(); n++) {
+		if (view.node_zone(n) == a.id && view.node_parent(n) == 0) na = n;
+		if (view.node_zone(n) == b.id && view.node_parent(n) == 0) nb = n;
 	}
-	res--;
-	if (res >= history_size()) res = HISTORY_LEN-1;
-	return res;
+	REQUIRE(na);
+	REQUIRE(nb);
+	for (uint32_t n = 1; n < view.node_count(); n++) {
+		if (view.node_zone(n) != shared.id) continue;
+		if (view.node_parent(n) == na) from_a = n;
+		if (view.node_parent(n) == nb) from_b = n;
+	}
+	REQUIRE(from_a);
+	REQUIRE(from_b);
+	REQUIRE(view.node_stats(from_a).ncalls == 1);
+	REQUIRE(view.node_stats(from_b).ncalls == 3);
+	REQUIRE(view.node_stats(from_a).owntime > 0.0015);
+	REQUIRE(view.node_stats(from_b).owntime < 0.001);
+	REQUIRE(view.node_stats(na).sumtime >= view.node_stats(from_a).sumtime);
+	REQUIRE(view.node_stats(na).owntime < 0.001);
+	// equal in ticks : float seconds of the children are rounded separately
+	REQUIRE(view.node_stats(0).sumtime >= (view.node_stats(na).sumtime + view.node_stats(nb).sumtime) * (1 - 1e-6));
+	REQUIRE(view.node_zone(0) == NO_ZONE);
 }
 
 };
@@ -23,10 +23,16 @@
 
 #pragma once
 
+#include <cstdint>
 #include <cstdlib>
+#include <string>
 #include <thread> // for ThreadID
 
+#include "tsc.hpp"
+
 #ifdef PROFILER_DEFINE_EXT
+#include <atomic>
+#include <string>
 #include <vector>
 #include <map>
 #endif
@@ -48,10 +54,52 @@ namespace prof {
 // implementation of very presize and stable clocksource
 // DON'T USE A DEFAULT clock() FUNCTION FROM LIBC! IT'S AWFUL!
 // I am using my own clocksource here.
+// (zones themselves use raw tsc::now() ticks, this one is for seconds)
 double prof_clock();
 
+/** max count of different zones. Zones over the limit are all counted as the one "<overflow>" zone */
+static constexpr uint32_t MAX_ZONES = 1024;
+
+/** max depth of the zone stack. Deeper zones are not recorded (but still may be ended safely) */
+static constexpr int MAX_DEPTH = 128;
+
+/**
+ * Static descriptor of the zone. PROFILING_SCOPE() makes one per callsite, and it
+ * is registered once, on the first pass. After that, zone is just a dense integer ID :
+ * begin()/end() with it don't lock and don't allocate anything.
+ *
+ * Descriptors are never unregistered : they must be static (or leaked).
+ */
+enum class ZoneKind : uint8_t {
+	ZONE, // begin()/end() : time and calls
+	COUNTER, // counter() : sum of the deltas in the frame, starts from 0 every frame
+	GAUGE // gauge() : last set value, kept between frames
+};
+
+struct ZoneDesc {
+	const char* name;
+	const char* file;
+	int line;
+	uint32_t id; // dense, 0...zones_count()-1
+	ZoneKind kind;
+
+	ZoneDesc(const char* name, const char* file = nullptr, int line = 0, ZoneKind kind = ZoneKind::ZONE);
+	/** for the profiler itself : NOT registered, id is given */
+	ZoneDesc(uint32_t id, const char* name) : name(name), file(nullptr), line(0), id(id), kind(ZoneKind::ZONE) {}
+	ZoneDesc(const ZoneDesc&) = delete;
+	ZoneDesc& operator=(const ZoneDesc&) = delete;
+};
+
+/**
+ * Descriptor of the zone with this name. Same name => same descriptor (kind of
+ * the first one is kept). For names known only at runtime.
+ * SLOW : takes a lock, and keeps a copy of the name FOREVER!
+ */
+const ZoneDesc& intern_zone(const char* name, ZoneKind kind = ZoneKind::ZONE);
+
 /** how data is really implmented... */
 struct DataImpl;
+class Zone;
 
 /**
  * Thread-specific profiler context
@@ -69,13 +117,18 @@ class ThreadData {
 	/* API */
 
 	/**
-	 * Push new profiler zone call on the stack.
-	 * NEW REQUIREMENT : All nemes passed to name must be very unique.
-	 * NEW ISSUE : Any unique passed string will be keeped in memory FOREVER!
+	 * Push new profiler zone call on the stack. No locks, no allocations
+	 * (except the first call of this zone in this thread).
+	 * Zone stack has MAX_DEPTH limit... yep
+	 */
+	void begin(const ZoneDesc& zone);
+
+	/**
+	 * Same as above, but zone is looked up by name with intern_zone(). SLOW!
+	 * Any unique passed string will be keeped in memory FOREVER!
 	 * : This is not a good idea to let unsafe enviroment use this function!
-	 * Also, zone stack has implementation-defined boundary limit... yep
 	 */
-	void begin(const char* name);
+	void begin(const char* name) { begin(intern_zone(name)); }
 
 	/** end of call to previously pushed zone. Return to previous zone */
 	void end();
@@ -94,20 +147,43 @@ class ThreadData {
 	 */
 	void step();
 
+	/**
+	 * Values, that are not durations : queue lengths, loaded chunks, bytes...
+	 * Stored in the history as zones of the COUNTER/GAUGE kind, with the value
+	 * and count of the updates. No locks, no allocations (except the first use).
+	 * counter() adds delta to this frame's sum, gauge() sets the value.
+	 */
+	void counter(const ZoneDesc& desc, double delta);
+	void counter(const char* name, double delta) { counter(intern_zone(name, ZoneKind::COUNTER), delta); }
+	void gauge(const ZoneDesc& desc, double value);
+	void gauge(const char* name, double value) { gauge(intern_zone(name, ZoneKind::GAUGE), value); }
+
+	/** name of the thread in the profiler and traces. Must be a static string */
+	void set_name(const char* name);
+
+	/** watch frames of this thread with the spike detector. Off by default */
+	void set_spike_detection(bool enabled);
+
 	/** syntax sugar and safer wrapper of begin()/end() functions above
 	   * Calls begin() immediatly, and calls end when returned object is destructed
 		 */
-  auto make_zone(const char* name) {
-    begin(name);
-		struct __nnn {
-			ThreadData master;
-			__nnn(ThreadData& d) : master(d) {}
-			~__nnn() {master.end();}
-		}v (*this);
-	  return v;
-  }
+	inline Zone make_zone(const ZoneDesc& zone);
+	inline Zone make_zone(const char* name);
+};
+
+/** RAII zone : begin() on construction, end() on destruction */
+class Zone {
+	ThreadData master;
+	public:
+	Zone(ThreadData d, const ZoneDesc& zone) : master(d) { master.begin(zone); }
+	Zone(const Zone&) = delete;
+	Zone& operator=(const Zone&) = delete;
+	~Zone() { master.end(); }
 };
 
+inline Zone ThreadData::make_zone(const ZoneDesc& zone) { return Zone(*this, zone); }
+inline Zone ThreadData::make_zone(const char* name) { return Zone(*this, intern_zone(name)); }
+
 /** get ThreadData for current thread. CANNOT BE USED BEFORE INIT OR AFTER FREE!
  * this thing is likely to be cached in a thread_local variable, so it's ok
  * in terms of perfomance.
@@ -123,13 +199,108 @@ ThreadData get_thread_data();
 ThreadData init_thread_data();
 void       free_thread_data(ThreadData);
 
+/** is the current thread registered? For the code, that may run in any thread (lock waits) */
+bool has_thread_data();
+
+/**
+ * Trace mode : every begin()/end() is also recorded with it's timestamp
+ * into the per-thread ring buffer (last 65536 events of every thread).
+ * Costs a bit more per zone, and 1 MiB per thread. Off by default.
+ */
+void set_tracing(bool enabled);
+bool is_tracing();
+
+/**
+ * Writes last `seconds` of the trace (or everything that is in the rings, if seconds <= 0)
+ * as Chrome trace-event JSON : open it in ui.perfetto.dev or chrome://tracing.
+ * Returns false if file can't be written.
+ */
+bool export_trace(const char* path, double seconds = 0);
+
+/**
+ * Writes stats of every zone in every thread over the whole history : mean,
+ * percentiles, calls per frame, etc. CSV if path ends with ".csv", JSON otherwise.
+ * For the headless runs and tools/prof_compare. Returns false if file can't be written.
+ */
+bool dump_stats(const char* path);
+
+/**
+ * Hardware performance counters mode (Linux perf_event_open) : every thread
+ * opens it's own counters on the next begin(), and deltas between begin() and
+ * end() are counted for the zone (subzones included). When the kernel
+ * multiplexes the counters, deltas are scaled by the enabled / running time.
+ * Costs a syscall per begin()/end()! Off by default.
+ */
+void set_perf_counters(bool enabled);
+bool is_perf_counters();
+
+/**
+ * Sampling mode : every thread arms a SIGPROF timer (1 ms of thread CPU time)
+ * on the next step(), and the handler saves the backtrace with the open zone.
+ * Finds hot code, that is not covered by the zones. Off by default.
+ * Backtraces walk the frame pointers (signal safe) : build with
+ * -fno-omit-frame-pointer, stacks end at the code without them.
+ * Function names need the executable to be linked with -rdynamic.
+ */
+void set_sampling(bool enabled);
+bool is_sampling();
+
+/**
+ * Allocation tracking mode : global operator new/delete count allocations,
+ * bytes and frees for the zone on top of the stack of the current thread.
+ * Costs an atomic load per new/delete when off. Opt-in : operator new/delete
+ * are replaced only in the builds with PB_ALLOC_HOOK (cmake option) and
+ * without ASan. Elsewhere this logs a warning and stays off.
+ */
+void set_alloc_tracking(bool enabled);
+bool is_alloc_tracking();
+
+/**
+ * Spike detector : frame (time between step() calls of the thread) longer than
+ * the budget, or longer than ratio * median of the recent frames of this thread,
+ * is a spike. `after` frames later, frames around it are written from the history
+ * into <prefix>_<unix time>_<N>.json : frame times and zone breakdown of every frame.
+ * If tracing is on, trace of these frames goes to <prefix>_<unix time>_<N>_trace.json.
+ * Only threads with ThreadData::set_spike_detection(true) are watched (the main
+ * loop) : workers call step() before they sleep, so their frames are idle waits.
+ * Snapshot is written by the thread itself in it's step(), and this time is not
+ * counted in the next frame.
+ */
+struct SpikeConfig {
+	double budget = 0; // seconds, 0 = off
+	double ratio = 0; // of the rolling median, 0 = off
+	uint32_t before = 8, after = 8; // frames in the snapshot. before + after < HISTORY_LEN
+	const char* prefix = "spike"; // of the files. Not copied : must outlive the detector (static string)
+};
+void set_spike_detector(const SpikeConfig& cfg);
+SpikeConfig get_spike_detector();
+/** count of the detected spikes (snapshots) */
+size_t spikes_count();
+/** path of the last written snapshot, or empty string */
+std::string last_spike_path();
+
+/**
+ * Streaming mode : every step() also puts a summary of the frame (time,
+ * called zones, counters and gauges) into a lock-free queue, and the
+ * background thread sends it to the external viewer (tools/prof_view), so
+ * the profiler window doesn't have to be open. Profiler listens on the
+ * address : "unix:/path/to/socket", "port" (on 127.0.0.1), "127.0.0.1:port" or
+ * "[::1]:port". Other hosts are rejected : the stream is not authenticated.
+ * Nothing is queued while no viewer is connected. Wire format is in profiler_stream.hpp.
+ * Returns false if the socket can't be opened.
+ */
+bool start_stream(const char* address);
+void stop_stream();
+/** is the viewer connected? */
+bool is_streaming();
+
 #ifdef PROFILER_DEFINE_EXT
 
 /** convinient wrapper around initialization things above */
 inline auto make_thread_data() {
 	ThreadData data = init_thread_data();
 	struct __nnz {
-		ThreadData &master;
+		ThreadData master; // by value : data above dies on return
 		__nnz(ThreadData& d) : master(d) {}
 		~__nnz() {free_thread_data(master);}
 	}v (data);
@@ -151,22 +322,240 @@ struct prof_stats {
 	float sumtime = 0;	// how long this entry and all called subentries are
 									// executed
 	int ncalls = 0;	// number of "calls" to this entry
+	// allocation tracking mode : heap operations while this entry was on top (subentries EXCLUDED)
+	uint32_t allocs = 0;
+	uint32_t frees = 0;
+	uint64_t alloc_bytes = 0;
+	double value = 0; // counters and gauges : ZoneKind
 };
 
 /** this is how entry/zone is stored internally */
-using StatsStorage2 = std::map<const std::string*, prof_stats>;
+using StatsStorage2 = std::map<const ZoneDesc*, prof_stats>;
 using ThreadID = std::thread::id;
 
+/** count of registered zones. IDs are 0...zones_count()-1 */
+uint32_t zones_count();
+
+/** zone descriptor by ID, or nullptr */
+const ZoneDesc* get_zone(uint32_t id);
+
+/** samples of the sampling mode, aggregated by the zone and the function */
+struct SampleEntry {
+	const ZoneDesc* zone; // open zone, or nullptr
+	std::string function; // where the thread was (leaf frame)
+	uint64_t count;
+};
+
+/**
+ * Aggregates new samples from all threads, and returns everything aggregated
+ * since the last clear_samples(), most frequent first. Symbolization is slow
+ * on the first meet of the function!
+ */
+void get_samples(std::vector<SampleEntry>&);
+void clear_samples();
+
+/**
+ * Writes aggregated samples as folded stacks ("zone;outer;...;leaf count"
+ * lines), for flamegraph.pl, speedscope, etc. Returns false if file can't be written.
+ */
+bool export_folded(const char* path);
+
 /** return vector of all threads */
 void get_threads(std::vector<ThreadID>&);
 
+/** how many frames are kept in the history */
+static constexpr size_t HISTORY_LEN = 128;
+
 /** return length of history buffers (or (max position+1) in history/summary) */
 size_t history_size();
 
+/**
+ * Latency histograms : durations of the calls (with subzones) are counted
+ * in log buckets, HDR-style : 4 buckets per power of two, so error is < 25%.
+ * One histogram per zone per window of HIST_WINDOW frames.
+ */
+static constexpr size_t HIST_WINDOW = 16;
+static constexpr int HIST_SUB_BITS = 2;
+static constexpr uint32_t HIST_BUCKETS = 36 << HIST_SUB_BITS; // up to 2^37 ticks
+
+/** bucket of the duration in ticks */
+inline uint32_t hist_bucket(uint64_t ticks) {
+	if (ticks < (1u << HIST_SUB_BITS)) return uint32_t(ticks); // exact
+	int e = 63 - __builtin_clzll(ticks);
+	uint32_t b = uint32_t(e - HIST_SUB_BITS + 1) << HIST_SUB_BITS
+		| (uint32_t(ticks >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+	return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+/** middle of the bucket in ticks */
+inline double hist_bucket_value(uint32_t b) {
+	uint32_t octave = b >> HIST_SUB_BITS, sub = b & ((1u << HIST_SUB_BITS) - 1);
+	if (octave == 0) return sub;
+	double width = double(uint64_t(1) << (octave - 1));
+	return double((1u << HIST_SUB_BITS) + sub) * width + width * 0.5;
+}
+
+/** duration (seconds) at quantile q (0...1) of the histogram with HIST_BUCKETS buckets. 0 if empty */
+double hist_percentile(const uint64_t* buckets, double q);
+
+/**
+ * Counters of the perf counters mode. If hardware events are not available
+ * (VMs, containers), software ones are used in the same slots instead.
+ */
+enum class PerfKind : uint32_t {NONE, HARDWARE, SOFTWARE};
+enum PerfCounter {
+	PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES, PERF_BRANCH_MISSES,
+	PERF_COUNTERS,
+	// PerfKind::SOFTWARE
+	PERF_TASK_CLOCK = 0, // ns
+	PERF_PAGE_FAULTS = 1,
+	PERF_CONTEXT_SWITCHES = 2,
+};
+
+/** name of the counter, or nullptr if kind has no such counter */
+const char* perf_counter_name(PerfKind kind, int counter);
+
+/** all frames of one zone in one thread. Flat arrays, indexed by the history position. Times are in ticks */
+struct ZoneHistory {
+	std::atomic<uint64_t> owntime[HISTORY_LEN] = {};
+	std::atomic<uint64_t> sumtime[HISTORY_LEN] = {};
+	std::atomic<int> ncalls[HISTORY_LEN] = {};
+	std::atomic<uint64_t> perf[PERF_COUNTERS][HISTORY_LEN] = {};
+	std::atomic<uint32_t> allocs[HISTORY_LEN] = {};
+	std::atomic<uint32_t> frees[HISTORY_LEN] = {};
+	std::atomic<uint64_t> alloc_bytes[HISTORY_LEN] = {};
+	std::atomic<double> value[HISTORY_LEN] = {}; // counters and gauges
+	/** window W ends at position W * HIST_WINDOW + HIST_WINDOW - 1, and is written with it */
+	std::atomic<uint32_t> hist[HISTORY_LEN / HIST_WINDOW][HIST_BUCKETS] = {};
+};
+
+/** max count of the call tree nodes per thread. Calls over the limit go to the one "<overflow>" node */
+static constexpr uint32_t MAX_NODES = 4096;
+/** zone of the call tree root : calls without any zone around */
+static constexpr uint32_t NO_ZONE = ~uint32_t(0);
+
+/**
+ * All frames of one call tree node (zone, called from the parent node) in one thread.
+ * sumtime is inclusive (subzones too), owntime is exclusive. Ticks.
+ */
+struct NodeHistory {
+	std::atomic<uint64_t> owntime[HISTORY_LEN] = {};
+	std::atomic<uint64_t> sumtime[HISTORY_LEN] = {};
+	std::atomic<int> ncalls[HISTORY_LEN] = {};
+};
+
+/**
+ * History of one thread. Written by the owner thread in step(), readers never
+ * take locks : every position has it's own sequence lock (odd = being written).
+ * Never freed (even if thread is gone), so the pointer may be kept forever.
+ */
+struct ThreadHistory {
+	std::atomic<uint32_t> seq[HISTORY_LEN] = {};
+	std::atomic<uint32_t> pos = HISTORY_LEN - 1; // last written position
+	std::atomic<PerfKind> perf_kind = PerfKind::NONE; // of the counters in the ZoneHistory
+	std::atomic<uint64_t> frame[HISTORY_LEN] = {}; // duration of the frame, ticks
+	std::atomic<uint64_t> frame_end[HISTORY_LEN] = {}; // tsc::now() at the step()
+	std::atomic<const char*> name = nullptr; // ThreadData::set_name()
+	std::atomic<uint32_t> index = 0; // small number of the (last) thread
+	std::atomic<uint32_t> count = 0; // of the zones below
+	std::atomic<uint32_t> ids[MAX_ZONES] = {}; // zones, ever recorded in this thread
+	std::atomic<ZoneHistory*> zones[MAX_ZONES] = {}; // by zone ID
+	std::atomic<uint32_t> node_count = 0; // of the call tree nodes below. Node 0 is the root
+	std::atomic<uint32_t> node_parent[MAX_NODES] = {}; // parent node < node
+	std::atomic<uint32_t> node_zone[MAX_NODES] = {};
+	std::atomic<NodeHistory*> nodes[MAX_NODES] = {};
+
+	ThreadHistory() = default;
+	ThreadHistory(const ThreadHistory&) = delete;
+	~ThreadHistory() {
+		for (auto& z : zones) delete z.load(std::memory_order_relaxed);
+		for (auto& n : nodes) delete n.load(std::memory_order_relaxed);
+	}
+};
+
+/**
+ * Read-only view of one position in the thread history. Copies nothing :
+ * values are read straight from the ThreadHistory. If valid() is false after
+ * reading, position was rewritten in the meantime, and read must be retried
+ * with the new view.
+ */
+class HistoryView {
+	const ThreadHistory* h = nullptr;
+	uint32_t p = 0;
+	uint32_t seq = 0;
+	public:
+	HistoryView() = default;
+	HistoryView(const ThreadHistory* h, size_t pos);
+
+	explicit operator bool() const { return h; }
+	/** count of the zones, ever recorded in this thread. Most of them may have 0 calls here */
+	size_t size() const { return h ? h->count.load(std::memory_order_acquire) : 0; }
+	uint32_t zone_id(size_t i) const { return h->ids[i].load(std::memory_order_relaxed); }
+	const ZoneDesc* zone(size_t i) const { return get_zone(zone_id(i)); }
+	prof_stats stats(size_t i) const {
+		const ZoneHistory* z = h->zones[zone_id(i)].load(std::memory_order_acquire);
+		return {
+			float(tsc::to_seconds(z->owntime[p].load(std::memory_order_relaxed))),
+			float(tsc::to_seconds(z->sumtime[p].load(std::memory_order_relaxed))),
+			z->ncalls[p].load(std::memory_order_relaxed),
+			z->allocs[p].load(std::memory_order_relaxed),
+			z->frees[p].load(std::memory_order_relaxed),
+			z->alloc_bytes[p].load(std::memory_order_relaxed),
+			z->value[p].load(std::memory_order_relaxed)
+		};
+	}
+	/** seconds between this step() and the previous one */
+	double frame_time() const { return tsc::to_seconds(h->frame[p].load(std::memory_order_relaxed)); }
+	/** call tree nodes, ever recorded in this thread. Node 0 is the root, children have bigger numbers than parents */
+	size_t node_count() const { return h ? h->node_count.load(std::memory_order_acquire) : 0; }
+	uint32_t node_parent(size_t n) const { return h->node_parent[n].load(std::memory_order_relaxed); }
+	/** zone ID of the node, NO_ZONE for the root */
+	uint32_t node_zone(size_t n) const { return h->node_zone[n].load(std::memory_order_relaxed); }
+	/** owntime, sumtime (inclusive) and ncalls of the node. Root's sumtime is the time in all zones */
+	prof_stats node_stats(size_t n) const {
+		const NodeHistory* v = h->nodes[n].load(std::memory_order_acquire);
+		return {
+			float(tsc::to_seconds(v->owntime[p].load(std::memory_order_relaxed))),
+			float(tsc::to_seconds(v->sumtime[p].load(std::memory_order_relaxed))),
+			v->ncalls[p].load(std::memory_order_relaxed),
+			0, 0, 0
+		};
+	}
+	PerfKind perf_kind() const { return h ? h->perf_kind.load(std::memory_order_relaxed) : PerfKind::NONE; }
+	/** sum of the perf counter over all calls of the zone i */
+	uint64_t perf(size_t i, int counter) const {
+		const ZoneHistory* z = h->zones[zone_id(i)].load(std::memory_order_acquire);
+		return z->perf[counter][p].load(std::memory_order_relaxed);
+	}
+	/** is there a latency histogram window, that ends at this position? */
+	bool has_window() const { return p % HIST_WINDOW == HIST_WINDOW - 1; }
+	/**
+	 * Duration of the call (seconds, subzones included) at quantile q (0...1)
+	 * of the zone i, in the window that ends at this position. 0 if no calls.
+	 */
+	double percentile(size_t i, double q) const;
+	/** adds histogram of the zone i, in the window that ends at this position, to dst[HIST_BUCKETS] */
+	void add_histogram(size_t i, uint64_t* dst) const;
+	/** is everything read from the view until now consistent? */
+	bool valid() const {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return h && h->seq[p].load(std::memory_order_relaxed) == seq;
+	}
+	/** changes every time position is rewritten */
+	uint32_t version() const { return seq; }
+};
+
+/** history of the thread, or nullptr. Takes a lock : keep the result */
+const ThreadHistory* get_history(ThreadID);
+
+/** last written position in the history */
+inline size_t get_current_position(const ThreadHistory* h) {
+	return h ? h->pos.load(std::memory_order_acquire) : 0;
+}
+
 /**
  * Get statictics about all zones in one thread at specified position in time.
- * Calling this every frame is somewhat costly, but
- * it allows us to do minimal syncronisation possible :)
+ * This is a COPY : use get_history() and HistoryView to read it in place.
  * 
  * Returns no value if thread with this ID does not exist.
  * pos is in range of 0 to history_size()-1;
@@ -184,10 +573,25 @@ size_t get_current_position(ThreadID id);
 
 /*
  * MACRO MAGIC AT THE END
+ * name MUST be a constant : descriptor is made once per callsite.
+ * Use PROFILING_SCOPE_DYNAMIC() for names known only at runtime (slow!)
  */
 #include "engine/base.hpp"
 #define PROFILING_SCOPE_X(name, ctx) \
-auto ANONYMOUS(_PROF_ZONE_N) = ctx.make_zone(name);
+static pb::prof::ZoneDesc CONCAT(_PROF_DESC_, __LINE__)(name, __FILE__, __LINE__); \
+pb::prof::Zone CONCAT(_PROF_ZONE_, __LINE__)(ctx, CONCAT(_PROF_DESC_, __LINE__));
 
 #define PROFILING_SCOPE(name) \
-auto ANONYMOUS(_PROF_ZONE_N) = pb::prof::get_thread_data().make_zone(name);
+PROFILING_SCOPE_X(name, pb::prof::get_thread_data())
+
+/** counter/gauge with a static descriptor, in the current thread */
+#define PROFILING_COUNTER(name, delta) { \
+static pb::prof::ZoneDesc CONCAT(_PROF_DESC_, __LINE__)(name, __FILE__, __LINE__, pb::prof::ZoneKind::COUNTER); \
+pb::prof::get_thread_data().counter(CONCAT(_PROF_DESC_, __LINE__), delta); }
+
+#define PROFILING_GAUGE(name, value) { \
+static pb::prof::ZoneDesc CONCAT(_PROF_DESC_, __LINE__)(name, __FILE__, __LINE__, pb::prof::ZoneKind::GAUGE); \
+pb::prof::get_thread_data().gauge(CONCAT(_PROF_DESC_, __LINE__), value); }
+
+#define PROFILING_SCOPE_DYNAMIC(name) \
+pb::prof::Zone ANONYMOUS(_PROF_ZONE_N)(pb::prof::get_thread_data(), pb::prof::intern_zone(name));
@@ -0,0 +1,208 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Profiler allocation tracking : global operator new/delete hooks
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "profiler_impl.hpp"
+
+#include <cstdlib>
+#include <new>
+
+#ifdef __linux__
+#include <malloc.h>
+#endif
+
+#include <doctest.h>
+
+/*
+ * Replacement of operator new/delete is opt-in (cmake -DPB_ALLOC_HOOK=ON) : it
+ * takes over ASan's own operators, and alloc/dealloc mismatches are not
+ * reported anymore. Never compiled with the address sanitizer.
+ */
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define PB_ASAN 1
+#endif
+#endif
+#if defined(PB_ALLOC_HOOK) && !defined(__SANITIZE_ADDRESS__) && !defined(PB_ASAN)
+#define PB_ALLOC_HOOK_ON 1
+#endif
+
+namespace pb {
+
+namespace prof {
+
+void set_alloc_tracking(bool enabled) {
+#ifndef PB_ALLOC_HOOK_ON
+	if (enabled) LOG_WARN("Allocation tracking is not available in this build (needs PB_ALLOC_HOOK, without ASan)");
+	enabled = false;
+#endif
+	impl::alloc_tracking.store(enabled, std::memory_order_relaxed);
+}
+
+bool is_alloc_tracking() {
+	return impl::alloc_tracking.load(std::memory_order_relaxed);
+}
+
+};
+
+};
+
+#ifdef PB_ALLOC_HOOK_ON
+
+/*
+ * Replacement of the global operator new/delete : malloc() + counting.
+ * Frees are counted by the thread that frees, in it's current zone.
+ */
+namespace {
+
+inline size_t block_size(void* p, size_t requested) {
+#ifdef __linux__
+	(void)requested;
+	return malloc_usable_size(p);
+#else
+	(void)p;
+	return requested;
+#endif
+}
+
+inline void on_alloc(void* p, size_t size) {
+	if (!pb::prof::impl::alloc_tracking.load(std::memory_order_relaxed)) [[likely]] return;
+	pb::prof::DataImpl* data = pb::prof::impl::_data_ref;
+	if (data && p) data->count_alloc(block_size(p, size));
+}
+
+inline void on_free(void* p) {
+	if (!pb::prof::impl::alloc_tracking.load(std::memory_order_relaxed)) [[likely]] return;
+	pb::prof::DataImpl* data = pb::prof::impl::_data_ref;
+	if (data && p) data->count_free();
+}
+
+void* do_new(size_t size) {
+	if (size == 0) size = 1;
+	void* p;
+	while (!(p = malloc(size))) {
+		std::new_handler h = std::get_new_handler();
+		if (!h) throw std::bad_alloc();
+		h();
+	}
+	on_alloc(p, size);
+	return p;
+}
+
+void* do_new_aligned(size_t size, std::align_val_t align) {
+	size_t a = size_t(align) < sizeof(void*) ? sizeof(void*) : size_t(align);
+	if (size == 0) size = 1;
+	void* p;
+	while (posix_memalign(&p, a, size) != 0) {
+		std::new_handler h = std::get_new_handler();
+		if (!h) throw std::bad_alloc();
+		h();
+	}
+	on_alloc(p, size);
+	return p;
+}
+
+void do_delete(void* p) {
+	on_free(p);
+	free(p);
+}
+
+};
+
+void* operator new(size_t size) { return do_new(size); }
+void* operator new[](size_t size) { return do_new(size); }
+void* operator new(size_t size, std::align_val_t a) { return do_new_aligned(size, a); }
+void* operator new[](size_t size, std::align_val_t a) { return do_new_aligned(size, a); }
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+	try { return do_new(size); } catch (...) { return nullptr; }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+	try { return do_new(size); } catch (...) { return nullptr; }
+}
+void* operator new(size_t size, std::align_val_t a, const std::nothrow_t&) noexcept {
+	try { return do_new_aligned(size, a); } catch (...) { return nullptr; }
+}
+void* operator new[](size_t size, std::align_val_t a, const std::nothrow_t&) noexcept {
+	try { return do_new_aligned(size, a); } catch (...) { return nullptr; }
+}
+
+void operator delete(void* p) noexcept { do_delete(p); }
+void operator delete[](void* p) noexcept { do_delete(p); }
+void operator delete(void* p, size_t) noexcept { do_delete(p); }
+void operator delete[](void* p, size_t) noexcept { do_delete(p); }
+void operator delete(void* p, std::align_val_t) noexcept { do_delete(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { do_delete(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { do_delete(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { do_delete(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { do_delete(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { do_delete(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { do_delete(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { do_delete(p); }
+
+namespace pb {
+
+namespace prof {
+
+TEST_CASE("Profiler allocation tracking") {
+	auto prof_ctx = make_thread_data();
+	ThreadData prof = get_thread_data();
+	static ZoneDesc outer("Test::Allocating");
+	static ZoneDesc inner("Test::Inner");
+	const ThreadHistory* h = get_history(std::this_thread::get_id());
+
+	set_alloc_tracking(true);
+	{
+		auto z = prof.make_zone(outer);
+		// volatile : new/delete pairs may be elided by the optimizer otherwise
+		for (int i = 0; i < 10; i++) {
+			int* volatile p = new int[100];
+			delete[] p;
+		}
+		auto y = prof.make_zone(inner); // not counted in the outer one
+		int* volatile p = new int;
+		delete p;
+	}
+	set_alloc_tracking(false);
+	prof.step();
+
+	HistoryView view(h, get_current_position(h));
+	prof_stats a, b;
+	for (size_t i = 0; i < view.size(); i++) {
+		if (view.zone(i) == &outer) a = view.stats(i);
+		if (view.zone(i) == &inner) b = view.stats(i);
+	}
+	REQUIRE(a.allocs == 10);
+	REQUIRE(a.frees == 10);
+	REQUIRE(a.alloc_bytes >= 10 * 100 * sizeof(int));
+	REQUIRE(b.allocs == 1);
+	REQUIRE(b.frees == 1);
+}
+
+};
+
+};
+
+#else
+
+TEST_CASE("Profiler allocation tracking") {
+	pb::prof::set_alloc_tracking(true); // no hook : stays off
+	REQUIRE(!pb::prof::is_alloc_tracking());
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Profiler stats dump : CSV reader (see dump_stats())
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Shared with tools/prof_compare : no engine includes here.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+
+namespace pb {
+namespace prof {
+namespace csv {
+
+/** splits one CSV line into the fields, "" escapes in quoted fields */
+inline std::vector<std::string> split_line(const char* s) {
+	std::vector<std::string> out(1);
+	bool quoted = false;
+	for (; *s && *s != '\n' && *s != '\r'; s++) {
+		if (quoted) {
+			if (*s == '"' && s[1] == '"') out.back() += *s++;
+			else if (*s == '"') quoted = false;
+			else out.back() += *s;
+		} else if (*s == '"') quoted = true;
+		else if (*s == ',') out.emplace_back();
+		else out.back() += *s;
+	}
+	return out;
+}
+
+};
+};
+};
@@ -0,0 +1,241 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Profiler stats dump : JSON/CSV for headless runs and regression checks
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "profiler_impl.hpp"
+#include "profiler_csv.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <doctest.h>
+
+namespace pb {
+
+namespace prof {
+
+namespace {
+
+/** one zone in one thread, over the whole history */
+struct ZoneAgg {
+	uint32_t id;
+	uint64_t calls = 0;
+	uint64_t allocs = 0;
+	double sumtime = 0;
+	double owntime = 0;
+	uint64_t hist[HIST_BUCKETS] = {};
+};
+
+struct ThreadAgg {
+	std::string name;
+	uint32_t frames = 0; // written history positions
+	std::vector<ZoneAgg> zones;
+};
+
+void aggregate(const ThreadHistory* h, ThreadAgg& dst) {
+	for (size_t pos = 0; pos < HISTORY_LEN; pos++) {
+		HistoryView view;
+		std::vector<ZoneAgg> frame;
+		do { // seqlock retry of this position
+			view = HistoryView(h, pos);
+			frame.clear();
+			if (view.version() == 0) break; // never written
+			for (size_t i = 0; i < view.size(); i++) {
+				prof_stats s = view.stats(i);
+				ZoneAgg& z = frame.emplace_back();
+				z.id = view.zone_id(i);
+				z.calls = s.ncalls;
+				z.allocs = s.allocs;
+				z.sumtime = s.sumtime;
+				z.owntime = s.owntime;
+				if (view.has_window()) view.add_histogram(i, z.hist);
+			}
+		} while (!view.valid());
+		if (view.version() == 0) continue;
+
+		dst.frames++;
+		if (dst.zones.size() < frame.size()) {
+			for (size_t i = dst.zones.size(); i < frame.size(); i++) dst.zones.emplace_back().id = frame[i].id;
+		}
+		for (size_t i = 0; i < frame.size(); i++) { // same order : ids are only appended
+			ZoneAgg& z = dst.zones[i];
+			z.calls += frame[i].calls;
+			z.allocs += frame[i].allocs;
+			z.sumtime += frame[i].sumtime;
+			z.owntime += frame[i].owntime;
+			for (uint32_t b = 0; b < HIST_BUCKETS; b++) z.hist[b] += frame[i].hist[b];
+		}
+	}
+}
+
+void collect(std::vector<ThreadAgg>& threads) {
+	std::vector<std::pair<uint32_t, const ThreadHistory*>> list;
+	{
+		auto ruse = impl::histories.use(); // lock
+		for (auto& [_, h] : ruse.ref) list.emplace_back(h->index.load(std::memory_order_relaxed), h);
+	}
+	std::sort(list.begin(), list.end());
+
+	for (auto& [index, h] : list) {
+		ThreadAgg& t = threads.emplace_back();
+		const char* name = h->name.load(std::memory_order_relaxed);
+		t.name = name ? name : "Thread " + std::to_string(index);
+		aggregate(h, t);
+	}
+}
+
+/** CSV field : quoted if needed */
+void write_csv(FILE* f, const char* s) {
+	if (!strpbrk(s, ",\"\n")) {
+		fputs(s, f);
+		return;
+	}
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"') fputc('"', f);
+		fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+};
+
+/*
+ * Columns (times are in ms) :
+ * mean/own_mean per call, frame = total time per frame, calls and allocs per frame,
+ * percentiles of the call duration over all histogram windows.
+ */
+bool dump_stats(const char* path) {
+	std::vector<ThreadAgg> threads;
+	collect(threads);
+
+	FILE* f = fopen(path, "w");
+	if (!f) {
+		LOG_ERROR("Can't write profiler stats to %s", path);
+		return false;
+	}
+
+	size_t len = strlen(path);
+	bool csv = len >= 4 && strcmp(path + len - 4, ".csv") == 0;
+
+	if (csv) fprintf(f, "thread,zone,file,line,frames,calls_per_frame,mean_ms,own_mean_ms,frame_ms,p50_ms,p95_ms,p99_ms,allocs_per_frame\n");
+	else fprintf(f, "{\"threads\":[");
+
+	bool first_thread = true;
+	for (auto& t : threads) {
+		if (!csv) {
+			fprintf(f, "%s\n{\"name\":", first_thread ? "" : ",");
+			impl::write_json_string(f, t.name.c_str());
+			fprintf(f, ",\"frames\":%u,\"zones\":[", t.frames);
+		}
+		first_thread = false;
+
+		bool first_zone = true;
+		for (auto& z : t.zones) {
+			const ZoneDesc* desc = get_zone(z.id);
+			if (!desc || desc->kind != ZoneKind::ZONE || !z.calls || !t.frames) continue; // no counters here
+			double calls = double(z.calls), frames = double(t.frames);
+			double v[] = {
+				calls / frames,
+				z.sumtime / calls * 1e3, z.owntime / calls * 1e3, z.sumtime / frames * 1e3,
+				hist_percentile(z.hist, 0.5) * 1e3, hist_percentile(z.hist, 0.95) * 1e3,
+				hist_percentile(z.hist, 0.99) * 1e3,
+				double(z.allocs) / frames
+			};
+
+			if (csv) {
+				write_csv(f, t.name.c_str());
+				fputc(',', f);
+				write_csv(f, desc->name);
+				fputc(',', f);
+				write_csv(f, desc->file ? desc->file : "");
+				fprintf(f, ",%i,%u", desc->line, t.frames);
+				for (double x : v) fprintf(f, ",%.6g", x);
+				fputc('\n', f);
+				continue;
+			}
+
+			fprintf(f, "%s\n {\"name\":", first_zone ? "" : ",");
+			impl::write_json_string(f, desc->name);
+			fprintf(f, ",\"file\":");
+			impl::write_json_string(f, desc->file ? desc->file : "");
+			fprintf(f, ",\"line\":%i,\"calls_per_frame\":%.6g,\"mean_ms\":%.6g,\"own_mean_ms\":%.6g,"
+				"\"frame_ms\":%.6g,\"p50_ms\":%.6g,\"p95_ms\":%.6g,\"p99_ms\":%.6g,\"allocs_per_frame\":%.6g}",
+				desc->line, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+			first_zone = false;
+		}
+		if (!csv) fprintf(f, "]}");
+	}
+	if (!csv) fprintf(f, "\n]}\n");
+
+	bool ok = !ferror(f);
+	if (fclose(f) != 0) ok = false;
+	if (!ok) {
+		LOG_ERROR("Can't write profiler stats to %s", path);
+		return false;
+	}
+	return true;
+}
+
+TEST_CASE("Profiler dump") {
+	auto prof_ctx = make_thread_data();
+	ThreadData prof = get_thread_data();
+	prof.set_name("Dump, \"test\"");
+	static ZoneDesc zone("Test::Dumped");
+	for (size_t i = 0; i < HISTORY_LEN; i++) { // whole history : older frames of this thread ID are overwritten
+		prof.make_zone(zone);
+		prof.make_zone(zone);
+		prof.step();
+	}
+
+	const char* path = "pb_test_dump.csv";
+	REQUIRE(dump_stats(path));
+	FILE* f = fopen(path, "r");
+	REQUIRE(f);
+	char line[1024];
+	REQUIRE(fgets(line, sizeof(line), f));
+	auto header = csv::split_line(line);
+	REQUIRE(header.size() == 13);
+	REQUIRE(header[4] == "frames");
+	REQUIRE(header[5] == "calls_per_frame");
+	bool found = false;
+	while (fgets(line, sizeof(line), f)) {
+		auto row = csv::split_line(line);
+		if (row.size() < 2 || row[1] != "Test::Dumped") continue;
+		found = true;
+		REQUIRE(row.size() == header.size());
+		REQUIRE(row[0] == "Dump, \"test\"");
+		REQUIRE(atoi(row[4].c_str()) == int(HISTORY_LEN));
+		REQUIRE(atof(row[5].c_str()) == 2.0);
+	}
+	fclose(f);
+	remove(path);
+	REQUIRE(found);
+
+	path = "pb_test_dump.json";
+	REQUIRE(dump_stats(path));
+	remove(path);
+}
+
+};
+
+};
@@ -0,0 +1,346 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Execution time profiler : internal data structures.
+ * Copyright (C) 2023-2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Shared between profiler*.cpp files ONLY. Don't include it anywhere else!
+ */
+
+#pragma once
+#include "base.hpp"
+#define PROFILER_DEFINE_EXT
+#include "profiler.hpp"
+#include "sync.hpp"
+#include "tsc.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "engine/hashmap.hpp"
+
+namespace pb {
+
+namespace prof {
+
+using Thread = std::thread;
+
+/** zone call on the stack */
+struct prof_item {
+	uint32_t zone;	// where to write a results
+	uint32_t node;	// in the call tree
+	uint64_t time; // tsc::now() ticks
+	uint64_t start; // of the call, for the latency histogram
+};
+
+namespace impl {
+	inline ThreadID curr_id() {return ::std::this_thread::get_id();}	
+};
+
+/**
+ * Per-thread ring of the trace events. Owner thread writes, exporter reads
+ * without locks : it validates what it has read against the head afterwards.
+ */
+struct TraceRing {
+	static constexpr size_t SIZE = 1 << 16; // events per thread
+
+	struct Event {
+		std::atomic<uint64_t> time; // ticks
+		std::atomic<uint32_t> code; // zone << 1 | is_end
+	};
+
+	std::atomic<uint64_t> head = 0; // count of events ever written
+	Event events[SIZE];
+
+	/** owner thread only */
+	inline void push(uint64_t time, uint32_t zone, bool end) {
+		uint64_t h = head.load(std::memory_order_relaxed);
+		auto& e = events[h & (SIZE - 1)];
+		e.time.store(time, std::memory_order_relaxed);
+		e.code.store(zone << 1 | uint32_t(end), std::memory_order_relaxed);
+		head.store(h + 1, std::memory_order_release);
+	}
+};
+
+/**
+ * Per-thread ring of the stack samples. Written by the SIGPROF handler on the
+ * owner thread, read by collect_samples() the same way as TraceRing.
+ */
+struct SampleRing {
+	static constexpr size_t SIZE = 1 << 11; // samples per thread
+	static constexpr int MAX_FRAMES = 32;
+
+	struct Sample {
+		std::atomic<uint32_t> zone; // open zone, or NO_ZONE
+		std::atomic<uint32_t> nframes;
+		std::atomic<uintptr_t> frames[MAX_FRAMES]; // leaf first
+	};
+	static constexpr uint32_t NO_ZONE = ~uint32_t(0);
+
+	std::atomic<uint64_t> head = 0; // count of samples ever written
+	Sample samples[SIZE];
+};
+
+/** prof_stats of the current frame, in ticks. Converted to seconds only by readers */
+struct tick_stats {
+	uint64_t owntime = 0;
+	uint64_t sumtime = 0;
+	int ncalls = 0;
+	uint32_t allocs = 0;
+	uint32_t frees = 0;
+	uint64_t alloc_bytes = 0;
+};
+
+/** zone in one thread. Allocated on the first call of the zone in this thread */
+struct ZoneState {
+	tick_stats stats; // current frame
+	ZoneKind kind = ZoneKind::ZONE;
+	double value = 0; // counters : current frame, gauges : last one
+	uint32_t hist[HIST_BUCKETS] = {}; // current histogram window
+	uint64_t perf[PERF_COUNTERS] = {}; // current frame
+};
+
+/** perf_event_open() counters of one thread. See profiler_perf.cpp */
+struct PerfGroup {
+	PerfKind kind = PerfKind::NONE;
+	int leader = -1;
+	int fds[PERF_COUNTERS];
+	int slots[PERF_COUNTERS]; // counter slot of the N-th value in the group
+	int count = 0;
+	uint64_t at[MAX_DEPTH][PERF_COUNTERS]; // values on begin()
+	uint64_t times_at[MAX_DEPTH][2]; // enabled and running time on begin()
+	bool valid[MAX_DEPTH] = {}; // begin() was counted
+
+	/** opens hardware counters, or software ones. nullptr if nothing is available */
+	static PerfGroup* open();
+	~PerfGroup();
+	/** values by the counter slots, and times[2] : enabled, running (ns) */
+	bool read(uint64_t* dst, uint64_t* times);
+	/**
+	 * delta of the counter, scaled up by enabled / running time : the kernel
+	 * multiplexes groups, when there are more events than hardware counters.
+	 */
+	static uint64_t scaled(uint64_t delta, uint64_t enabled, uint64_t running) {
+		if (running == 0 || running >= enabled) return running ? delta : 0;
+		return uint64_t(double(delta) * double(enabled) / double(running));
+	}
+};
+
+/** per-thread profiler data. We assume that only owning thread will access this data. */
+/** call tree node of the thread : zone, called from the parent node. Same IDs as in the ThreadHistory */
+struct CallNode {
+	uint32_t zone;
+	uint32_t parent;
+	uint32_t first_child = 0; // 0 = none : root is nobody's child
+	uint32_t next_sibling = 0;
+	uint64_t owntime = 0; // ticks, this frame
+	int ncalls = 0;
+};
+
+/** frames in the spike detector median */
+static constexpr uint32_t SPIKE_WINDOW = 64;
+
+struct DataImpl {
+	public:
+	const ThreadID key;
+	const uint32_t index; // small number of the thread, for humans
+	const char* name = nullptr;
+	prof_item stack[MAX_DEPTH];
+	int depth = 0; // may be > MAX_DEPTH, deeper zones are not recorded
+	ZoneState* zones[MAX_ZONES] = {}; // by zone ID
+	std::vector<uint32_t> used; // IDs of allocated zones
+	std::vector<CallNode> nodes; // call tree, [0] is the root
+	std::vector<uint64_t> node_sums; // step() temporary : inclusive times
+	ThreadHistory* const history; // shared with readers
+	double tick_time; // when was ticked last time. if > 5 seconds, we can remove thread.
+	std::atomic<TraceRing*> trace = nullptr; // allocated by the owner, when tracing is enabled
+	PerfGroup* perf = nullptr; // opened by the owner, when perf counters are enabled
+	bool perf_failed = false; // don't try again
+	std::atomic<SampleRing*> samples = nullptr; // allocated by the owner, when sampling is enabled
+	void* sample_timer = nullptr; // timer_t, armed when sampling is enabled
+	uintptr_t stack_lo = 0, stack_hi = 0; // of this thread, for take_sample()
+	bool sampling_on = false; // timer was requested (may have failed)
+	bool alloc_muted = false; // profiler allocates by itself : not counted for the zones
+	uint64_t frame_start; // tsc::now() at the last step()
+	uint64_t recent[SPIKE_WINDOW] = {}; // last frame times, for the spike detector median
+	uint32_t nrecent = 0;
+	int spike_pos = -1; // history position of the spike, that waits for the frames after it
+	uint32_t spike_left = 0;
+	uint64_t spike_median = 0;
+	bool spike_watch = false; // ThreadData::set_spike_detection()
+	SpikeConfig spike_cfg; // copy of impl::spikes.cfg
+	uint32_t spike_cfg_version = 0; // impl::spike_version of the copy
+	public:
+	DataImpl(ThreadID id, uint32_t index, ThreadHistory* history) : key(id), index(index), history(history), frame_start(tsc::now()) {load_tree();}
+	DataImpl(const DataImpl&) = delete;
+	~DataImpl() {
+		for (uint32_t id : used) delete zones[id];
+		stop_sampling();
+		delete trace.load(std::memory_order_relaxed);
+		delete perf;
+		delete samples.load(std::memory_order_relaxed);
+	}
+	private:
+	uint64_t use() {
+		return tsc::now();
+	}
+	/** get statictics for a given zone,
+	  * or create new one */
+	inline tick_stats& stat(uint32_t id) {
+		ZoneState* z = zones[id];
+		if (!z) [[unlikely]] z = new_zone(id);
+		return z->stats;
+	}
+	inline ZoneState& state(uint32_t id) {
+		ZoneState* z = zones[id];
+		if (!z) [[unlikely]] z = new_zone(id);
+		return *z;
+	}
+	ZoneState* new_zone(uint32_t id) {
+		alloc_muted = true;
+		used.push_back(id);
+		zones[id] = new ZoneState();
+		alloc_muted = false;
+		const ZoneDesc* desc = get_zone(id);
+		if (desc) zones[id]->kind = desc->kind;
+		return zones[id];
+	}
+	/** node of the zone, called from the parent node. Creates it, if needed */
+	inline uint32_t child_node(uint32_t parent, uint32_t zone) {
+		for (uint32_t n = nodes[parent].first_child; n; n = nodes[n].next_sibling)
+			if (nodes[n].zone == zone) return n;
+		return new_node(parent, zone);
+	}
+	uint32_t new_node(uint32_t parent, uint32_t zone);
+	/** call tree of the previous thread with this ID, to keep node IDs of the history */
+	void load_tree();
+	/** perf counters on begin()/end() of the zone on the stack index d */
+	void perf_begin(int d);
+	void perf_end(int d, ZoneState& zone);
+	/** arms/disarms the sampling timer of this thread. Owner only */
+	void start_sampling();
+	void stop_sampling();
+	/** spike detector, after the frame at the history position pos is written */
+	void check_spike(uint32_t pos, uint64_t frame);
+	void write_spike(const SpikeConfig& cfg);
+	/** streaming mode : summary of the frame into the queue of the sender. Lock-free */
+	void stream_frame(uint64_t frame);
+	/** records trace event, if tracing is enabled */
+	inline void trace_event(uint64_t time, uint32_t zone, bool end);
+	/** is there any (recorded) zone call? */
+	inline bool have() {
+		return depth > 0;
+	}
+	/** get zone call on top of the stack */
+	inline prof_item& get() {
+		return stack[(depth < MAX_DEPTH ? depth : MAX_DEPTH) - 1];
+	}
+	public:
+	ThreadData get_wrapper() {
+		return ThreadData(*this);
+	}
+	/** API */
+	void begin(uint32_t zone);
+	void end();
+	void counter(uint32_t zone, double delta) {
+		ZoneState& z = state(zone);
+		z.value += delta;
+		z.stats.ncalls++;
+	}
+	void gauge(uint32_t zone, double value) {
+		ZoneState& z = state(zone);
+		z.value = value;
+		z.stats.ncalls++;
+	}
+	void step();
+	/** SIGPROF handler : writes the sample. pc is the interrupted instruction of THIS thread */
+	void take_sample(uintptr_t pc, uintptr_t fp);
+	/** operator new/delete hooks. Must not allocate! */
+	inline void count_alloc(size_t bytes) {
+		if (!have() || alloc_muted) return;
+		tick_stats& s = zones[get().zone]->stats;
+		s.allocs++;
+		s.alloc_bytes += bytes;
+	}
+	inline void count_free() {
+		if (have() && !alloc_muted) zones[get().zone]->stats.frees++;
+	}
+	/** private extended */
+	void newframe();
+};
+
+namespace impl {
+	extern Resource<std::map<ThreadID, DataImpl>, SpinLock> prof_data;
+	extern std::atomic<bool> tracing;
+	extern std::atomic<bool> perf_counters;
+	extern std::atomic<bool> sampling;
+	extern std::atomic<bool> alloc_tracking;
+	extern std::atomic<bool> spike_detect; // any criteria of the config is on
+	extern std::atomic<uint32_t> spike_version; // bumped on every set_spike_detector()
+	extern std::atomic<bool> streaming; // viewer is connected to the stream
+	struct SpikeState {
+		SpikeConfig cfg;
+		size_t count = 0;
+		std::string last;
+	};
+	extern Resource<SpikeState, SpinLock> spikes;
+	/** JSON string with quotes, escaped */
+	void write_json_string(FILE* f, const char* s);
+	/** ThreadData of the current thread, if it was already used. Also used by the SIGPROF handler */
+	extern thread_local DataImpl* _data_ref;
+	/** histories of all threads, ever registered. Freed only at exit */
+	struct HistoryMap : public std::map<ThreadID, ThreadHistory*> {
+		~HistoryMap() {
+			for (auto& [_, h] : *this) delete h;
+		}
+	};
+	extern Resource<HistoryMap, SpinLock> histories;
+
+	/** all the zone descriptors. Lock is taken on registration only */
+	struct Registry {
+		std::mutex lock;
+		std::atomic<ZoneDesc*> zones[MAX_ZONES] = {};
+		std::atomic<uint32_t> count = 0;
+		pb::HashMap<std::string_view, ZoneDesc*> named; // intern_zone() ones
+		ZoneDesc overflow = ZoneDesc(uint32_t(0), "<overflow>"); // zones over the MAX_ZONES limit
+		Registry() {
+			zones[0].store(&overflow);
+			count.store(1);
+		}
+	};
+
+	Registry& registry();
+};
+
+inline void DataImpl::trace_event(uint64_t time, uint32_t zone, bool end) {
+	if (!impl::tracing.load(std::memory_order_relaxed)) [[likely]] return;
+	TraceRing* ring = trace.load(std::memory_order_relaxed);
+	if (!ring) [[unlikely]] {
+		ring = new TraceRing();
+		trace.store(ring, std::memory_order_release);
+	}
+	ring->push(time, zone, end);
+}
+
+};
+
+};
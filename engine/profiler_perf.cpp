@@ -0,0 +1,219 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Profiler perf counters mode : perf_event_open() counters per zone
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "profiler_impl.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <doctest.h>
+
+namespace pb {
+
+namespace prof {
+
+void set_perf_counters(bool enabled) {
+	impl::perf_counters.store(enabled, std::memory_order_relaxed);
+}
+
+bool is_perf_counters() {
+	return impl::perf_counters.load(std::memory_order_relaxed);
+}
+
+const char* perf_counter_name(PerfKind kind, int counter) {
+	static const char* hardware[PERF_COUNTERS] = {"Cycles", "Instructions", "L1D misses", "LLC misses", "Branch misses"};
+	static const char* software[PERF_COUNTERS] = {"Task clock, ns", "Page faults", "Context switches", nullptr, nullptr};
+	if (counter < 0 || counter >= PERF_COUNTERS) return nullptr;
+	if (kind == PerfKind::HARDWARE) return hardware[counter];
+	if (kind == PerfKind::SOFTWARE) return software[counter];
+	return nullptr;
+}
+
+#ifdef __linux__
+
+namespace {
+
+struct EventDesc {
+	uint32_t type;
+	uint64_t config;
+};
+
+static constexpr uint64_t cache_event(uint64_t cache, uint64_t op, uint64_t result) {
+	return cache | (op << 8) | (result << 16);
+}
+
+// by the counter slot. First one is the group leader
+static const EventDesc hardware_events[PERF_COUNTERS] = {
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static const EventDesc software_events[] = {
+	{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+	{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+	{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+int open_event(const EventDesc& e, int group) {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = e.type;
+	attr.config = e.config;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.exclude_kernel = 1; // allowed with perf_event_paranoid = 2
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0); // this thread, any CPU
+}
+
+/** opens the group of events. Leader is required, the rest is optional */
+bool open_group(PerfGroup& g, const EventDesc* events, int n) {
+	g.leader = open_event(events[0], -1);
+	if (g.leader < 0) return false;
+	g.fds[0] = g.leader;
+	g.slots[0] = 0;
+	g.count = 1;
+	for (int i = 1; i < n; i++) {
+		int fd = open_event(events[i], g.leader);
+		if (fd < 0) continue; // not supported : stays 0
+		g.fds[g.count] = fd;
+		g.slots[g.count] = i;
+		g.count++;
+	}
+	return true;
+}
+
+};
+
+PerfGroup* PerfGroup::open() {
+	auto* g = new PerfGroup();
+	if (open_group(*g, hardware_events, PERF_COUNTERS)) {
+		g->kind = PerfKind::HARDWARE;
+	} else if (open_group(*g, software_events, sizeof(software_events) / sizeof(software_events[0]))) {
+		g->kind = PerfKind::SOFTWARE;
+	} else {
+		LOG_WARN("perf_event_open() failed : no perf counters in the profiler (%s)", strerror(errno));
+		delete g;
+		return nullptr;
+	}
+	LOG_DEBUG("Profiler : %i %s perf counters are opened", g->count,
+		g->kind == PerfKind::HARDWARE ? "hardware" : "software");
+	return g;
+}
+
+PerfGroup::~PerfGroup() {
+	for (int i = 0; i < count; i++) close(fds[i]);
+}
+
+bool PerfGroup::read(uint64_t* dst, uint64_t* times) {
+	uint64_t buff[3 + PERF_COUNTERS]; // nr, time enabled, time running, values...
+	if (::read(leader, buff, sizeof(buff)) < ssize_t(3 * sizeof(uint64_t))) return false;
+	int n = int(buff[0]) < count ? int(buff[0]) : count;
+	times[0] = buff[1];
+	times[1] = buff[2];
+	for (int i = 0; i < n; i++) dst[slots[i]] = buff[3 + i];
+	return true;
+}
+
+#else
+
+PerfGroup* PerfGroup::open() {
+	LOG_WARN("No perf counters on this platform");
+	return nullptr;
+}
+
+PerfGroup::~PerfGroup() {}
+
+bool PerfGroup::read(uint64_t*, uint64_t*) {
+	return false;
+}
+
+#endif
+
+void DataImpl::perf_begin(int d) {
+	if (!impl::perf_counters.load(std::memory_order_relaxed)) {
+		if (perf) perf->valid[d] = false; // mode is off now
+		return;
+	}
+	if (!perf) {
+		if (perf_failed) return;
+		perf = PerfGroup::open();
+		if (!perf) {
+			perf_failed = true;
+			return;
+		}
+	}
+	memset(perf->at[d], 0, sizeof(perf->at[d]));
+	perf->valid[d] = perf->read(perf->at[d], perf->times_at[d]);
+}
+
+void DataImpl::perf_end(int d, ZoneState& zone) {
+	if (!perf->valid[d]) return;
+	perf->valid[d] = false;
+	uint64_t now[PERF_COUNTERS] = {}, times[2];
+	if (!perf->read(now, times)) return;
+	uint64_t enabled = times[0] - perf->times_at[d][0], running = times[1] - perf->times_at[d][1];
+	for (int c = 0; c < PERF_COUNTERS; c++)
+		zone.perf[c] += PerfGroup::scaled(now[c] - perf->at[d][c], enabled, running);
+}
+
+TEST_CASE("Profiler perf counters") {
+	auto prof_ctx = make_thread_data();
+	ThreadData prof = get_thread_data();
+	static ZoneDesc zone("Test::Perf");
+	const ThreadHistory* h = get_history(std::this_thread::get_id());
+
+	// counted a quarter of the time : estimate for the whole
+	REQUIRE(PerfGroup::scaled(100, 400, 100) == 400);
+	REQUIRE(PerfGroup::scaled(100, 400, 400) == 100);
+	REQUIRE(PerfGroup::scaled(100, 400, 0) == 0);
+
+	set_perf_counters(true);
+	volatile uint64_t sink = 0;
+	for (int i = 0; i < 4; i++) {
+		auto z = prof.make_zone(zone);
+		for (int j = 0; j < 100000; j++) sink = sink + j;
+	}
+	set_perf_counters(false);
+	prof.step();
+
+	HistoryView view(h, get_current_position(h));
+	size_t i = 0;
+	while (view.zone(i) != &zone) i++;
+	if (view.perf_kind() == PerfKind::NONE) {
+		MESSAGE("perf_event_open() is not available, perf counters are not tested");
+		return;
+	}
+	// instructions or task clock : both are not 0 after such loop
+	REQUIRE(view.perf(i, view.perf_kind() == PerfKind::HARDWARE ? PERF_INSTRUCTIONS : PERF_TASK_CLOCK) > 0);
+	REQUIRE(perf_counter_name(view.perf_kind(), 0));
+}
+
+};
+
+};
@@ -0,0 +1,413 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Profiler sampling mode : SIGPROF timers and frame pointer backtraces
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "profiler_impl.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <csignal>
+#include <ctime>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+#include <doctest.h>
+
+namespace pb {
+
+namespace prof {
+
+static constexpr long SAMPLE_INTERVAL_NS = 1000000; // of the thread CPU time
+
+void set_sampling(bool enabled) {
+	impl::sampling.store(enabled, std::memory_order_relaxed);
+}
+
+bool is_sampling() {
+	return impl::sampling.load(std::memory_order_relaxed);
+}
+
+#ifdef __linux__
+
+namespace {
+
+/** interrupted instruction and frame pointer (rbp/ebp/x29). Zeroes on unknown CPU */
+void interrupted_regs(void* ucontext, uintptr_t& pc, uintptr_t& fp) {
+	auto* uc = static_cast<ucontext_t*>(ucontext);
+#if defined(__x86_64__)
+	pc = uc->uc_mcontext.gregs[REG_RIP];
+	fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__i386__)
+	pc = uc->uc_mcontext.gregs[REG_EIP];
+	fp = uc->uc_mcontext.gregs[REG_EBP];
+#elif defined(__aarch64__)
+	pc = uc->uc_mcontext.pc;
+	fp = uc->uc_mcontext.regs[29];
+#else
+	(void)uc;
+	pc = fp = 0;
+#endif
+}
+
+void sigprof_handler(int, siginfo_t*, void* ucontext) {
+	int saved = errno;
+	DataImpl* data = impl::_data_ref; // nullptr while thread is unregistering
+	if (data) {
+		uintptr_t pc, fp;
+		interrupted_regs(ucontext, pc, fp);
+		data->take_sample(pc, fp);
+	}
+	errno = saved;
+}
+
+void install_handler() {
+	static std::once_flag once;
+	std::call_once(once, [](){
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = sigprof_handler;
+		sa.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGPROF, &sa, nullptr) != 0)
+			LOG_ERROR("Can't install SIGPROF handler : %s", strerror(errno));
+	});
+}
+
+};
+
+/*
+ * Signal handler context : no locks, no allocations, no unwinder (glibc
+ * backtrace() takes the loader lock). Walks the frame pointer chain of the
+ * interrupted code : [fp] is the caller's fp, [fp + 1] is the return address.
+ * Every fp must be inside this thread's stack and grow up, so garbage (code
+ * without frame pointers, like libc) ends the walk instead of a crash.
+ * Build with -fno-omit-frame-pointer (CMake does) to get the whole stacks.
+ * Not instrumented : ASan would complain about reading the other frames.
+ * Writes the sample the same way as TraceRing::push()
+ */
+__attribute__((no_sanitize("address")))
+void DataImpl::take_sample(uintptr_t pc, uintptr_t fp) {
+	SampleRing* ring = samples.load(std::memory_order_relaxed);
+	if (!ring || !pc) return;
+
+	uintptr_t frames[SampleRing::MAX_FRAMES];
+	int n = 0;
+	frames[n++] = pc;
+	while (n < SampleRing::MAX_FRAMES) {
+		if (fp < stack_lo || fp > stack_hi - 2 * sizeof(uintptr_t) || fp % sizeof(uintptr_t)) break;
+		const uintptr_t* frame = reinterpret_cast<const uintptr_t*>(fp);
+		uintptr_t ret = frame[1], next = frame[0];
+		if (!ret) break;
+		frames[n++] = ret;
+		if (next <= fp) break; // callers are higher on the stack
+		fp = next;
+	}
+
+	int d = depth;
+	uint32_t zone = d > 0 ? stack[(d < MAX_DEPTH ? d : MAX_DEPTH) - 1].zone : SampleRing::NO_ZONE;
+
+	uint64_t h = ring->head.load(std::memory_order_relaxed);
+	auto& s = ring->samples[h & (SampleRing::SIZE - 1)];
+	s.zone.store(zone, std::memory_order_relaxed);
+	s.nframes.store(n, std::memory_order_relaxed);
+	for (int i = 0; i < n; i++) s.frames[i].store(frames[i], std::memory_order_relaxed);
+	ring->head.store(h + 1, std::memory_order_release);
+}
+
+void DataImpl::start_sampling() {
+	sampling_on = true;
+	install_handler();
+	if (!stack_hi) { // bounds for the frame pointer walk. Not in the handler : this allocates
+		pthread_attr_t attr;
+		void* addr = nullptr;
+		size_t size = 0;
+		if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+			pthread_attr_getstack(&attr, &addr, &size);
+			pthread_attr_destroy(&attr);
+		}
+		stack_lo = uintptr_t(addr);
+		stack_hi = uintptr_t(addr) + size;
+		if (!size) LOG_WARN("Can't get the thread stack : samples will have the leaf function only");
+	}
+	if (!samples.load(std::memory_order_relaxed)) samples.store(new SampleRing(), std::memory_order_release);
+
+	sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGPROF;
+	sev._sigev_un._tid = gettid(); // only this thread
+
+	timer_t timer;
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer) != 0) {
+		LOG_WARN("Can't create sampling timer : %s", strerror(errno));
+		return;
+	}
+	static_assert(sizeof(timer_t) <= sizeof(void*));
+	memcpy(&sample_timer, &timer, sizeof(timer));
+
+	itimerspec spec;
+	spec.it_interval = {0, SAMPLE_INTERVAL_NS};
+	spec.it_value = spec.it_interval;
+	timer_settime(timer, 0, &spec, nullptr);
+}
+
+void DataImpl::stop_sampling() {
+	sampling_on = false;
+	if (!sample_timer) return;
+	timer_t timer;
+	memcpy(&timer, &sample_timer, sizeof(timer));
+	timer_delete(timer);
+	sample_timer = nullptr;
+}
+
+#else
+
+void DataImpl::take_sample(uintptr_t, uintptr_t) {}
+
+void DataImpl::start_sampling() {
+	sampling_on = true;
+	LOG_WARN("No sampling profiler on this platform");
+}
+
+void DataImpl::stop_sampling() {
+	sampling_on = false;
+}
+
+#endif
+
+/*
+ * Aggregation : on the reader side, by zone + leaf function, and by whole stacks.
+ */
+namespace {
+
+struct RawSample {
+	uint32_t zone;
+	uint32_t nframes;
+	uintptr_t frames[SampleRing::MAX_FRAMES];
+};
+
+struct SampleDb {
+	std::mutex lock;
+	std::map<const SampleRing*, uint64_t> cursors; // samples, that were already read
+	std::unordered_map<uintptr_t, std::string> symbols; // by address
+	std::map<std::pair<uint32_t, std::string>, uint64_t> by_function;
+	std::map<std::string, uint64_t> folded;
+	std::vector<RawSample> raw;
+
+	/** new samples from the ring. Under prof_data lock */
+	void copy_ring(const SampleRing& ring) {
+		uint64_t& cursor = cursors[&ring];
+		uint64_t head = ring.head.load(std::memory_order_acquire);
+		if (cursor > head) cursor = 0; // new ring at the same address
+		uint64_t from = std::max(cursor, head > SampleRing::SIZE ? head - SampleRing::SIZE : 0);
+
+		size_t start = raw.size();
+		for (uint64_t i = from; i < head; i++) {
+			auto& s = ring.samples[i & (SampleRing::SIZE - 1)];
+			RawSample& r = raw.emplace_back();
+			r.zone = s.zone.load(std::memory_order_relaxed);
+			r.nframes = std::min<uint32_t>(s.nframes.load(std::memory_order_relaxed), SampleRing::MAX_FRAMES);
+			for (uint32_t j = 0; j < r.nframes; j++) r.frames[j] = s.frames[j].load(std::memory_order_relaxed);
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t now = ring.head.load(std::memory_order_relaxed);
+		uint64_t valid = now + 1 > SampleRing::SIZE ? now + 1 - SampleRing::SIZE : 0;
+		if (valid > from) { // overwritten while we were reading
+			size_t drop = std::min<uint64_t>(valid - from, raw.size() - start);
+			raw.erase(raw.begin() + start, raw.begin() + start + drop);
+		}
+		cursor = head;
+	}
+
+	const std::string& symbol(uintptr_t pc) {
+		auto it = symbols.find(pc);
+		if (it != symbols.end()) return it->second;
+
+		std::string name;
+#ifdef __linux__
+		Dl_info info = {};
+		if (!dladdr((void*)pc, &info)) {
+			// not in any loaded object : garbage frame, the raw address below
+		} else if (info.dli_sname) {
+			int status = 0;
+			char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+			name = status == 0 && demangled ? demangled : info.dli_sname;
+			free(demangled);
+		} else if (info.dli_fname) {
+			const char* base = strrchr(info.dli_fname, '/');
+			char buff[32];
+			snprintf(buff, sizeof(buff), "+0x%zx", size_t(pc - uintptr_t(info.dli_fbase)));
+			name = std::string(base ? base + 1 : info.dli_fname) + buff;
+		}
+#endif
+		if (name.empty()) {
+			char buff[32];
+			snprintf(buff, sizeof(buff), "0x%zx", size_t(pc));
+			name = buff;
+		}
+		std::replace(name.begin(), name.end(), ';', ':'); // folded stacks separator
+		return symbols.emplace(pc, std::move(name)).first->second;
+	}
+
+	void aggregate() {
+		std::string stack;
+		for (auto& r : raw) {
+			const ZoneDesc* zone = r.zone != SampleRing::NO_ZONE ? get_zone(r.zone) : nullptr;
+			// return addresses point after the call
+			auto pc = [&r](uint32_t i) { return i == 0 ? r.frames[0] : r.frames[i] - 1; };
+
+			by_function[{r.zone, symbol(pc(0))}]++;
+
+			stack = zone ? zone->name : "<no zone>";
+			std::replace(stack.begin(), stack.end(), ';', ':');
+			for (uint32_t i = r.nframes; i-- > 0;) {
+				stack += ';';
+				stack += symbol(pc(i));
+			}
+			folded[stack]++;
+		}
+		raw.clear();
+	}
+
+	void collect() {
+		{
+			auto ruse = impl::prof_data.use(); // lock : threads can't go away
+			for (auto& [_, data] : ruse.ref) {
+				const SampleRing* ring = data.samples.load(std::memory_order_acquire);
+				if (ring) copy_ring(*ring);
+			}
+		}
+		aggregate();
+	}
+};
+
+SampleDb& sample_db() {
+	static SampleDb db;
+	return db;
+}
+
+};
+
+void get_samples(std::vector<SampleEntry>& dst) {
+	auto& db = sample_db();
+	std::lock_guard l(db.lock);
+	db.collect();
+
+	dst.clear();
+	dst.reserve(db.by_function.size());
+	for (auto& [key, count] : db.by_function) {
+		const ZoneDesc* zone = key.first != SampleRing::NO_ZONE ? get_zone(key.first) : nullptr;
+		dst.push_back(SampleEntry{zone, key.second, count});
+	}
+	std::sort(dst.begin(), dst.end(), [](const SampleEntry& a, const SampleEntry& b) {
+		return a.count > b.count;
+	});
+}
+
+void clear_samples() {
+	auto& db = sample_db();
+	std::lock_guard l(db.lock);
+	db.collect(); // move cursors
+	db.by_function.clear();
+	db.folded.clear();
+}
+
+bool export_folded(const char* path) {
+	auto& db = sample_db();
+	std::lock_guard l(db.lock);
+	db.collect();
+
+	FILE* f = fopen(path, "w");
+	if (!f) {
+		LOG_ERROR("Can't write samples to %s", path);
+		return false;
+	}
+	for (auto& [stack, count] : db.folded)
+		fprintf(f, "%s %llu\n", stack.c_str(), (unsigned long long)count);
+
+	bool ok = !ferror(f);
+	if (fclose(f) != 0) ok = false;
+	if (!ok) {
+		LOG_ERROR("Can't write samples to %s", path);
+		return false;
+	}
+	LOG_INFO("%zu folded stacks are written to %s", db.folded.size(), path);
+	return true;
+}
+
+#ifdef __linux__
+TEST_CASE("Profiler sampling") {
+	auto prof_ctx = make_thread_data();
+	ThreadData prof = get_thread_data();
+	static ZoneDesc zone("Test::Sampled");
+	clear_samples();
+
+	set_sampling(true);
+	prof.step(); // arms the timer
+	{
+		auto z = prof.make_zone(zone);
+		double t = prof_clock();
+		volatile uint64_t sink = 0;
+		while (prof_clock() - t < 0.1) sink = sink + 1;
+	}
+	set_sampling(false);
+	prof.step(); // disarms
+
+	std::vector<SampleEntry> samples;
+	get_samples(samples);
+	uint64_t total = 0, in_zone = 0;
+	for (auto& s : samples) {
+		total += s.count;
+		if (s.zone == &zone) in_zone += s.count;
+	}
+	REQUIRE(total > 10); // ~100 expected
+	REQUIRE(in_zone * 2 > total);
+
+	const char* path = "pb_test_folded.txt";
+	REQUIRE(export_folded(path));
+	FILE* f = fopen(path, "r");
+	REQUIRE(f);
+	char line[4096] = {};
+	size_t deep = 0; // frame pointer walk : zone;...;caller;leaf, not the leaf only
+	while (fgets(line, sizeof(line), f)) {
+		REQUIRE(strchr(line, ' '));
+		size_t depth = 0;
+		for (char* c = line; *c; c++) depth += *c == ';';
+		if (strncmp(line, "Test::Sampled;", 14) == 0 && depth >= 3) deep++;
+	}
+	fclose(f);
+	remove(path);
+	REQUIRE(deep > 0);
+	clear_samples();
+}
+#endif
+
+};
+
+};
@@ -0,0 +1,250 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Profiler spike detector : snapshots of the history around the long frames
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "profiler_impl.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <thread>
+
+#include <doctest.h>
+
+namespace pb {
+
+namespace prof {
+
+void set_spike_detector(const SpikeConfig& src) {
+	SpikeConfig cfg = src;
+	// all frames of the snapshot must be in the history, when it is written
+	if (cfg.before > HISTORY_LEN - 1) cfg.before = HISTORY_LEN - 1;
+	if (cfg.after > HISTORY_LEN - 1 - cfg.before) cfg.after = HISTORY_LEN - 1 - cfg.before;
+	if (!cfg.prefix) cfg.prefix = "spike";
+	{
+		auto ruse = impl::spikes.use(); // lock
+		ruse.ref.cfg = cfg;
+	}
+	impl::spike_version.fetch_add(1, std::memory_order_release); // threads copy it again
+	impl::spike_detect.store(cfg.budget > 0 || cfg.ratio > 0, std::memory_order_relaxed);
+}
+
+SpikeConfig get_spike_detector() {
+	auto ruse = impl::spikes.use(); // lock
+	return ruse.ref.cfg;
+}
+
+size_t spikes_count() {
+	auto ruse = impl::spikes.use(); // lock
+	return ruse.ref.count;
+}
+
+std::string last_spike_path() {
+	auto ruse = impl::spikes.use(); // lock
+	return ruse.ref.last;
+}
+
+/*
+ * Median of the recent frames is a robust baseline : one slow frame (or a
+ * few) don't move it, unlike the average. Spikes during the frames after the
+ * spike go into the same snapshot.
+ */
+void DataImpl::check_spike(uint32_t pos, uint64_t frame) {
+	bool detect = spike_watch && impl::spike_detect.load(std::memory_order_relaxed);
+	if (!detect && spike_pos < 0) return;
+	// per-thread copy of the config : no shared lock on every step()
+	uint32_t version = impl::spike_version.load(std::memory_order_acquire);
+	if (version != spike_cfg_version) {
+		auto ruse = impl::spikes.use(); // lock
+		spike_cfg = ruse.ref.cfg;
+		spike_cfg_version = version;
+	}
+	const SpikeConfig& cfg = spike_cfg;
+
+	if (spike_pos >= 0) {
+		if (spike_left > 0) spike_left--;
+		if (spike_left == 0) write_spike(cfg);
+		return; // frames around the spike are not the baseline
+	}
+	if (!detect) return;
+
+	uint64_t median = 0;
+	if (nrecent >= SPIKE_WINDOW / 4) {
+		uint32_t n = std::min(nrecent, SPIKE_WINDOW);
+		uint64_t tmp[SPIKE_WINDOW];
+		memcpy(tmp, recent, n * sizeof(uint64_t));
+		std::nth_element(tmp, tmp + n / 2, tmp + n);
+		median = tmp[n / 2];
+	}
+	bool warm = nrecent > 0; // first frame includes the thread startup
+	recent[nrecent++ % SPIKE_WINDOW] = frame;
+	if (!warm) return;
+
+	double seconds = tsc::to_seconds(frame);
+	bool spike = (cfg.budget > 0 && seconds > cfg.budget) ||
+		(cfg.ratio > 0 && median && frame > median * cfg.ratio);
+	if (!spike) return;
+
+	spike_pos = int(pos);
+	spike_left = cfg.after;
+	spike_median = median;
+	if (spike_left == 0) write_spike(cfg);
+}
+
+void DataImpl::write_spike(const SpikeConfig& cfg) {
+	const ThreadHistory& h = *history;
+	uint32_t spike = uint32_t(spike_pos);
+	spike_pos = -1;
+
+	size_t number;
+	{
+		auto ruse = impl::spikes.use(); // lock
+		number = ruse.ref.count++;
+	}
+	char path[256], trace_path[256];
+	long long now = (long long)time(nullptr);
+	snprintf(path, sizeof(path), "%s_%lld_%zu.json", cfg.prefix, now, number);
+	snprintf(trace_path, sizeof(trace_path), "%s_%lld_%zu_trace.json", cfg.prefix, now, number);
+
+	// oldest written frame of the snapshot
+	int first = -int(cfg.before);
+	auto at = [&](int offset) { return uint32_t(spike + HISTORY_LEN + offset) % HISTORY_LEN; };
+	while (first < 0 && h.seq[at(first)].load(std::memory_order_relaxed) == 0) first++;
+
+	bool traced = false;
+	if (impl::tracing.load(std::memory_order_relaxed)) {
+		uint32_t p = at(first);
+		uint64_t start = h.frame_end[p].load(std::memory_order_relaxed) - h.frame[p].load(std::memory_order_relaxed);
+		traced = export_trace(trace_path, tsc::to_seconds(tsc::now() - start));
+	}
+
+	FILE* f = fopen(path, "w");
+	if (!f) {
+		LOG_ERROR("Can't write spike snapshot to %s", path);
+		frame_start = tsc::now();
+		return;
+	}
+
+	fprintf(f, "{\"thread\":");
+	if (name) impl::write_json_string(f, name);
+	else fprintf(f, "\"Thread %u\"", index);
+	fprintf(f, ",\"frame_ms\":%.6g,\"median_ms\":%.6g,\"budget_ms\":%.6g,\"ratio\":%.6g,\"trace\":",
+		tsc::to_seconds(h.frame[spike].load(std::memory_order_relaxed)) * 1e3,
+		tsc::to_seconds(spike_median) * 1e3, cfg.budget * 1e3, cfg.ratio);
+	if (traced) impl::write_json_string(f, trace_path);
+	else fprintf(f, "null");
+	fprintf(f, ",\"frames\":[");
+
+	// owner thread : nobody writes the history meanwhile, no seqlock retries
+	std::vector<std::pair<double, uint32_t>> order;
+	for (int offset = first; offset <= int(cfg.after); offset++) {
+		HistoryView view(&h, at(offset));
+		fprintf(f, "%s\n{\"offset\":%i,\"frame_ms\":%.6g,\"zones\":[", offset == first ? "" : ",",
+			offset, view.frame_time() * 1e3);
+
+		order.clear();
+		for (size_t i = 0; i < view.size(); i++) {
+			prof_stats s = view.stats(i);
+			if (s.ncalls) order.emplace_back(s.sumtime, uint32_t(i));
+		}
+		std::sort(order.begin(), order.end(), [](auto& a, auto& b) { return a.first > b.first; });
+
+		bool first_zone = true;
+		for (auto& [_, i] : order) {
+			const ZoneDesc* desc = view.zone(i);
+			prof_stats s = view.stats(i);
+			fprintf(f, "%s\n {\"name\":", first_zone ? "" : ",");
+			impl::write_json_string(f, desc ? desc->name : "<unknown>");
+			if (desc && desc->kind != ZoneKind::ZONE) fprintf(f, ",\"updates\":%i,\"value\":%.6g}", s.ncalls, s.value);
+			else fprintf(f, ",\"calls\":%i,\"total_ms\":%.6g,\"own_ms\":%.6g,\"allocs\":%u}",
+				s.ncalls, s.sumtime * 1e3, s.owntime * 1e3, s.allocs);
+			first_zone = false;
+		}
+		fprintf(f, "]}");
+	}
+	fprintf(f, "\n]}\n");
+
+	bool ok = !ferror(f);
+	if (fclose(f) != 0) ok = false;
+	if (!ok) LOG_ERROR("Can't write spike snapshot to %s", path);
+	else {
+		LOG_INFO("Frame spike : snapshot is written to %s", path);
+		auto ruse = impl::spikes.use(); // lock
+		ruse.ref.last = path;
+	}
+	frame_start = tsc::now(); // writing is not a part of the next frame
+}
+
+TEST_CASE("Profiler spike detector") {
+	auto prof_ctx = make_thread_data();
+	ThreadData prof = get_thread_data();
+	static ZoneDesc zone("Test::Hitch");
+
+	SpikeConfig old = get_spike_detector();
+	SpikeConfig cfg;
+	cfg.budget = 0.005;
+	cfg.before = 2;
+	cfg.after = 2;
+	cfg.prefix = "pb_test_spike";
+	set_spike_detector(cfg);
+	size_t count = spikes_count();
+
+	// not watched : idle waits of a worker between it's step() calls
+	std::thread worker([]() {
+		auto ctx = make_thread_data();
+		for (int i = 0; i < 4; i++) {
+			ctx.master.step();
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	});
+	worker.join();
+	REQUIRE(spikes_count() == count);
+
+	prof.set_spike_detection(true);
+	for (int i = 0; i < 8; i++) {
+		if (i == 4) {
+			auto z = prof.make_zone(zone);
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		prof.step();
+	}
+	set_spike_detector(old);
+	prof.set_spike_detection(false);
+
+	REQUIRE(spikes_count() == count + 1);
+	std::string path = last_spike_path();
+	FILE* f = fopen(path.c_str(), "r");
+	REQUIRE(f);
+	std::string text;
+	char buff[256];
+	size_t n;
+	while ((n = fread(buff, 1, sizeof(buff), f)) > 0) text.append(buff, n);
+	fclose(f);
+	remove(path.c_str());
+
+	REQUIRE(text.find("\"offset\":-2") != std::string::npos);
+	REQUIRE(text.find("\"offset\":2") != std::string::npos);
+	REQUIRE(text.find("\"offset\":3") == std::string::npos);
+	REQUIRE(text.find("\"name\":\"Test::Hitch\"") != std::string::npos);
+}
+
+};
+
+};
@@ -0,0 +1,443 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Profiler streaming : frame summaries to the external viewer over a loopback socket
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "profiler_impl.hpp"
+#include "profiler_stream.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <doctest.h>
+
+namespace pb {
+
+namespace prof {
+
+namespace {
+
+/** zones of the frame in one queue slot. Frames with more zones take several slots */
+static constexpr uint32_t PACKET_ZONES = 40;
+/** frames (parts) in the queue. When the sender is late, new frames are dropped */
+static constexpr size_t STREAM_QUEUE = 256;
+/** records are sent in batches up to this size */
+static constexpr size_t SEND_BATCH = 1 << 16;
+
+/** what step() puts into the queue : raw ticks, no names */
+struct Packet {
+	uint32_t thread;
+	uint32_t part;
+	uint32_t count;
+	const char* name; // of the thread, static string
+	uint64_t frame; // ticks
+	struct {
+		uint32_t id;
+		uint32_t ncalls;
+		uint64_t ticks;
+		double value;
+	} entries[PACKET_ZONES];
+};
+
+using PacketQueue = BoundedQueue<Packet, STREAM_QUEUE>;
+
+/**
+ * allocated on the first start_stream(), and leaked on purpose : producers may
+ * still use it in their step() while the static destructors run
+ */
+std::atomic<PacketQueue*> queue = nullptr;
+std::atomic<uint32_t> dropped = 0;
+
+struct StreamState {
+	std::mutex lock; // start/stop
+	std::thread sender;
+	std::atomic<bool> stop = false;
+	int listen_fd = -1;
+	std::string unix_path; // to unlink
+	~StreamState();
+};
+StreamState state;
+
+};
+
+/*
+ * Owner thread. Only zones, that were called (or updated) in this frame, are
+ * sent : viewer keeps the last values of the gauges by itself.
+ */
+void DataImpl::stream_frame(uint64_t frame) {
+	PacketQueue* qp = queue.load(std::memory_order_acquire);
+	if (!qp) return;
+	PacketQueue& q = *qp;
+	uint32_t part = 0;
+	size_t i = 0;
+	do {
+		bool ok = q.try_push_with([&](Packet& p) {
+			p.thread = index;
+			p.part = part;
+			p.count = 0;
+			p.name = name;
+			p.frame = frame;
+			for (; i < used.size() && p.count < PACKET_ZONES; i++) {
+				const ZoneState* z = zones[used[i]];
+				if (!z->stats.ncalls) continue;
+				p.entries[p.count++] = {used[i], uint32_t(z->stats.ncalls), z->stats.sumtime, z->value};
+			}
+		});
+		if (!ok) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		part++;
+	} while (i < used.size());
+}
+
+bool is_streaming() {
+	return impl::streaming.load(std::memory_order_relaxed);
+}
+
+#ifdef __linux__
+
+namespace {
+
+template <class T>
+void put(std::vector<char>& dst, const T& v) {
+	const char* p = reinterpret_cast<const char*>(&v);
+	dst.insert(dst.end(), p, p + sizeof(T));
+}
+
+void put_record(std::vector<char>& dst, stream::RecordType type, uint32_t size) {
+	put(dst, stream::RecordHeader{type, size});
+}
+
+/** names, that the viewer already knows */
+struct Known {
+	std::vector<bool> zones; // by ID
+	std::vector<const char*> threads; // by index
+
+	void clear() {
+		zones.clear();
+		threads.clear();
+	}
+};
+
+/** appends records of the packet : new names, then the frame */
+void encode(const Packet& p, Known& known, std::vector<char>& dst) {
+	for (uint32_t i = 0; i < p.count; i++) {
+		uint32_t id = p.entries[i].id;
+		if (id < known.zones.size() && known.zones[id]) continue;
+		if (id >= known.zones.size()) known.zones.resize(id + 1);
+		known.zones[id] = true;
+		const ZoneDesc* desc = get_zone(id);
+		const char* name = desc ? desc->name : "<unknown>";
+		uint32_t len = strlen(name);
+		put_record(dst, stream::ZONE_NAME, sizeof(stream::ZoneRecord) + len);
+		put(dst, stream::ZoneRecord{id, uint32_t(desc ? desc->kind : ZoneKind::ZONE)});
+		dst.insert(dst.end(), name, name + len);
+	}
+
+	if (p.name) {
+		if (p.thread >= known.threads.size()) known.threads.resize(p.thread + 1);
+		if (known.threads[p.thread] != p.name) {
+			known.threads[p.thread] = p.name;
+			uint32_t len = strlen(p.name);
+			put_record(dst, stream::THREAD_NAME, sizeof(stream::ThreadRecord) + len);
+			put(dst, stream::ThreadRecord{p.thread});
+			dst.insert(dst.end(), p.name, p.name + len);
+		}
+	}
+
+	put_record(dst, stream::FRAME, sizeof(stream::FrameRecord) + p.count * sizeof(stream::FrameEntry));
+	put(dst, stream::FrameRecord{p.thread, p.part, p.count, dropped.exchange(0, std::memory_order_relaxed),
+		p.part == 0 ? tsc::to_seconds(p.frame) * 1e3 : 0.0});
+	for (uint32_t i = 0; i < p.count; i++) {
+		auto& e = p.entries[i];
+		const ZoneDesc* desc = get_zone(e.id);
+		bool zone = !desc || desc->kind == ZoneKind::ZONE;
+		put(dst, stream::FrameEntry{e.id, e.ncalls, zone ? tsc::to_seconds(e.ticks) * 1e3 : e.value});
+	}
+}
+
+bool send_all(int fd, const std::vector<char>& buff) {
+	size_t done = 0;
+	while (done < buff.size()) {
+		ssize_t n = send(fd, buff.data() + done, buff.size() - done, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		done += size_t(n);
+	}
+	return true;
+}
+
+/*
+ * One viewer at a time. Queue is only filled while the viewer is connected,
+ * so the game pays nothing for the stream nobody looks at.
+ */
+void sender_loop(int listen_fd) {
+	int client = -1;
+	Known known;
+	std::vector<char> buff;
+	Packet p;
+	PacketQueue& q = *queue.load(std::memory_order_acquire); // started after the allocation
+
+	auto disconnect = [&]() {
+		impl::streaming.store(false, std::memory_order_relaxed);
+		close(client);
+		client = -1;
+		LOG_INFO("Profiler stream : viewer disconnected");
+	};
+
+	while (!state.stop.load(std::memory_order_relaxed)) {
+		if (client < 0) {
+			pollfd pfd{listen_fd, POLLIN, 0};
+			if (poll(&pfd, 1, 100) <= 0) continue;
+			client = accept(listen_fd, nullptr, nullptr);
+			if (client < 0) continue;
+			while (q.try_pop(p)) {} // of the previous viewer
+			dropped.store(0, std::memory_order_relaxed);
+			known.clear();
+			buff.assign(stream::STREAM_MAGIC, stream::STREAM_MAGIC + sizeof(stream::STREAM_MAGIC));
+			impl::streaming.store(true, std::memory_order_relaxed);
+			LOG_INFO("Profiler stream : viewer connected");
+		}
+
+		while (buff.size() < SEND_BATCH && q.try_pop(p)) encode(p, known, buff);
+		if (!buff.empty()) {
+			bool ok = send_all(client, buff);
+			buff.clear();
+			if (!ok) disconnect();
+			continue;
+		}
+
+		// nothing to send : wait a bit, and notice if the viewer is gone
+		pollfd pfd{client, POLLIN, 0};
+		if (poll(&pfd, 1, 5) > 0) {
+			char tmp[64];
+			if (recv(client, tmp, sizeof(tmp), 0) <= 0) disconnect();
+		}
+	}
+	if (client >= 0) disconnect();
+}
+
+/** "unix:/path", or loopback TCP address, see stream::parse_loopback(). -1 on error */
+int open_listener(const char* address, std::string& unix_path) {
+	int fd = -1;
+	if (strncmp(address, "unix:", 5) == 0) {
+		sockaddr_un a = {};
+		a.sun_family = AF_UNIX;
+		const char* path = address + 5;
+		if (!*path || strlen(path) >= sizeof(a.sun_path)) {
+			LOG_ERROR("Profiler stream : bad socket path %s", path);
+			return -1;
+		}
+		strcpy(a.sun_path, path);
+		unlink(path); // stale socket of the previous run
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 && bind(fd, (sockaddr*)&a, sizeof(a)) == 0 && listen(fd, 1) == 0) {
+			unix_path = path;
+			return fd;
+		}
+	} else {
+		bool ipv6 = false;
+		uint16_t port = stream::parse_loopback(address, ipv6);
+		if (!port) {
+			LOG_ERROR("Profiler stream : bad address %s (only port on the loopback is allowed)", address);
+			return -1;
+		}
+		sockaddr_in a4 = {};
+		sockaddr_in6 a6 = {};
+		a4.sin_family = AF_INET;
+		a4.sin_port = htons(port);
+		a4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		a6.sin6_family = AF_INET6;
+		a6.sin6_port = htons(port);
+		a6.sin6_addr = in6addr_loopback;
+		sockaddr* a = ipv6 ? (sockaddr*)&a6 : (sockaddr*)&a4;
+		socklen_t len = ipv6 ? sizeof(a6) : sizeof(a4);
+
+		fd = socket(ipv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+		int yes = 1;
+		if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		if (fd >= 0 && bind(fd, a, len) == 0 && listen(fd, 1) == 0) return fd;
+	}
+	LOG_ERROR("Profiler stream : can't listen on %s : %s", address, strerror(errno));
+	if (fd >= 0) close(fd);
+	return -1;
+}
+
+void stop_locked() {
+	if (!state.sender.joinable()) return;
+	state.stop.store(true, std::memory_order_relaxed);
+	state.sender.join();
+	close(state.listen_fd);
+	state.listen_fd = -1;
+	if (!state.unix_path.empty()) unlink(state.unix_path.c_str());
+	state.unix_path.clear();
+}
+
+StreamState::~StreamState() {
+	stop_locked();
+}
+
+};
+
+bool start_stream(const char* address) {
+	std::lock_guard guard(state.lock);
+	stop_locked();
+	if (!address || !*address) address = stream::DEFAULT_ADDRESS;
+	int fd = open_listener(address, state.unix_path);
+	if (fd < 0) return false;
+	if (!queue.load(std::memory_order_relaxed)) queue.store(new PacketQueue(), std::memory_order_release);
+	state.listen_fd = fd;
+	state.stop.store(false, std::memory_order_relaxed);
+	state.sender = std::thread(sender_loop, fd);
+	LOG_INFO("Profiler stream : listening on %s", address);
+	return true;
+}
+
+void stop_stream() {
+	std::lock_guard guard(state.lock);
+	stop_locked();
+}
+
+#else
+
+StreamState::~StreamState() {}
+
+bool start_stream(const char*) {
+	LOG_ERROR("Profiler stream : not supported on this platform");
+	return false;
+}
+
+void stop_stream() {}
+
+#endif
+
+#ifdef __linux__
+
+TEST_CASE("Profiler streaming") {
+	const char* path = "pb_test_stream.sock";
+	REQUIRE(start_stream("unix:pb_test_stream.sock"));
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un a = {};
+	a.sun_family = AF_UNIX;
+	strcpy(a.sun_path, path);
+	REQUIRE(connect(fd, (sockaddr*)&a, sizeof(a)) == 0);
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (!is_streaming() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	REQUIRE(is_streaming());
+
+	{
+		auto prof_ctx = make_thread_data();
+		ThreadData prof = get_thread_data();
+		prof.set_name("Stream test");
+		static ZoneDesc zone("Test::Streamed");
+		static ZoneDesc counter("Test::Streamed counter", nullptr, 0, ZoneKind::COUNTER);
+		for (int i = 0; i < 4; i++) {
+			prof.make_zone(zone);
+			prof.counter(counter, 2);
+			prof.step();
+		}
+
+		// records until the frame with both of them
+		std::vector<char> data;
+		bool magic = false, named = false, thread = false, found = false;
+		size_t at = 0;
+		while (!found && std::chrono::steady_clock::now() < deadline) {
+			char buff[4096];
+			pollfd pfd{fd, POLLIN, 0};
+			if (poll(&pfd, 1, 10) <= 0) continue;
+			ssize_t n = recv(fd, buff, sizeof(buff), 0);
+			REQUIRE(n > 0);
+			data.insert(data.end(), buff, buff + n);
+
+			if (!magic && data.size() >= sizeof(stream::STREAM_MAGIC)) {
+				REQUIRE(memcmp(data.data(), stream::STREAM_MAGIC, sizeof(stream::STREAM_MAGIC)) == 0);
+				magic = true;
+				at = sizeof(stream::STREAM_MAGIC);
+			}
+			stream::RecordHeader hdr;
+			while (magic && data.size() - at >= sizeof(hdr)) {
+				memcpy(&hdr, data.data() + at, sizeof(hdr));
+				if (data.size() - at - sizeof(hdr) < hdr.size) break;
+				const char* payload = data.data() + at + sizeof(hdr);
+				if (hdr.type == stream::ZONE_NAME) {
+					stream::ZoneRecord z;
+					memcpy(&z, payload, sizeof(z));
+					named |= z.id == zone.id &&
+						std::string(payload + sizeof(z), hdr.size - sizeof(z)) == "Test::Streamed";
+				} else if (hdr.type == stream::THREAD_NAME) {
+					thread |= std::string(payload + sizeof(stream::ThreadRecord), hdr.size - sizeof(stream::ThreadRecord)) == "Stream test";
+				} else if (hdr.type == stream::FRAME) {
+					stream::FrameRecord f;
+					memcpy(&f, payload, sizeof(f));
+					bool has_zone = false, has_counter = false;
+					for (uint32_t i = 0; i < f.count; i++) {
+						stream::FrameEntry e;
+						memcpy(&e, payload + sizeof(f) + i * sizeof(e), sizeof(e));
+						has_zone |= e.id == zone.id && e.ncalls == 1;
+						has_counter |= e.id == counter.id && e.value == 2.0;
+					}
+					found = has_zone && has_counter;
+				}
+				at += sizeof(hdr) + hdr.size;
+			}
+		}
+		REQUIRE(named);
+		REQUIRE(thread);
+		REQUIRE(found);
+	}
+
+	close(fd);
+	stop_stream();
+	REQUIRE(!is_streaming());
+}
+
+TEST_CASE("Profiler stream address") {
+	bool ipv6 = true;
+	REQUIRE(stream::parse_loopback("7420", ipv6) == 7420);
+	REQUIRE(!ipv6);
+	REQUIRE(stream::parse_loopback("127.0.0.1:7421", ipv6) == 7421);
+	REQUIRE(stream::parse_loopback("localhost:7422", ipv6) == 7422);
+	REQUIRE(stream::parse_loopback("[::1]:7423", ipv6) == 7423);
+	REQUIRE(ipv6);
+	REQUIRE(stream::parse_loopback("0.0.0.0:7420", ipv6) == 0); // exposed to the network
+	REQUIRE(stream::parse_loopback("192.168.1.2:7420", ipv6) == 0);
+	REQUIRE(stream::parse_loopback("127.0.0.1:", ipv6) == 0);
+	REQUIRE(stream::parse_loopback("70000", ipv6) == 0);
+	REQUIRE(stream::parse_loopback("12ab", ipv6) == 0);
+	REQUIRE(!start_stream("0.0.0.0:7420"));
+}
+
+#endif
+
+};
+
+};
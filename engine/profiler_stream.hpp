@@ -0,0 +1,103 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Profiler streaming : wire format of the frame summaries (see start_stream())
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Shared with tools/prof_view : only plain structs here, no engine includes.
+ *
+ * Stream starts with STREAM_MAGIC, then records : RecordHeader and `size`
+ * bytes of the payload. Loopback only, so numbers are in the host byte order.
+ * Names of the zones and threads are sent once, before the first frame that
+ * uses them (and again after the reconnect).
+ */
+
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace pb {
+namespace prof {
+namespace stream {
+
+static constexpr char STREAM_MAGIC[8] = {'P', 'B', 'P', 'R', 'O', 'F', '1', '\n'};
+
+/** default address : TCP port on 127.0.0.1 */
+static constexpr const char* DEFAULT_ADDRESS = "7420";
+
+enum RecordType : uint32_t {
+	ZONE_NAME = 1, // ZoneRecord, then the name (not terminated)
+	THREAD_NAME = 2, // ThreadRecord, then the name (not terminated)
+	FRAME = 3, // FrameRecord, then `count` FrameEntry
+};
+
+struct RecordHeader {
+	uint32_t type;
+	uint32_t size; // of the payload after the header
+};
+
+struct ZoneRecord {
+	uint32_t id;
+	uint32_t kind; // pb::prof::ZoneKind
+};
+
+struct ThreadRecord {
+	uint32_t index;
+};
+
+/**
+ * One step() of the thread. Frames with a lot of zones are split into the
+ * parts : frame_ms is only in the part 0.
+ */
+struct FrameRecord {
+	uint32_t thread; // index
+	uint32_t part;
+	uint32_t count; // of the entries
+	uint32_t dropped; // frames (parts), lost since the previous record : queue was full
+	double frame_ms;
+};
+
+/** zone with ncalls > 0 in this frame */
+struct FrameEntry {
+	uint32_t id;
+	uint32_t ncalls; // updates for the counters and gauges
+	double value; // ZONE : total time in ms, COUNTER : sum in this frame, GAUGE : last value
+};
+
+/**
+ * TCP address : "port", "127.0.0.1:port", "localhost:port" or "[::1]:port".
+ * Stream is not authenticated, so anything but the loopback is rejected.
+ * Returns the port, or 0 on error. ipv6 is set for ::1.
+ */
+inline uint16_t parse_loopback(const char* address, bool& ipv6) {
+	const char* colon = strrchr(address, ':');
+	const char* port = colon ? colon + 1 : address;
+	size_t host_len = colon ? size_t(colon - address) : 0;
+	auto host_is = [&](const char* h) { return host_len == strlen(h) && strncmp(address, h, host_len) == 0; };
+
+	ipv6 = host_is("[::1]") || host_is("::1");
+	if (colon && !ipv6 && !host_is("127.0.0.1") && !host_is("localhost")) return 0;
+	char* end = nullptr;
+	long v = strtol(port, &end, 10);
+	if (end == port || *end || v < 1 || v > 65535) return 0;
+	return uint16_t(v);
+}
+
+};
+};
+};
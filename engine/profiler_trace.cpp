@@ -0,0 +1,220 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Profiler trace mode : export in Chrome trace-event format
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "profiler_impl.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+
+#include <doctest.h>
+
+namespace pb {
+
+namespace prof {
+
+namespace {
+
+struct TraceEvent {
+	uint64_t time; // ticks
+	uint32_t zone;
+	bool end;
+};
+
+struct ThreadTrace {
+	uint32_t index;
+	const char* name;
+	std::vector<TraceEvent> events;
+};
+
+/**
+ * Copies everything in the ring, that was not overwritten while we were reading.
+ * Writer is never blocked : we just check the head again after the copy.
+ */
+void copy_ring(const TraceRing& ring, std::vector<TraceEvent>& dst) {
+	uint64_t head = ring.head.load(std::memory_order_acquire);
+	uint64_t from = head > TraceRing::SIZE ? head - TraceRing::SIZE : 0;
+
+	dst.reserve(head - from);
+	for (uint64_t i = from; i < head; i++) {
+		auto& e = ring.events[i & (TraceRing::SIZE - 1)];
+		uint32_t code = e.code.load(std::memory_order_relaxed);
+		dst.push_back(TraceEvent{e.time.load(std::memory_order_relaxed), code >> 1, bool(code & 1)});
+	}
+
+	std::atomic_thread_fence(std::memory_order_acquire);
+	uint64_t now = ring.head.load(std::memory_order_relaxed);
+	// event at index (now) may be in the middle of write too
+	uint64_t valid = now + 1 > TraceRing::SIZE ? now + 1 - TraceRing::SIZE : 0;
+	if (valid > from) dst.erase(dst.begin(), dst.begin() + std::min<uint64_t>(valid - from, dst.size()));
+}
+
+/** one complete ("X") event. Time is in microseconds in this format */
+void write_complete(FILE* f, bool& first, uint32_t tid, uint32_t zone, uint64_t start, uint64_t end) {
+	const ZoneDesc* desc = get_zone(zone);
+	fprintf(f, "%s\n{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"name\":",
+		first ? "" : ",", tid, tsc::to_seconds(start) * 1e6, tsc::to_seconds(end - start) * 1e6);
+	impl::write_json_string(f, desc ? desc->name : "<unknown>");
+	if (desc && desc->file) fprintf(f, ",\"args\":{\"line\":%i}", desc->line);
+	fputc('}', f);
+	first = false;
+}
+
+};
+
+void impl::write_json_string(FILE* f, const char* s) {
+	fputc('"', f);
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+		else if (c < 0x20) fprintf(f, "\\u%04x", c);
+		else fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+void set_tracing(bool enabled) {
+	impl::tracing.store(enabled, std::memory_order_relaxed);
+}
+
+bool is_tracing() {
+	return impl::tracing.load(std::memory_order_relaxed);
+}
+
+/*
+ * Rings contain raw begin/end events. They are matched back per thread here,
+ * as in DataImpl::end(). Zones that are cut by the window (or by the ring
+ * overwrite) are clamped to the window bounds, so nothing is lost on the edges.
+ */
+bool export_trace(const char* path, double seconds) {
+	std::vector<ThreadTrace> threads;
+	uint64_t now = tsc::now();
+	uint64_t window = seconds > 0 ? uint64_t(seconds / tsc::seconds_per_tick()) : now;
+	uint64_t from = now - std::min(window, now);
+
+	{
+		auto ruse = impl::prof_data.use(); // lock : threads can't go away
+		for (auto& [_, data] : ruse.ref) {
+			const TraceRing* ring = data.trace.load(std::memory_order_acquire);
+			if (!ring) continue;
+			threads.push_back(ThreadTrace{data.index, data.name, {}});
+			copy_ring(*ring, threads.back().events);
+		}
+	}
+
+	FILE* f = fopen(path, "w");
+	if (!f) {
+		LOG_ERROR("Can't write trace to %s", path);
+		return false;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	bool first = true;
+	std::vector<std::pair<uint32_t, uint64_t>> stack;
+	size_t total = 0;
+
+	for (auto& t : threads) {
+		fprintf(f, "%s\n{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":",
+			first ? "" : ",", t.index);
+		if (t.name) impl::write_json_string(f, t.name);
+		else fprintf(f, "\"Thread %u\"", t.index);
+		fprintf(f, "}}");
+		first = false;
+
+		if (t.events.empty()) continue;
+		uint64_t start = std::max(from, t.events.front().time);
+		stack.clear();
+
+		for (auto& e : t.events) {
+			if (!e.end) {
+				stack.emplace_back(e.zone, e.time);
+				continue;
+			}
+			// end without begin : began before the oldest event in the ring
+			uint64_t begin = start;
+			if (!stack.empty()) {
+				begin = stack.back().second;
+				stack.pop_back();
+			}
+			if (e.time < from) continue;
+			write_complete(f, first, t.index, e.zone, std::max(begin, from), e.time);
+			total++;
+		}
+
+		// still running
+		while (!stack.empty()) {
+			auto [zone, begin] = stack.back();
+			stack.pop_back();
+			write_complete(f, first, t.index, zone, std::max(begin, from), now);
+			total++;
+		}
+	}
+
+	fprintf(f, "\n]}\n");
+	bool ok = !ferror(f);
+	if (fclose(f) != 0) ok = false;
+	if (!ok) {
+		LOG_ERROR("Can't write trace to %s", path);
+		return false;
+	}
+	LOG_INFO("Trace with %zu zones from %zu threads is written to %s", total, threads.size(), path);
+	return true;
+}
+
+TEST_CASE("Profiler trace") {
+	auto prof_ctx = make_thread_data();
+	ThreadData prof = get_thread_data();
+	static ZoneDesc outer("Trace::Outer");
+	static ZoneDesc inner("Trace \"quoted\"");
+
+	set_tracing(true);
+	for (int i = 0; i < 2; i++) {
+		auto z = prof.make_zone(outer);
+		prof.make_zone(inner);
+	}
+	prof.begin(outer); // open one is exported too
+	set_tracing(false);
+
+	const char* path = "pb_test_trace.json";
+	REQUIRE(export_trace(path));
+	prof.end();
+
+	FILE* f = fopen(path, "r");
+	REQUIRE(f);
+	std::string text;
+	char buff[256];
+	size_t n;
+	while ((n = fread(buff, 1, sizeof(buff), f)) > 0) text.append(buff, n);
+	fclose(f);
+	remove(path);
+
+	auto count = [&](const char* s) {
+		size_t c = 0;
+		for (size_t p = text.find(s); p != std::string::npos; p = text.find(s, p + 1)) c++;
+		return c;
+	};
+	REQUIRE(count("\"name\":\"Trace::Outer\"") == 3);
+	REQUIRE(count("\"name\":\"Trace \\\"quoted\\\"\"") == 2);
+	REQUIRE(text.rfind("]}") != std::string::npos);
+}
+
+};
+
+};
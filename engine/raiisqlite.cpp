@@ -24,11 +24,15 @@
 #include "raiisqlite.hpp"
 #include <cstring>
 #include <exception>
+#include <list>
 #include <new>
 #include <sstream>
 #include <stdexcept>
+#include <string>
+#include <unordered_map>
 #include "base.hpp"
 #include "sqlite3.h"
+#include "doctest.h"
 
 // implementation
 namespace sqlite {
@@ -177,7 +181,167 @@ DatabaseError Backup::iterate(int n_pages) noexcept {
 	return err;
 }
 
+DatabaseError BlobIO::open(sqlite3 *db, const char* table, const char* column, int64_t rowid, bool writable, const char* schema) noexcept {
+	close().supress();
+	if (!db || !table || !column) return SQLITE_MISUSE;
+	if (!schema) schema = "main";
+	int err = sqlite3_blob_open(db, schema, table, column, rowid, writable ? 1 : 0, &blob);
+	if (err != SQLITE_OK) {
+		sqlite3_blob_close(blob); // may be allocated even on error
+		blob = nullptr;
+	}
+	return err;
+}
+
+DatabaseError BlobIO::reopen(int64_t rowid) noexcept {
+	if (!blob) return SQLITE_MISUSE;
+	return sqlite3_blob_reopen(blob, rowid); // handle is aborted on error, only close() after that
+}
+
+/** sqlite checks the range itself, but the sizes are ints there */
+static bool blob_range_ok(sqlite3_blob *blob, size_t n, size_t offset) {
+	size_t size = size_t(sqlite3_blob_bytes(blob));
+	return offset <= size && n <= size - offset;
+}
+
+DatabaseError BlobIO::read(Blob dst, size_t offset) noexcept {
+	if (!blob) return SQLITE_MISUSE;
+	if (!blob_range_ok(blob, dst.length(), offset)) return SQLITE_ERROR;
+	return sqlite3_blob_read(blob, dst.begin(), int(dst.length()), int(offset));
+}
+
+DatabaseError BlobIO::write(Blob src, size_t offset) noexcept {
+	if (!blob) return SQLITE_MISUSE;
+	if (!blob_range_ok(blob, src.length(), offset)) return SQLITE_ERROR;
+	return sqlite3_blob_write(blob, src.begin(), int(src.length()), int(offset));
+}
+
+namespace impl {
+
+struct CacheEntry {
+	std::string sql; // key
+	sqlite3_stmt* stmt;
+	bool busy; // given to the CachedStatement
+};
+
+/**
+ * LRU list + index by the SQL text. Statements in use stay in the list (so
+ * pointers to the entries are stable), and are just skipped by the eviction.
+ */
+class StatementCache {
+	public:
+	std::list<CacheEntry> lru; // most recently used first
+	std::unordered_map<std::string_view, std::list<CacheEntry>::iterator> index; // views of CacheEntry::sql
+	StatementCacheStats stats;
+	size_t capacity = 64;
+
+	/** evicts least recently used statements, that are not in use, over the capacity */
+	void trim() noexcept {
+		auto it = lru.end();
+		while (lru.size() > capacity && it != lru.begin()) {
+			--it;
+			if (it->busy) continue;
+			index.erase(it->sql);
+			sqlite3_finalize(it->stmt);
+			it = lru.erase(it);
+			stats.evictions++;
+		}
+	}
+
+	~StatementCache() {
+		for (auto& e : lru) sqlite3_finalize(e.stmt);
+	}
+};
+
+};
+
+void CachedStatement::give_back() noexcept {
+	if (!stmt) return;
+	if (entry) {
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+		entry->busy = false;
+		stmt = nullptr;
+		cache->trim(); // could be over the capacity, while everything was in use
+	} else {
+		release();
+	}
+	cache = nullptr;
+	entry = nullptr;
+}
+
+DatabaseError Database::prepare(Text sql, CachedStatement& dst) noexcept {
+	dst.give_back();
+	if (!db) return SQLITE_MISUSE;
+	try {
+		if (!cache) cache = new impl::StatementCache();
+		auto it = cache->index.find(sql);
+		if (it != cache->index.end() && !it->second->busy) { // hit
+			impl::CacheEntry& e = *it->second;
+			cache->lru.splice(cache->lru.begin(), cache->lru, it->second);
+			e.busy = true;
+			cache->stats.hits++;
+			dst.attach(cache, &e, e.stmt);
+			return SQLITE_OK;
+		}
+
+		cache->stats.misses++;
+		sqlite3_stmt* stmt = nullptr;
+		const char* tail = nullptr;
+		int e = sqlite3_prepare_v3(db, sql.data(), sql.size(), SQLITE_PREPARE_PERSISTENT, &stmt, &tail);
+		if (e != SQLITE_OK) return e;
+		if (!stmt) return SQLITE_EMPTY;
+		while (tail < sql.end() && isspace((unsigned char)tail[0])) tail++;
+		if (tail < sql.end()) { // one statement only : the rest would be silently ignored
+			sqlite3_finalize(stmt);
+			return SQLITE_MISUSE;
+		}
+
+		if (it != cache->index.end()) { // same SQL is in use : this one is not cached
+			dst.attach(cache, nullptr, stmt);
+			return SQLITE_OK;
+		}
+		cache->lru.push_front(impl::CacheEntry{std::string(sql), stmt, true});
+		cache->index.emplace(cache->lru.front().sql, cache->lru.begin());
+		dst.attach(cache, &cache->lru.front(), stmt);
+		cache->trim();
+		return SQLITE_OK;
+	} catch (std::bad_alloc& e) {
+		return SQLITE_NOMEM;
+	}
+}
+
+DatabaseError Database::execute(Text sql) noexcept {
+	CachedStatement stmt;
+	DatabaseError rc = prepare(sql, stmt);
+	if (!rc.check()) return rc;
+	return stmt.execute();
+}
+
+StatementCacheStats Database::cache_stats() const noexcept {
+	if (!cache) return StatementCacheStats{0, 0, 0, 0, 64};
+	StatementCacheStats r = cache->stats;
+	r.size = cache->lru.size();
+	r.capacity = cache->capacity;
+	return r;
+}
+
+void Database::set_cache_size(size_t n) noexcept {
+	if (!db) return; // cache lives with the connection : close() frees it
+	if (!cache) {
+		try {
+			cache = new impl::StatementCache();
+		} catch (std::bad_alloc& e) {
+			return;
+		}
+	}
+	cache->capacity = n;
+	cache->trim();
+}
+
 void Database::close() noexcept {
+	delete cache; // statements must be finalized before the close
+	cache = nullptr;
 	if (db && own_handle) {
 		sqlite3_close_v2(db); // NEW : do not close unowned handles
 		//LOG_DEBUG("DATABASE CLOSED!!!!!1 %p", db);
@@ -249,11 +413,119 @@ Database connect_uri(const char* url) noexcept {
 
 Database& Database::operator=(Database && src) {
 	if (this == &src) return *this; 
-	if (db) close(); // important!
+	close(); // important! Frees the cache even without the connection
 	db = src.db;
 	own_handle = src.own_handle;
+	cache = src.cache;
 	src.db = nullptr;
+	src.cache = nullptr;
 	return *this;
 }
 
-};	// namespace sqlite
\ No newline at end of file
+TEST_CASE("Statement cache") {
+	Database db = create_memory();
+	REQUIRE(db);
+	db.exec("CREATE TABLE t (k INTEGER PRIMARY KEY, v)");
+	db.set_cache_size(2);
+
+	const Text insert = "INSERT INTO t(k, v) VALUES (?1, ?2)";
+	for (int i = 0; i < 10; i++) {
+		CachedStatement stmt;
+		REQUIRE(db.prepare(insert, stmt).get() == SQLITE_OK);
+		stmt.bind(i, i * 10);
+		REQUIRE(stmt.execute().get() == SQLITE_DONE);
+	}
+	StatementCacheStats st = db.cache_stats();
+	REQUIRE(st.misses == 1);
+	REQUIRE(st.hits == 9);
+
+	{ // same SQL, while the cached one is in use
+		CachedStatement a, b;
+		REQUIRE(db.prepare("SELECT v FROM t WHERE k = ?1", a).get() == SQLITE_OK);
+		REQUIRE(db.prepare("SELECT v FROM t WHERE k = ?1", b).get() == SQLITE_OK);
+		a.bind(3);
+		b.bind(4);
+		REQUIRE(a.iterate().get() == SQLITE_ROW);
+		REQUIRE(b.iterate().get() == SQLITE_ROW);
+		REQUIRE(a.result().get<int>(0) == 30);
+		REQUIRE(b.result().get<int>(0) == 40);
+	}
+	{ // returned reset and unbound
+		CachedStatement a;
+		REQUIRE(db.prepare("SELECT v FROM t WHERE k = ?1", a).get() == SQLITE_OK);
+		REQUIRE(a.iterate().get() == SQLITE_DONE); // k = NULL
+	}
+
+	CachedStatement tmp;
+	REQUIRE(db.prepare("SELECT count(*) FROM t", tmp).get() == SQLITE_OK); // third one : evicts the insert
+	tmp.give_back();
+	st = db.cache_stats();
+	REQUIRE(st.size == 2);
+	REQUIRE(st.evictions == 1);
+	REQUIRE(db.prepare("SELECT 1; SELECT 2", tmp).get() == SQLITE_MISUSE);
+	REQUIRE(db.prepare("  ", tmp).get() == SQLITE_EMPTY);
+	REQUIRE(!tmp);
+	REQUIRE(db.execute("DELETE FROM t WHERE k > 4").get() == SQLITE_DONE);
+	REQUIRE(db.execute("SELECT \xd0\xbf FROM nowhere").get() == SQLITE_ERROR); // non-ASCII SQL
+	REQUIRE(db.prepare("SELECT count(*) FROM t \t\n", tmp).get() == SQLITE_OK);
+	REQUIRE(tmp.iterate().get() == SQLITE_ROW);
+	REQUIRE(tmp.result().get<int>(0) == 5);
+	tmp.give_back();
+
+	Database closed;
+	closed.set_cache_size(4); // no connection : nothing to cache
+	REQUIRE(closed.cache_stats().capacity == 64);
+	closed = std::move(db); // old cache is freed, new one moved
+	REQUIRE(!db);
+	REQUIRE(closed.cache_stats().size == 2);
+}
+
+TEST_CASE("Blob I/O") {
+	Database db = create_memory();
+	REQUIRE(db);
+	db.exec("CREATE TABLE chunks (id INTEGER PRIMARY KEY, data BLOB)");
+
+	struct Page {
+		uint32_t v[1024];
+	};
+	static Page src, dst;
+	for (uint32_t i = 0; i < 1024; i++) src.v[i] = i * 2654435761u;
+
+	CachedStatement insert;
+	REQUIRE(db.prepare("INSERT INTO chunks(id, data) VALUES (?1, ?2)", insert).get() == SQLITE_OK);
+	insert.bind(7, ZeroBlob{sizeof(Page)});
+	REQUIRE(insert.execute().get() == SQLITE_DONE);
+	REQUIRE(db.last_insert_rowid() == 7);
+	insert.bind(8, as_blob(src)); // static : src is alive until execute()
+	REQUIRE(insert.execute().get() == SQLITE_DONE);
+	{
+		std::string tmp = "temporary";
+		insert.bind(9, copy(tmp));
+	} // tmp is dead, but the value is copied
+	REQUIRE(insert.execute().get() == SQLITE_DONE);
+
+	BlobIO io;
+	REQUIRE(io.open(db, "chunks", "data", 7, true).get() == SQLITE_OK);
+	REQUIRE(io.size() == sizeof(Page));
+	REQUIRE(io.write(as_blob(src)).get() == SQLITE_OK);
+	REQUIRE(io.write(as_blob(src), 1).get() == SQLITE_ERROR); // doesn't fit
+	REQUIRE(io.read(Blob(&dst, sizeof(dst))).get() == SQLITE_OK);
+	REQUIRE(memcmp(&src, &dst, sizeof(Page)) == 0);
+
+	memset(&dst, 0, sizeof(dst));
+	REQUIRE(io.reopen(8).get() == SQLITE_OK);
+	REQUIRE(io.read(Blob(&dst.v[1], 4), 4).get() == SQLITE_OK); // partial
+	REQUIRE(dst.v[1] == src.v[1]);
+	REQUIRE(dst.v[0] == 0);
+	REQUIRE(io.close().get() == SQLITE_OK);
+	REQUIRE(io.open(db, "chunks", "data", 100).get() == SQLITE_ERROR); // no row
+	REQUIRE(!io);
+
+	CachedStatement select;
+	REQUIRE(db.prepare("SELECT data FROM chunks WHERE id = 9", select).get() == SQLITE_OK);
+	REQUIRE(select.iterate().get() == SQLITE_ROW);
+	REQUIRE(select.result().get<std::string>(0) == "temporary");
+	REQUIRE(select.iterate().get() == SQLITE_DONE);
+}
+
+};	// namespace sqlite
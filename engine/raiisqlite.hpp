@@ -25,6 +25,7 @@
 #include <cstdint>
 #include <stdexcept>
 #include <string_view>
+#include <type_traits>
 #include "base.hpp"
 #include "bindata.hpp"
 #include "sqlite3.h"
@@ -58,6 +59,12 @@ class Statement;
  */
 class QueryResult;
 
+/**
+ * @brief compiled statement, borrowed from the per-connection cache.
+ * See Database::prepare().
+ */
+class CachedStatement;
+
 /**
 * @brief RAII Database wrapper. 
 * 
@@ -66,6 +73,12 @@ class QueryResult;
 */
 class Database;
 
+/**
+ * @brief incremental I/O of one blob (sqlite3_blob), right from/into the caller's buffer.
+ * @warning like a Statement, must be closed before the Database is closed!
+ */
+class BlobIO;
+
 /** Optional error, returned by most of the functions. */
 //class DatabaseError;
 
@@ -184,6 +197,33 @@ using DatabaseError = impl::DbError<REPORT_UNHANDLED_ERRORS>;
 using Text = std::string_view;
 using Blob = pb::BytesView;
 
+/** Blob of the trivially copyable object (Pixels of the chunk, for example). No copy */
+template <typename T>
+inline Blob as_blob(const T& v) noexcept {
+	static_assert(std::is_trivially_copyable_v<T>, "only raw bytes can be a blob");
+	return Blob(&v, sizeof(T));
+}
+
+/**
+ * bind() argument : blob of this size, filled with zeroes, without any buffer.
+ * Write the data right into the database page later, with BlobIO.
+ */
+struct ZeroBlob {
+	uint64_t size;
+};
+
+/**
+ * bind() argument : Text or Blob, that SQLite copies (SQLITE_TRANSIENT).
+ * Use it when the buffer dies before the statement is executed (temporary strings).
+ * Plain Text and Blob are NOT copied, see Statement::bind().
+ */
+template <typename T>
+struct Copy {
+	T v;
+};
+inline Copy<Text> copy(Text v) noexcept { return {v}; }
+inline Copy<Blob> copy(Blob v) noexcept { return {v}; }
+
 /** implementation specific stuff. Do not use directly! */
 namespace impl {
 
@@ -209,6 +249,10 @@ inline bool sqlite_bind(sqlite3_stmt *stmt, int idx, Blob v) {return sqlite3_bin
 inline bool sqlite_bind_copy(sqlite3_stmt *stmt, int idx, Text v) {return sqlite3_bind_text(stmt, idx, v.data(), v.size(), SQLITE_TRANSIENT);};
 inline bool sqlite_bind_copy(sqlite3_stmt *stmt, int idx, Blob v) {return sqlite3_bind_blob(stmt, idx, v.begin(), v.length(), SQLITE_TRANSIENT);};
 
+inline bool sqlite_bind(sqlite3_stmt *stmt, int idx, ZeroBlob v) {return sqlite3_bind_zeroblob64(stmt, idx, v.size);};
+inline bool sqlite_bind(sqlite3_stmt *stmt, int idx, Copy<Text> v) {return sqlite_bind_copy(stmt, idx, v.v);};
+inline bool sqlite_bind(sqlite3_stmt *stmt, int idx, Copy<Blob> v) {return sqlite_bind_copy(stmt, idx, v.v);};
+
 #undef _TMP_MAGIC_SHIT
 
 /** raw column */
@@ -294,6 +338,7 @@ class QueryResult {
 class Statement {
  private:
   friend class Testing;
+	friend class CachedStatement;
 	sqlite3_stmt *stmt = nullptr;
  public:
 
@@ -377,7 +422,12 @@ class Statement {
 		return rc;
 	}
 
-	/** bind arguments passed to function... some black magic :D */
+	/** bind arguments passed to function... some black magic :D
+	 * Text and Blob are bound with SQLITE_STATIC : SQLite reads the caller's
+	 * buffer, without the copy. It must live (and not change) until the statement
+	 * is reset, rebound or destroyed! Wrap it in sqlite::copy() otherwise.
+	 * ZeroBlob reserves the blob for the BlobIO.
+	 */
 	template <typename... Args>
 	void bind(Args &&...args) noexcept {
 		if (!stmt) return;
@@ -387,7 +437,7 @@ class Statement {
 		if (lim < 1) return;
 
 		/** bind values */
-		int i = 1;	// start from 1
+		[[maybe_unused]] int i = 1;	// start from 1
 
 		(
 				[&] {
@@ -426,6 +476,122 @@ class Statement {
 	~Statement() { release(); }
 };
 
+namespace impl {
+	class StatementCache;
+	struct CacheEntry;
+};
+
+/** counters of the statement cache of one connection */
+struct StatementCacheStats {
+	uint64_t hits = 0;
+	uint64_t misses = 0; // compiled
+	uint64_t evictions = 0;
+	size_t size = 0; // statements in the cache now
+	size_t capacity = 0;
+};
+
+/**
+ * @brief statement from the LRU cache of the Database, see Database::prepare().
+ * It is reset and unbound when you get it, and goes back to the cache on
+ * destruction (or give_back()). Same API as Statement, except compile() and
+ * release() : SQL of the cached statement never changes.
+ *
+ * @warning like a Statement, must be destroyed before the Database is closed!
+ */
+class CachedStatement : private Statement {
+	friend class Database;
+	impl::StatementCache* cache = nullptr;
+	impl::CacheEntry* entry = nullptr; // nullptr : not cached, finalized on give_back()
+	void attach(impl::StatementCache* c, impl::CacheEntry* e, sqlite3_stmt* s) noexcept {
+		cache = c; entry = e; stmt = s;
+	}
+ public:
+	CachedStatement() = default;
+	CachedStatement(const CachedStatement &) = delete;
+	CachedStatement &operator=(const CachedStatement &) = delete;
+	CachedStatement(CachedStatement &&src) noexcept { *this = std::move(src); }
+	CachedStatement &operator=(CachedStatement &&src) noexcept {
+		if (this == &src) return *this;
+		give_back();
+		attach(src.cache, src.entry, src.stmt);
+		src.attach(nullptr, nullptr, nullptr);
+		return *this;
+	}
+
+	/** returns statement to the cache early. Empty after that */
+	void give_back() noexcept;
+
+	using Statement::operator bool;
+	using Statement::iterate;
+	using Statement::result;
+	using Statement::reset;
+	using Statement::execute;
+	using Statement::bind;
+	using Statement::unbind;
+	using Statement::is_busy;
+	using Statement::expanded_sql;
+	using Statement::operator sqlite3_stmt*;
+
+	~CachedStatement() { give_back(); }
+};
+
+/**
+ * Reads and writes the blob in place, without the statement : data goes
+ * between the database pages and the caller's buffer directly, with no
+ * temporary copies (as column results or TRANSIENT binds have).
+ * Size of the blob can't be changed : reserve it with ZeroBlob on insert.
+ * Handle is invalidated (SQLITE_ABORT) if the row is changed or deleted by
+ * anything else : reopen() it then.
+ */
+class BlobIO {
+ friend class Testing;
+ protected:
+	sqlite3_blob *blob = nullptr;
+ public:
+	BlobIO() = default;
+	BlobIO(const BlobIO &) = delete;
+	BlobIO &operator=(const BlobIO &) = delete;
+	BlobIO(BlobIO &&src) noexcept { *this = std::move(src); }
+	BlobIO &operator=(BlobIO &&src) noexcept {
+		if (this == &src) return *this;
+		close().supress();
+		blob = src.blob;
+		src.blob = nullptr;
+		return *this;
+	}
+
+	operator bool() const noexcept { return !!blob; }
+
+	/** opens blob in the column of the row with this rowid (INTEGER PRIMARY KEY).
+	 * Closes the previous one. Error message is in the database.
+	 */
+	[[nodiscard]] DatabaseError open(sqlite3 *db, const char* table, const char* column, int64_t rowid, bool writable = false, const char* schema = "main") noexcept;
+
+	/** same table and column, another row. Much cheaper, than open() */
+	[[nodiscard]] DatabaseError reopen(int64_t rowid) noexcept;
+
+	/** size of the blob in bytes. 0 if not opened */
+	size_t size() const noexcept { return blob ? size_t(sqlite3_blob_bytes(blob)) : 0; }
+
+	/** reads dst.length() bytes at the offset into dst. SQLITE_ERROR if the blob is shorter */
+	[[nodiscard]] DatabaseError read(Blob dst, size_t offset = 0) noexcept;
+
+	/** writes src at the offset. SQLITE_ERROR if it doesn't fit */
+	[[nodiscard]] DatabaseError write(Blob src, size_t offset = 0) noexcept;
+
+	/** may return an error of the last write */
+	DatabaseError close() noexcept {
+		if (!blob) return SQLITE_OK;
+		int err = sqlite3_blob_close(blob);
+		blob = nullptr;
+		return err;
+	}
+
+	operator sqlite3_blob *() noexcept { return blob; } // rawdog pointer
+
+	~BlobIO() { close().supress(); }
+};
+
 class Backup {
  friend class Testing;
  protected:
@@ -521,6 +687,7 @@ class Database {
 	friend class Testing;
 	sqlite3 *db = nullptr;
 	bool own_handle = false;
+	impl::StatementCache* cache = nullptr; // of prepare(), created on the first use
  public:
 	Database() = default;
 	Database(const Database &) = delete;
@@ -534,7 +701,9 @@ class Database {
 	Database(Database && src) noexcept {
 		db = src.db; 
 		own_handle = src.own_handle;
+		cache = src.cache;
 		src.db = nullptr;
+		src.cache = nullptr;
 		//LOG_DEBUG("DATABASE MOVED! %p %i", db, own_handle);
 	}
 
@@ -595,9 +764,35 @@ class Database {
 		if (db) sqlite3_db_release_memory(db);
 	}
 
+	/** rowid of the last INSERT on this connection, for BlobIO::open() */
+	int64_t last_insert_rowid() const { return db ? sqlite3_last_insert_rowid(db) : 0; }
+
 	/** check is database readonly. result on closed/not opened database is undefined. */
 	bool is_readonly() { return db ? sqlite3_db_readonly(db, "main") : false; }
 
+	/**
+	 * Compiled statement for this SQL from the LRU cache of this connection, or
+	 * compiled now (with SQLITE_PREPARE_PERSISTENT) on the cache miss. SQL must be
+	 * ONE statement, and it is the key : same text => same statement.
+	 * If the cached one is in use already, dst gets a new one, that is not cached.
+	 * @return SQLITE_OK, SQLITE_EMPTY for no code, or error (dst is empty then)
+	 */
+	[[nodiscard]] DatabaseError prepare(Text sql, CachedStatement& dst) noexcept;
+
+	/** runs ONE statement through the statement cache, results are ignored.
+	 * @return SQLITE_DONE, or error (of prepare() or of the execution)
+	 */
+	[[nodiscard]] DatabaseError execute(Text sql) noexcept;
+
+	/** hit/miss counters and size of the statement cache */
+	StatementCacheStats cache_stats() const noexcept;
+
+	/**
+	 * max count of the cached statements, 64 by default. Statements in use are never evicted.
+	 * Does nothing without the connection, and is reset by close()
+	 */
+	void set_cache_size(size_t n) noexcept;
+
 	/** fire and forget. sqlite3_exec()-like, but with bind() available (and without row callback). throws on error! */
 	template <typename... Args>
 	inline void exec(Text sql, Args&& ...args) {
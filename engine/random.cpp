@@ -167,6 +167,8 @@ static unsigned char perm[] = {
 		205, 93,	222, 114, 67,	 29,	24,	 72,	243, 141, 128, 195, 78,
 		66,	 215, 61,	 156, 180}; */
 
+NoiseGen::NoiseGen(uint64_t seed) { randomize(seed); }
+
 void NoiseGen::randomize(uint64_t seed) {	 // my extension
 	bool done[256] = {0};
 
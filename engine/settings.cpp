@@ -0,0 +1,171 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Ultimate settings storage
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "settings.hpp"
+
+#include <cstdio>
+
+#include "doctest.h"
+
+namespace pb {
+
+void SettingsManager::init_stmts(const char* tab) {
+	static char tmp[515] = {0};
+	int n = snprintf_(tmp, 512, "CREATE TABLE IF NOT EXISTS %s (key STRING PRIMARY KEY NOT NULL, value)", tab);
+	if (n > 0) {
+		std::string_view sql(tmp, n);
+		sqlite::Statement stmt;
+		stmt.compile(db, sql).raise();
+		stmt.execute().raise();
+	};
+	n = snprintf_(tmp, 512, "SELECT key, value FROM %s", tab);
+	if (n > 0) load_sql.assign(tmp, n);
+	n = snprintf_(tmp, 512, "INSERT OR REPLACE INTO %s(key, value) VALUES (?1, ?2)", tab);
+	if (n > 0) set_sql.assign(tmp, n);
+}
+
+/** whole table, one query. Called once on open : nobody else writes this table */
+void SettingsManager::load() {
+	cache.clear();
+	dirty.clear();
+	sqlite::CachedStatement load_stmt;
+	db.prepare(load_sql, load_stmt).raise();
+	sqlite::DatabaseError rc;
+	while ((rc = load_stmt.iterate()) == SQLITE_ROW) {
+		auto res = load_stmt.result();
+		SettingValue v;
+		v.type = res.type(1);
+		switch (v.type) {
+			case SQLITE_INTEGER: v.i = res.get<int64_t>(1); break;
+			case SQLITE_FLOAT: v.d = res.get<double>(1); break;
+			case SQLITE_NULL: break;
+			default: // blobs are kept as the text
+				v.type = SQLITE_TEXT;
+				v.s = res.get<std::string>(1);
+				break;
+		}
+		cache[res.get<std::string>(0)].value = std::move(v);
+	}
+	if (rc != SQLITE_DONE) LOG_ERROR("Can't load settings : %s", sqlite3_errmsg(db));
+	last_flush = std::chrono::steady_clock::now();
+	LOG_DEBUG("%zu settings loaded", cache.size());
+}
+
+bool SettingsManager::flush() {
+	last_flush = std::chrono::steady_clock::now();
+	if (dirty.empty() || !db) return true;
+
+	sqlite::CachedStatement set_stmt;
+	if (!db.prepare(set_sql, set_stmt).check() || db.execute("BEGIN") != SQLITE_DONE) {
+		LOG_ERROR("Can't write settings : %s", sqlite3_errmsg(db));
+		return false;
+	}
+	bool ok = true;
+	for (const std::string& key : dirty) {
+		const SettingValue& v = cache.find(key)->second.value;
+		sqlite::Text k = key;
+		switch (v.type) {
+			case SQLITE_INTEGER: set_stmt.bind(k, v.i); break;
+			case SQLITE_FLOAT: set_stmt.bind(k, v.d); break;
+			case SQLITE_TEXT: set_stmt.bind(k, sqlite::Text(v.s)); break;
+			default: set_stmt.bind(k, nullptr); break;
+		}
+		if (set_stmt.execute() != SQLITE_DONE) {
+			ok = false;
+			break;
+		}
+	}
+	set_stmt.give_back();
+	if (ok && db.execute("COMMIT") != SQLITE_DONE) ok = false;
+	if (!ok) {
+		LOG_ERROR("Can't write settings : %s", sqlite3_errmsg(db));
+		db.execute("ROLLBACK").supress();
+		return false;
+	}
+
+	for (const std::string& key : dirty) cache.find(key)->second.dirty = false;
+	dirty.clear();
+	return true;
+}
+
+void SettingsManager::open(const char* dbname) {
+	close();
+	sqlite::Database src(dbname);
+	src.assert_owned();
+	db = std::move(src);
+	db.assert_owned();
+	init_stmts("pb_settings");
+	load();
+}
+
+void SettingsManager::use_handler(sqlite3* h, const char* tabname) {
+	db.from_raw(h, false); // don't manage it! caller is responcible for freeing database handle!
+	init_stmts(tabname);
+	load();
+}
+
+void SettingsManager::close() {
+	if (db) flush();
+	db.close();
+	cache.clear();
+	dirty.clear();
+}
+
+TEST_CASE("SettingsManager write-back cache") {
+	const char* path = "pb_test_settings.db";
+	remove(path);
+	{
+		SettingsManager m;
+		m.open(path);
+		int w = 0;
+		REQUIRE(!m.get("width", w));
+		m.set("width", 1280);
+		m.set("scale", 1.5);
+		m.set("name", "Pixelbox");
+		m.set("width", 1920);
+		REQUIRE(m.dirty_count() == 3);
+		REQUIRE(m.get("width", w));
+		REQUIRE(w == 1920);
+		REQUIRE(m.flush());
+		REQUIRE(m.dirty_count() == 0);
+		m.set("width", 1920); // same value : nothing to write
+		REQUIRE(m.dirty_count() == 0);
+		m.set("height", 720); // written by close()
+	}
+	{
+		SettingsManager m;
+		m.open(path);
+		int w = 0, h = 0;
+		double scale = 0;
+		std::string name;
+		REQUIRE(m.get("width", w));
+		REQUIRE(m.get("height", h));
+		REQUIRE(m.get("scale", scale));
+		REQUIRE(m.get("name", name));
+		REQUIRE(w == 1920);
+		REQUIRE(h == 720);
+		REQUIRE(scale == 1.5);
+		REQUIRE(name == "Pixelbox");
+		REQUIRE(m.get("width", name)); // converted
+		REQUIRE(name == "1920");
+	}
+	remove(path);
+}
+
+};
@@ -18,89 +18,141 @@
  */
 
 #pragma once
+#include <chrono>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
+
 #include "engine/raiisqlite.hpp"
 #include "printf.h"
 
 namespace pb {
 
+	/** cached value of the setting, typed as SQLite stores it */
+	struct SettingValue {
+		int type = SQLITE_NULL; // SQLITE_INTEGER, SQLITE_FLOAT or SQLITE_TEXT
+		int64_t i = 0;
+		double d = 0;
+		std::string s;
+
+		bool operator==(const SettingValue&) const = default;
+
+		/** conversions are the same as SQLite does for the columns */
+		template <typename T>
+		T as() const {
+			if constexpr (std::is_arithmetic_v<T>) {
+				if (type == SQLITE_INTEGER) return T(i);
+				if (type == SQLITE_FLOAT) return T(d);
+				if (type == SQLITE_TEXT) return T(strtod(s.c_str(), nullptr));
+				return T(0);
+			} else {
+				static_assert(std::is_same_v<T, std::string>, "setting can be a number or a string");
+				if (type == SQLITE_TEXT) return s;
+				if (type == SQLITE_INTEGER) return std::to_string(i);
+				if (type == SQLITE_FLOAT) {
+					char tmp[32];
+					snprintf_(tmp, sizeof(tmp), "%.17g", d);
+					return tmp;
+				}
+				return std::string();
+			}
+		}
+
+		template <typename T>
+		static SettingValue from(const T& v) {
+			SettingValue r;
+			if constexpr (std::is_same_v<T, std::nullptr_t>) {
+			} else if constexpr (std::is_integral_v<T>) {
+				r.type = SQLITE_INTEGER;
+				r.i = int64_t(v);
+			} else if constexpr (std::is_floating_point_v<T>) {
+				r.type = SQLITE_FLOAT;
+				r.d = double(v);
+			} else {
+				r.type = SQLITE_TEXT;
+				r.s = std::string(sqlite::Text(v));
+			}
+			return r;
+		}
+	};
+
+	/**
+	 * Key-value settings in the SQLite table, with the write-back cache :
+	 * open() loads the whole table in one query, get() is served from memory,
+	 * set() only marks the key dirty. Dirty keys are written in ONE transaction
+	 * by flush(), tick() (at most every flush_interval seconds) and close().
+	 * So one fsync per flush, not per key.
+	 */
 	class SettingsManager {
 		public:
 		sqlite::Database db;
+		/** tick() writes dirty keys not more often than this, seconds */
+		double flush_interval = 2.0;
 		protected:
-		sqlite::Statement get_stmt;
-		sqlite::Statement set_stmt;
-		void init_stmts(const char* tab) {
-			static char tmp[515] = {0};
-			db.assert_owned();
-			int n = snprintf_(tmp, 512, "CREATE TABLE IF NOT EXISTS %s (key STRING PRIMARY KEY NOT NULL, value)", tab);
-			if (n > 0) {
-				std::string_view sql(tmp, n);
-				sqlite::Statement stmt;
-				stmt.compile(db, sql).raise();
-				stmt.execute().raise();
-			};
-			n = snprintf_(tmp, 512, "SELECT value FROM %s WHERE key = ?1", tab);
-			if (n > 0) {
-				std::string_view sql(tmp, n);
-				get_stmt.compile(db, sql).raise();
-			}
-			n = snprintf_(tmp, 512, "INSERT OR REPLACE INTO %s(key, value) VALUES (?1, ?2)", tab);
-			if (n > 0) {
-				std::string_view sql(tmp, n);
-				set_stmt.compile(db, sql).raise();
-			}
-			db.assert_owned();
-		}
+		struct Entry {
+			SettingValue value;
+			bool dirty = false;
+		};
+		std::map<std::string, Entry, std::less<>> cache;
+		std::vector<std::string> dirty; // keys, in the order of the first set()
+		std::chrono::steady_clock::time_point last_flush;
+
+		// statements are in the cache of the db
+		std::string load_sql;
+		std::string set_sql;
+		void init_stmts(const char* tab);
+		void load();
 		public:
 		SettingsManager() = default;
 		public:
 
 		template <typename T>
-		bool get(const char* id, T& dest) {
-			get_stmt.bind(id);
-			bool stat = false;
-			while (get_stmt.iterate() == SQLITE_ROW) {
-				auto res = get_stmt.result();
-				if (!res.count()) return false;
-				dest = res.get<T>(0);
-				LOG_DEBUG("get %s success (%s)", id, res.get<std::string>(0).c_str());
-				stat = true;
-			}
-			return stat;
+		bool get(const char* id, T& dest) const {
+			auto it = cache.find(std::string_view(id));
+			if (it == cache.end() || it->second.value.type == SQLITE_NULL) return false;
+			dest = it->second.value.template as<T>();
+			return true;
 		}
 
+		/** in memory. Written to the database later, see the class description */
 		template <typename T>
 		void set(const char* id, const T& data) {
-			set_stmt.bind(id, data);
-			return set_stmt.execute().raise();
+			SettingValue v = SettingValue::from(data);
+			auto it = cache.find(std::string_view(id));
+			if (it == cache.end()) it = cache.emplace(id, Entry()).first;
+			else if (it->second.value == v) return; // nothing to write
+			it->second.value = std::move(v);
+			if (!it->second.dirty) {
+				it->second.dirty = true;
+				dirty.push_back(it->first);
+			}
 		}
 
-		/// open database that will be managed By settings manager
-		void open(const char* dbname) {
-			close();
-			sqlite::Database src(dbname);
-			src.assert_owned();
-			LOG_INFO("WHAT");
-			db = std::move(src);
-			db.assert_owned();
-			LOG_INFO("FINE");
-			init_stmts("pb_settings");
+		/** count of the keys, that are not written yet */
+		size_t dirty_count() const {return dirty.size();}
+
+		/** writes all dirty keys in one transaction. On error they stay dirty, and false is returned */
+		bool flush();
+
+		/** call once per frame : flush(), if there are dirty keys, and the last flush was flush_interval seconds ago */
+		void tick() {
+			if (dirty.empty()) return;
+			auto now = std::chrono::steady_clock::now();
+			if (std::chrono::duration<double>(now - last_flush).count() >= flush_interval) flush();
 		}
 
+		/// open database that will be managed By settings manager
+		void open(const char* dbname);
+
 		// USE database managed externally. This handler MUST NOT BE FREED UNTIL DESTRUCTION OF THIS MANAGER!
-		void use_handler(sqlite3* h, const char* tabname="pb_settings") {
-			db.from_raw(h, false); // don't manage it! caller is responcible for freeing database handle!
-			init_stmts(tabname);
-		}
+		void use_handler(sqlite3* h, const char* tabname="pb_settings");
 
-		void close() {
-			get_stmt.release();
-			set_stmt.release();
-			db.close();
-		}
+		/** flushes dirty keys, and closes the database */
+		void close();
 
 		~SettingsManager() {close();}
 	};
 
 };
-
@@ -0,0 +1,161 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Synchronization primitives : spinlock, mutex with wait time accounting
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "sync.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#define PROFILER_DEFINE_EXT
+#include "profiler.hpp"
+#include "tsc.hpp"
+#include "doctest.h"
+
+namespace pb {
+
+LockTag::LockTag(const char* name) : _zone(&prof::intern_zone(name)) {
+	_next = _head.load(std::memory_order_relaxed);
+	while (!_head.compare_exchange_weak(_next, this, std::memory_order_release, std::memory_order_relaxed)) {}
+}
+
+void LockTag::add_wait(uint64_t ticks) {
+	_contended.fetch_add(1, std::memory_order_relaxed);
+	_wait.fetch_add(ticks, std::memory_order_relaxed);
+	uint64_t max = _max_wait.load(std::memory_order_relaxed);
+	while (ticks > max && !_max_wait.compare_exchange_weak(max, ticks, std::memory_order_relaxed)) {}
+}
+
+const char* LockTag::name() const {
+	return _zone->name;
+}
+
+double LockTag::wait_time() const {
+	return tsc::to_seconds(_wait.load(std::memory_order_relaxed));
+}
+
+double LockTag::max_wait_time() const {
+	return tsc::to_seconds(_max_wait.load(std::memory_order_relaxed));
+}
+
+/** spins before sleeping in the std::mutex. Backoff makes the last ones longer */
+static constexpr uint32_t MUTEX_SPINS = 8;
+
+/*
+ * Wait is a zone in the profiler of the waiting thread (if this thread is
+ * registered there at all). Zone ends after the lock is taken.
+ */
+void TaggedMutex::lock_slow() {
+	uint64_t start = tsc::now();
+	bool profiled = prof::has_thread_data();
+	if (profiled) prof::get_thread_data().begin(tag->zone());
+
+	bool locked = false;
+	for (uint32_t n = 0; n < MUTEX_SPINS && !locked; n++) {
+		impl::spin_wait(n);
+		locked = m.try_lock();
+	}
+	if (!locked) m.lock(); // park
+
+	if (profiled) prof::get_thread_data().end();
+	tag->add_wait(tsc::now() - start);
+}
+
+TEST_CASE("SpinLock") {
+	SpinLock lock;
+	uint64_t counter = 0;
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; t++) threads.emplace_back([&]() {
+		for (int i = 0; i < 20000; i++) {
+			std::lock_guard l(lock);
+			counter++;
+		}
+	});
+	for (auto& t : threads) t.join();
+	REQUIRE(counter == 4 * 20000);
+}
+
+TEST_CASE("BoundedQueue") {
+	static BoundedQueue<uint64_t, 64> queue;
+	uint64_t v;
+	REQUIRE(!queue.try_pop(v));
+	for (uint64_t i = 0; i < 64; i++) REQUIRE(queue.try_push(i));
+	REQUIRE(!queue.try_push(64)); // full
+	for (uint64_t i = 0; i < 64; i++) {
+		REQUIRE(queue.try_pop(v));
+		REQUIRE(v == i);
+	}
+
+	// 4 producers, 1 consumer : every value is popped exactly once
+	constexpr uint64_t PER_THREAD = 20000;
+	std::vector<std::thread> threads;
+	for (uint64_t t = 0; t < 4; t++) threads.emplace_back([t]() {
+		for (uint64_t i = 0; i < PER_THREAD; i++) {
+			while (!queue.try_push(t * PER_THREAD + i)) std::this_thread::yield();
+		}
+	});
+	std::vector<uint8_t> seen(4 * PER_THREAD);
+	for (uint64_t n = 0; n < 4 * PER_THREAD;) {
+		if (!queue.try_pop(v)) continue;
+		REQUIRE(v < seen.size());
+		seen[v]++;
+		n++;
+	}
+	for (auto& t : threads) t.join();
+	REQUIRE(std::count(seen.begin(), seen.end(), 1) == int(seen.size()));
+}
+
+TEST_CASE("TaggedMutex contention") {
+	static LockTag tag("Lock::Test");
+	TaggedMutex lock(tag);
+	const prof::ThreadHistory* h = nullptr;
+
+	lock.lock();
+	std::atomic<bool> started = false;
+	std::thread waiter([&]() {
+		auto prof_ctx = prof::make_thread_data();
+		prof::ThreadData prof = prof::get_thread_data();
+		h = prof::get_history(std::this_thread::get_id());
+		started = true;
+		lock.lock(); // waits for the main thread
+		lock.unlock();
+		prof.step();
+	});
+	while (!started) std::this_thread::yield();
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	lock.unlock();
+	waiter.join();
+
+	REQUIRE(tag.contended() == 1);
+	REQUIRE(tag.wait_time() > 0.005);
+	REQUIRE(tag.max_wait_time() == tag.wait_time());
+
+	prof::HistoryView view(h, prof::get_current_position(h));
+	size_t i = 0;
+	while (i < view.size() && view.zone(i) != &tag.zone()) i++;
+	REQUIRE(i < view.size());
+	REQUIRE(view.stats(i).ncalls == 1);
+	REQUIRE(view.stats(i).sumtime > 0.005);
+
+	bool found = false;
+	for (auto t = LockTag::first(); t; t = t->next()) found |= t == &tag;
+	REQUIRE(found);
+}
+
+};	// namespace pb
@@ -0,0 +1,256 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Synchronization primitives : spinlock, mutex with wait time accounting
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "base.hpp"
+
+namespace pb {
+
+namespace prof {
+	struct ZoneDesc;
+};
+
+namespace impl {
+
+	/** busy waiting hint for the CPU */
+	inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+		asm volatile("yield");
+#endif
+	}
+
+	/** spin iteration n of the lock waiting : exponential backoff, then the thread gives up it's timeslice */
+	inline void spin_wait(uint32_t n) {
+		if (n < 8) {
+			for (uint32_t i = 0; i < (1u << n); i++) cpu_relax();
+		} else {
+			std::this_thread::yield();
+		}
+	}
+
+};	// namespace impl
+
+/**
+ * Use ONLY under very active load, and short lock period!
+ * Waits on the plain load (no cache line ping-pong), with backoff, and yields
+ * when the owner is clearly not going to release it soon.
+ * Not instrumented : profiler uses it itself.
+ */
+class SpinLock {
+	std::atomic_bool lo = false;
+	public:
+	inline bool try_lock() {
+		// not even try to take cache line exclusively, if lock is taken
+		if (lo.load(std::memory_order_relaxed)) return false;
+		bool unlocked = false;
+		return lo.compare_exchange_weak(unlocked, true, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+	inline void lock() {
+		for (uint32_t n = 0; !try_lock(); n++) impl::spin_wait(n);
+	}
+	inline void unlock() {
+		lo.store(false, std::memory_order_release);
+	}
+};
+
+/**
+ * Named contention counters of the lock (or of the group of locks, like all
+ * the shards of the map). Only contended acquisitions are counted : counting
+ * every lock() in the shared place would be a contention itself.
+ *
+ * Waits are also recorded into the profiler of the waiting thread, as the
+ * pseudo-zone with the same name : they are seen in the call list, traces, etc.
+ *
+ * Tags register themselves in the global list on construction, and are never
+ * unregistered : make them static or global. Profiler UI shows all of them.
+ */
+class LockTag : public Static {
+	const prof::ZoneDesc* _zone;
+	std::atomic<uint64_t> _contended = 0;
+	std::atomic<uint64_t> _wait = 0; // tsc ticks
+	std::atomic<uint64_t> _max_wait = 0;
+	LockTag* _next = nullptr;
+
+	static inline std::atomic<LockTag*> _head = nullptr;
+
+	public:
+	/** name is also the name of the profiler zone : "Lock::Something" is a good one */
+	LockTag(const char* name);
+
+	/** one contended acquisition, that waited for ticks */
+	void add_wait(uint64_t ticks);
+
+	const char* name() const;
+	const prof::ZoneDesc& zone() const { return *_zone; }
+	uint64_t contended() const { return _contended.load(std::memory_order_relaxed); }
+	double wait_time() const; // seconds, total
+	double max_wait_time() const; // seconds
+
+	/** iteration over all tags : for (auto t = LockTag::first(); t; t = t->next()) */
+	static const LockTag* first() { return _head.load(std::memory_order_acquire); }
+	const LockTag* next() const { return _next; }
+};
+
+/**
+ * std::mutex, that counts it's contention in the LockTag.
+ * Uncontended lock() is just std::mutex::try_lock(). Contended one spins a bit
+ * with backoff (critical sections are usually short), then sleeps in the std::mutex.
+ * Works with std::unique_lock and std::condition_variable_any.
+ */
+class TaggedMutex {
+	std::mutex m;
+	LockTag* tag;
+	void lock_slow();
+	public:
+	TaggedMutex(LockTag& dst) : tag(&dst) {}
+	TaggedMutex(const TaggedMutex&) = delete;
+	TaggedMutex& operator=(const TaggedMutex&) = delete;
+
+	inline bool try_lock() { return m.try_lock(); }
+	inline void lock() {
+		if (m.try_lock()) [[likely]] return;
+		lock_slow();
+	}
+	inline void unlock() { m.unlock(); }
+};
+
+/**
+ * Bounded lock-free MPMC queue (Vyukov's) : every slot has a sequence number,
+ * that says whose turn it is, so push and pop are just one CAS on the
+ * head/tail. Nobody ever waits : try_push() fails if the queue is full,
+ * try_pop() if it is empty. N is a power of two.
+ * Big, keep it in the heap or in the static storage.
+ */
+template <class T, size_t N>
+class BoundedQueue : public Static {
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of two");
+	struct Slot {
+		std::atomic<size_t> seq;
+		T value;
+	};
+	alignas(64) std::atomic<size_t> head = 0; // next push
+	alignas(64) std::atomic<size_t> tail = 0; // next pop
+	alignas(64) Slot slots[N];
+	public:
+	BoundedQueue() {
+		for (size_t i = 0; i < N; i++) slots[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	/** fill(T&) writes the value right into the slot : no copy of the big T */
+	template <class F>
+	bool try_push_with(F&& fill) {
+		size_t pos = head.load(std::memory_order_relaxed);
+		Slot* s;
+		for (;;) {
+			s = &slots[pos & (N - 1)];
+			size_t seq = s->seq.load(std::memory_order_acquire);
+			intptr_t dif = intptr_t(seq) - intptr_t(pos);
+			if (dif == 0) {
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (dif < 0) {
+				return false; // full
+			} else {
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+		fill(s->value);
+		s->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+	bool try_push(const T& v) {
+		return try_push_with([&v](T& dst) { dst = v; });
+	}
+
+	bool try_pop(T& dst) {
+		size_t pos = tail.load(std::memory_order_relaxed);
+		Slot* s;
+		for (;;) {
+			s = &slots[pos & (N - 1)];
+			size_t seq = s->seq.load(std::memory_order_acquire);
+			intptr_t dif = intptr_t(seq) - intptr_t(pos + 1);
+			if (dif == 0) {
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			} else if (dif < 0) {
+				return false; // empty
+			} else {
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+		dst = s->value;
+		s->seq.store(pos + N, std::memory_order_release);
+		return true;
+	}
+};
+
+/**
+
+ resource and other shared thread stuff...
+
+  */
+template <class T, class Mutex = std::mutex>
+struct ResUsage {
+	std::unique_lock<Mutex> lock;
+	T& ref;
+	public:
+	operator T& () {return ref;}
+};
+
+template<class T, class Mutex = std::mutex>
+class Resource : public T{
+	private:
+	Mutex m;
+	//T object;
+	public:
+	template<class... Args>
+	Resource(Args&&... args) : T(std::forward<Args>(args)...) {}
+	ResUsage<T, Mutex> use() {
+		return {std::unique_lock<Mutex>(m), static_cast<T&>(*this)};
+	}
+};
+
+/*
+ * For debug. Turns resource aqquring and releaseing into NOOP
+ */
+template <class T>
+struct ResUsage<T, void> {
+	T& ref;
+	public:
+	operator T& () {return ref;}
+};
+
+template<class T>
+class Resource<T, void> : public T{
+	private:
+	//T object;
+	public:
+	template<class... Args>
+	Resource(Args&&... args) : T(std::forward<Args>(args)...) {}
+	ResUsage<T, void> use() {
+		return {static_cast<T&>(*this)};
+	}
+};
+
+};	// namespace pb
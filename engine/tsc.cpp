@@ -0,0 +1,97 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Cheap timestamps for the profiler : raw CPU counter, calibrated once
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "tsc.hpp"
+#include "base.hpp"
+
+#include <time.h>
+#if defined(PB_TSC_X86)
+#include <cpuid.h>
+#endif
+
+#include <doctest.h>
+
+namespace pb {
+
+namespace tsc {
+
+static uint64_t raw_ns() {
+	timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+#if defined(PB_TSC_X86)
+static bool no_invariant_tsc() {
+	unsigned a, b, c, d;
+	if (__get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1u << 8))) return false;
+	LOG_WARN("CPU has no invariant TSC : profiler uses clock_gettime()");
+	return true;
+}
+
+bool impl::use_clock = no_invariant_tsc();
+#endif
+
+static double calibrate() {
+#if defined(PB_TSC_X86)
+	if (impl::use_clock) return 1e-9;
+#elif defined(PB_TSC_ARM)
+	uint64_t freq;
+	asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+	if (freq) return 1.0 / double(freq);
+	// not set up by the firmware : measure it
+#endif
+#if defined(PB_TSC_X86) || defined(PB_TSC_ARM)
+	// spin for 10 ms. Sleeping would be less presize
+	uint64_t ns0 = raw_ns(), t0 = now();
+	uint64_t ns1 = ns0, t1 = t0;
+	while (ns1 - ns0 < 10000000) {
+		ns1 = raw_ns();
+		t1 = now();
+	}
+	double res = double(ns1 - ns0) * 1e-9 / double(t1 - t0);
+	LOG_DEBUG("Timestamp counter : %.3f MHz", 1e-6 / res);
+	return res;
+#else
+	return 1e-9; // nanoseconds already
+#endif
+}
+
+double seconds_per_tick() {
+	static const double v = calibrate();
+	return v;
+}
+
+TEST_CASE("TSC") {
+	uint64_t ns0 = raw_ns(), t0 = now();
+	uint64_t ns1 = ns0;
+	while (ns1 - ns0 < 20000000) ns1 = raw_ns();
+	double real = double(ns1 - ns0) * 1e-9;
+	double measured = to_seconds(now() - t0);
+	REQUIRE(measured > real * 0.9);
+	REQUIRE(measured < real * 1.1 + 0.001);
+}
+
+};
+
+};
@@ -0,0 +1,89 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Cheap timestamps for the profiler : raw CPU counter, calibrated once
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <cstdint>
+
+/**
+ * rdtsc on x86 (if the CPU has invariant TSC), cntvct_el0 on arm64,
+ * clock_gettime() everywhere else.
+ * #define PB_NO_TSC to always use clock_gettime().
+ */
+#if !defined(PB_NO_TSC) && (defined(__x86_64__) || defined(__i386__))
+#define PB_TSC_X86 1
+#include <x86intrin.h>
+#elif !defined(PB_NO_TSC) && defined(__aarch64__)
+#define PB_TSC_ARM 1
+#endif
+#include <time.h>
+
+namespace pb {
+
+namespace tsc {
+
+namespace impl {
+
+#if defined(PB_TSC_X86)
+/**
+ * CPU has no invariant TSC : it drifts with the frequency, and may go
+ * backwards between cores. now() uses clock_gettime() then.
+ * Checked once, on the static initialization of tsc.cpp.
+ */
+extern bool use_clock;
+#endif
+
+inline uint64_t clock_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+};
+
+/**
+ * Raw timestamp in ticks. Monotonic, but tick length is unknown until
+ * calibration : store ticks, and convert to seconds only when showing them.
+ */
+inline uint64_t now() {
+#if defined(PB_TSC_X86)
+	if (impl::use_clock) [[unlikely]] return impl::clock_ns();
+	return __rdtsc();
+#elif defined(PB_TSC_ARM)
+	uint64_t v;
+	asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+	return v;
+#else
+	return impl::clock_ns();
+#endif
+}
+
+/**
+ * Length of one tick. On x86 first call calibrates the counter against
+ * CLOCK_MONOTONIC_RAW, and takes ~10 ms. arm64 counter reports it's
+ * frequency, clock_gettime() ticks are nanoseconds. Thread safe.
+ */
+double seconds_per_tick();
+
+inline double to_seconds(uint64_t ticks) {
+	return double(ticks) * seconds_per_tick();
+}
+
+};
+
+};
@@ -17,16 +17,25 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#pragma once
 #include "base.hpp"
 #include <stdint.h>
 #include <new>
 #include "hashmap.hpp"
+#include "concurrent_hashmap.hpp"
+#include "memory.hpp"
 
  namespace pb {
 
 	enum {
 		PIX_NUL = 0,
 		PIX_AIR = 1,
+		PIX_STONE,
+		PIX_DIRT,
+		PIX_GRASS,
+		PIX_ORE,
+		PIX_WOOD,
+		PIX_LEAVES,
 		PIX_ALL = 256 // MAX + 1
 	};
 
@@ -59,6 +68,7 @@
 	union ChunkCoords {
 		u16 part[2];
 		u32 combo;
+		inline bool operator==(const ChunkCoords& b) const {return combo == b.combo;}
 	};
 	static_assert(sizeof(ChunkCoords) == sizeof(uint32_t));
 
@@ -70,32 +80,42 @@
 		bool        is_ready : 1 = false; // ready or invalid still
 		bool        in_free_list : 1 = false; // must be deleted frpom free list if will be recruited
 		bool        is_changed : 1 = false; // unchanged since lload/gen or last global save chunks shall not be saved again
-		Pixels      zone_a, zone_b; // threading zones
+		Pixels      zone_a = {}, zone_b = {}; // threading zones
 	};
 	// TODO :  add BBOX i8 and etc.
 
 	struct WorldStorage {
 		public:
+		// memory of the maps below, for the profiler
+		static inline MemoryTag chunk_map_mem{"World chunk map"};
+		static inline MemoryTag queues_mem{"World load/save queues"};
+
+		using ChunkQueue = pb::HashMap<ChunkCoords, Chunk*, hash_obj<ChunkCoords>, HashMapEqualTo<ChunkCoords>, TaggedAllocator>;
+
 		bool is_zone_b = false; // 0 => zone_a, 1=>zone_b
-		pb::HashMap<ChunkCoords, Chunk*, hash_obj<ChunkCoords>> chunk_map; // use murmurhash for pos
+		// lookups are threadsafe and lock-free, changes are done by the main thread.
+		// Chunks, that may still be seen by other threads, shall be chunk_map.retire()d instead of deleted
+		pb::ConcurrentHashMap<ChunkCoords, Chunk*, hash_obj<ChunkCoords>, 16, TaggedAllocator> chunk_map{TaggedAllocator(chunk_map_mem)};
 
 		// secondary
 		// load queue may still be here,but save_queue will be moved out into other master container
-		pb::HashMap<ChunkCoords, Chunk*, hash_obj<ChunkCoords>> load_queue; // chunks to be loaded, already present in chunk_map with laoded=False
-		pb::HashMap<ChunkCoords, Chunk*, hash_obj<ChunkCoords>> save_queue; // save queue for chunks
+		ChunkQueue load_queue{TaggedAllocator(queues_mem)}; // chunks to be loaded, already present in chunk_map with laoded=False
+		ChunkQueue save_queue{TaggedAllocator(queues_mem)}; // save queue for chunks
 		public:
 
-		/// get chunk only if it actually exists, else nullptr
+		/// get chunk only if it actually exists, else nullptr.
+		/// Threadsafe. Keep chunk_map.pin() while you use the chunk from other thread
 		inline Chunk* getPresentChunk(ChunkCoords pos) const {
-			auto v = chunk_map.find(pos);
-			if (v != chunk_map.end()) return v->second;
-			return nullptr; // no
+			Chunk* v = nullptr;
+			chunk_map.find(pos, v);
+			return v; // or nullptr
 		}
 
 		/// gets chunk anyway. If not exist, adds new chunk to map and load_queue, to be processed by other systems later 
+		/// Main thread only!
 		inline Chunk* getChunk(ChunkCoords pos) noexcept {
-			auto v = chunk_map.find(pos);
-			if (v != chunk_map.end()) return v->second;
+			Chunk* v = nullptr;
+			if (chunk_map.find(pos, v)) return v;
 			// stuff is going on
 			auto* o = new(std::nothrow) Chunk{.pos=pos};
 			if (!o) return nullptr; // alloc error
@@ -106,19 +126,20 @@
 		}
 
 		/// collects chunks from map into save queue. If chunk was not loaded yet, remioves it from load queue
+		/// Main thread only!
 		void collectChunks(int amount = 1) {
-			auto i = chunk_map.begin();
-			while (i != chunk_map.end()) {
-				assert(i->second != nullptr);
-				if (i->second->gc_info > 0) i->second->gc_info -= amount; // mark
-				if (i->second->gc_info <= 0) { // collected
-					if (!i->second->is_ready) load_queue.erase(i->first); // DELETE FROM LOAD QUEUE
-					save_queue.insert(i->first, i->second); // save later if conditions met
-					i = chunk_map.erase(i); // remove :)
-				} else { // still alive
-					i++;
+			chunk_map.erase_if([&](const ChunkCoords& pos, Chunk*& chunk) {
+				assert(chunk != nullptr);
+				if (chunk->gc_info > 0) chunk->gc_info -= amount; // mark
+				if (chunk->gc_info <= 0) { // collected
+					if (!chunk->is_ready) load_queue.erase(pos); // DELETE FROM LOAD QUEUE
+					save_queue.insert(pos, chunk); // save later if conditions met
+					return true; // remove :)
 				}
-			}
+				return false; // still alive
+			});
+			chunk_map.collect(); // free what is not used by other threads anymore (and shrinked tables)
+			if (load_queue.load_factor() < 0.125f) load_queue.shrink_to_fit(); // don't keep empty buckets forever
 		}
 
 	};
@@ -0,0 +1,393 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Multithreaded staged world generator
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "worldgen.hpp"
+
+#include <math.h>
+
+#define PROFILER_DEFINE_EXT
+#include "profiler.hpp"
+#include "clock.hpp"
+#include "doctest.h"
+
+namespace pb {
+
+static constexpr int W = Pixels::CHUNK_WIDTH;
+
+/** stable per-chunk random seed (splitmix64 finalizer) */
+static uint64_t chunk_seed(uint64_t seed, ChunkCoords pos, int salt) {
+	uint64_t z = seed ^ (uint64_t(pos.combo) << 8) ^ uint64_t(salt);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline bool is_solid(u8 v) { return v != PIX_NUL && v != PIX_AIR; }
+
+/*
+ * Stages.
+ * Only ctx.out may be written! Everything else is shared with other workers.
+ */
+
+static void gen_terrain(GenContext& ctx) {
+	for (int x = 0; x < W; x++) {
+		float wx = ctx.world_x(x);
+		float h = ctx.noise->noise1(wx * 0.01f) * 48.0f + ctx.noise->noise1(wx * 0.07f) * 6.0f;
+		float soil = 3.0f + ctx.noise->noise1(wx * 0.13f + 17.0f) * 2.0f;
+		for (int y = 0; y < W; y++) {
+			float wy = ctx.world_y(y);
+			u8 v = PIX_AIR;
+			if (wy >= h + soil) v = PIX_STONE;
+			else if (wy >= h) v = PIX_DIRT;
+			ctx.out->data[y * W + x] = v;
+		}
+	}
+}
+
+static void gen_caves(GenContext& ctx) {
+	for (int y = 0; y < W; y++) {
+		for (int x = 0; x < W; x++) {
+			u8& v = ctx.out->data[y * W + x];
+			if (!is_solid(v)) continue;
+			// keep a roof : don't open caves right under the air
+			if (!is_solid(ctx.prev(x, y - 1)) || !is_solid(ctx.prev(x, y - W / 2))) continue;
+
+			float wx = ctx.world_x(x), wy = ctx.world_y(y);
+			float n = ctx.noise->noise2(wx * 0.03f, wy * 0.045f);
+			if (fabsf(n) < 0.07f) v = PIX_AIR;	// "worm" caves along zero crossing
+		}
+	}
+}
+
+/** ore veins. Every chunk has it's own veins, that may cross borders : gather them from all neighbours */
+static void gen_ores(GenContext& ctx) {
+	for (int cy = -1; cy <= 1; cy++) {
+		for (int cx = -1; cx <= 1; cx++) {
+			RNG rng(chunk_seed(ctx.seed, chunk_near(ctx.pos, cx, cy), GEN_ORES));
+			int count = rng.getn() * 2;
+			for (int i = 0; i < count; i++) {
+				// vein center relative to THIS chunk
+				int ox = int(rng.getn() * W) + cx * W;
+				int oy = int(rng.getn() * W) + cy * W;
+				int r  = 1 + int(rng.getn() * 3);
+
+				for (int y = oy - r; y <= oy + r; y++) {
+					for (int x = ox - r; x <= ox + r; x++) {
+						if (x < 0 || y < 0 || x >= W || y >= W) continue; // not ours
+						if ((x - ox) * (x - ox) + (y - oy) * (y - oy) > r * r) continue;
+						u8& v = ctx.out->data[y * W + x];
+						if (v == PIX_STONE) v = PIX_ORE;
+					}
+				}
+			}
+		}
+	}
+}
+
+static void gen_decor(GenContext& ctx) {
+	// grass on top of the dirt
+	for (int y = 0; y < W; y++) {
+		for (int x = 0; x < W; x++) {
+			u8& v = ctx.out->data[y * W + x];
+			if (v == PIX_DIRT && ctx.prev(x, y - 1) == PIX_AIR) v = PIX_GRASS;
+		}
+	}
+
+	// trees are rooted in the neighbours too : gather them
+	for (int cy = -1; cy <= 1; cy++) {
+		for (int cx = -1; cx <= 1; cx++) {
+			RNG rng(chunk_seed(ctx.seed, chunk_near(ctx.pos, cx, cy), GEN_DECOR));
+			for (int tx = 0; tx < W; tx += 4) {
+				bool grow = rng.getn() < 0.3;
+				int height = 4 + int(rng.getn() * 5);
+				int crown = 2 + int(rng.getn() * 2);
+				if (!grow) continue;
+
+				// root position relative to THIS chunk. Surface is searched in the root chunk only
+				int rx = tx + cx * W, ry = 0;
+				bool found = false;
+				for (int y = 1; y < W && !found; y++) {
+					ry = y + cy * W;
+					found = ctx.prev(rx, ry) == PIX_DIRT && ctx.prev(rx, ry - 1) == PIX_AIR;
+				}
+				if (!found) continue;	// no surface there
+
+				auto put = [&ctx](int x, int y, u8 what) {
+					if (x < 0 || y < 0 || x >= W || y >= W) return;	// not ours
+					u8& v = ctx.out->data[y * W + x];
+					if (v == PIX_AIR || (what == PIX_WOOD && v == PIX_LEAVES)) v = what;
+				};
+
+				int top = ry - height;
+				for (int y = top - crown; y <= top + crown; y++) {
+					for (int x = rx - crown; x <= rx + crown; x++) {
+						if ((x - rx) * (x - rx) + (y - top) * (y - top) <= crown * crown + 1) put(x, y, PIX_LEAVES);
+					}
+				}
+				for (int y = ry - 1; y >= top; y--) put(rx, y, PIX_WOOD);
+			}
+		}
+	}
+}
+
+static const GenStageFunc stage_funcs[GEN_DONE + 1] = {nullptr, gen_terrain, gen_caves, gen_ores, gen_decor};
+static prof::ZoneDesc stage_zones[GEN_DONE + 1] = {{"WorldGen::None"}, {"WorldGen::Terrain"}, {"WorldGen::Caves"},
+																									{"WorldGen::Ores"}, {"WorldGen::Decor"}};
+
+/*
+ * Scheduling
+ */
+
+void WorldGenerator::init(uint64_t s, int threads) {
+	uninit();
+	seed = s;
+	noise.randomize(s);
+	stop = false;
+
+	if (threads <= 0) threads = int(std::thread::hardware_concurrency()) - 1;
+	if (threads <= 0) threads = 1;
+	for (int i = 0; i < threads; i++) {
+		workers.emplace_back([this]() { worker_main(); });
+	}
+}
+
+void WorldGenerator::uninit() {
+	{
+		std::unique_lock<TaggedMutex> l(lock);
+		stop = true;
+	}
+	cond.notify_all();
+	for (auto& t : workers) t.join();
+	workers.clear();
+
+	jobs.clear();
+	for (auto& [pos, e] : entries) delete e;
+	entries.clear();
+}
+
+WorldGenerator::Entry* WorldGenerator::find_entry(ChunkCoords pos) {
+	auto v = entries.find(pos);
+	if (v != entries.end()) return v->second;
+	return nullptr;
+}
+
+WorldGenerator::Entry* WorldGenerator::get_entry(ChunkCoords pos) {
+	auto v = entries.find(pos);
+	if (v != entries.end()) return v->second;
+	Entry* e = new Entry;
+	e->pos = pos;
+	entries.insert(pos, e);
+	return e;
+}
+
+/** queue next stage of this entry, if all dependencies are ready */
+bool WorldGenerator::try_queue(Entry* e) {
+	if (e->queued || e->stage >= e->want) return false;
+	int next = e->stage + 1;
+
+	if (next > GEN_TERRAIN) {
+		for (int y = -1; y <= 1; y++) {
+			for (int x = -1; x <= 1; x++) {
+				Entry* n = find_entry(chunk_near(e->pos, x, y));
+				if (!n || n->stage < next - 1) return false;	// not yet
+			}
+		}
+	}
+
+	e->queued = true;
+	jobs.push_back(e);
+	return true;
+}
+
+/** mark that we want this chunk at this stage, and request all the dependencies recursively */
+void WorldGenerator::want(ChunkCoords pos, int stage) {
+	Entry* e = get_entry(pos);
+	if (e->want >= stage) return;	// already requested
+	e->want = stage;
+
+	if (stage > GEN_TERRAIN) {
+		for (int y = -1; y <= 1; y++) {
+			for (int x = -1; x <= 1; x++) {
+				if (x || y) want(chunk_near(pos, x, y), stage - 1);
+			}
+		}
+	}
+	try_queue(e);
+}
+
+void WorldGenerator::request(ChunkCoords pos) {
+	{
+		std::unique_lock<TaggedMutex> l(lock);
+		want(pos, GEN_DONE);
+	}
+	cond.notify_all();
+}
+
+bool WorldGenerator::collect(ChunkCoords pos, Pixels& dst) {
+	std::unique_lock<TaggedMutex> l(lock);
+	Entry* e = find_entry(pos);
+	if (!e || e->stage < GEN_DONE) return false;
+	dst = e->layers[GEN_DONE - 1];
+	e->collected = true;
+	return true;
+}
+
+size_t WorldGenerator::pending() {
+	std::unique_lock<TaggedMutex> l(lock);
+	return jobs.size();
+}
+
+size_t WorldGenerator::cached() {
+	std::unique_lock<TaggedMutex> l(lock);
+	return entries.size();
+}
+
+/**
+ * Pending work on chunk may read it's neighbours, and theese neighbours may need their neighbours
+ * to get to the required stage... So we keep everything in GEN_DONE-1 radius around pending work.
+ * Dropped auxiliary chunks will be regenerated if needed again (generation is deterministic).
+ */
+void WorldGenerator::sweep() {
+	PROFILING_SCOPE("WorldGen::Sweep");
+	std::unique_lock<TaggedMutex> l(lock);
+	constexpr int R = GEN_DONE - 1;
+
+	HashMap<ChunkCoords, bool, hash_obj<ChunkCoords>> keep;
+	for (auto& [pos, e] : entries) {
+		if (e->stage >= e->want && !e->queued) continue;
+		for (int y = -R; y <= R; y++) {
+			for (int x = -R; x <= R; x++) keep.insert(chunk_near(pos, x, y), true);
+		}
+	}
+
+	std::vector<Entry*> drop;
+	for (auto& [pos, e] : entries) {
+		if (keep.contains(pos)) continue;
+		if (e->want >= GEN_DONE && !e->collected) continue;	// not taken yet
+		drop.push_back(e);
+	}
+
+	for (Entry* e : drop) {
+		entries.erase(e->pos);
+		delete e;
+	}
+	if (entries.load_factor() < 0.125f) entries.shrink_to_fit();
+}
+
+/** runs stage without the lock held. Entry and it's neighbours can't be dropped while job is pending */
+void WorldGenerator::run_job(Entry* e, int stage) {
+	GenContext ctx;
+	ctx.pos = e->pos;
+	ctx.noise = &noise;
+	ctx.seed = seed;
+	ctx.out = &e->layers[stage - 1];
+
+	if (stage > GEN_TERRAIN) {
+		std::unique_lock<TaggedMutex> l(lock);
+		for (int y = -1; y <= 1; y++) {
+			for (int x = -1; x <= 1; x++) {
+				ctx.near[(y + 1) * 3 + x + 1] = &find_entry(chunk_near(e->pos, x, y))->layers[stage - 2];
+			}
+		}
+	} else {
+		for (auto& p : ctx.near) p = nullptr;
+	}
+
+	if (ctx.near[4]) *ctx.out = *ctx.near[4];
+	else ctx.out->zero();
+
+	prof::Zone zone(prof::get_thread_data(), stage_zones[stage]);
+	stage_funcs[stage](ctx);
+}
+
+void WorldGenerator::worker_main() {
+	auto prof_ctx = prof::make_thread_data();
+	prof_ctx.master.set_name("WorldGen worker");
+	double last_step = prof::prof_clock();
+
+	try {
+		while (true) {
+			Entry* e = nullptr;
+			int stage = 0;
+			{
+				std::unique_lock<TaggedMutex> l(lock);
+				if (jobs.empty()) {
+					l.unlock();
+					prof_ctx.master.step();	// going to sleep : flush stats
+					last_step = prof::prof_clock();
+					l.lock();
+				}
+				cond.wait(l, [this]() { return stop || !jobs.empty(); });
+				if (stop) break;
+				e = jobs.front();
+				jobs.pop_front();
+				stage = e->stage + 1;
+				PROFILING_GAUGE("WorldGen::Queue", jobs.size());
+			}
+
+			run_job(e, stage);
+
+			{
+				std::unique_lock<TaggedMutex> l(lock);
+				e->stage = stage;
+				e->queued = false;
+				if (stage == GEN_DONE) PROFILING_COUNTER("WorldGen::Chunks done", 1);
+				// this may unlock next stage for us and for all neighbours
+				for (int y = -1; y <= 1; y++) {
+					for (int x = -1; x <= 1; x++) {
+						Entry* n = find_entry(chunk_near(e->pos, x, y));
+						if (n) try_queue(n);
+					}
+				}
+			}
+			cond.notify_all();
+
+			if (prof::prof_clock() - last_step > 1.0 / 60.0) {
+				prof_ctx.master.step();
+				last_step = prof::prof_clock();
+			}
+		}
+	} catch (...) {
+		LOG_ERROR("world generator worker failed!");
+	}
+}
+
+TEST_CASE("WorldGenerator") {
+	auto prof_ctx = prof::make_thread_data();
+	ChunkCoords pos = {.part = {0, 0}};
+	Pixels a, b;
+
+	auto generate = [pos](int threads, Pixels& dst) {
+		WorldGenerator gen;
+		gen.init(1234, threads);
+		gen.request(pos);
+		while (!gen.collect(pos, dst)) std::this_thread::yield();
+		CHECK(gen.cached() >= 49);	// all dependencies are kept until sweep
+		gen.sweep();
+		CHECK(gen.cached() == 0);
+		gen.uninit();
+	};
+
+	generate(1, a);
+	generate(4, b);
+	// results do not depend on the scheduling
+	for (int i = 0; i < Pixels::CHUNK_SIZE; i++) REQUIRE(a.data[i] == b.data[i]);
+}
+
+};	// namespace pb
@@ -0,0 +1,153 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Multithreaded staged world generator
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "base.hpp"
+#include "random.h"
+#include "sync.hpp"
+#include "world.hpp"
+
+namespace pb {
+
+/**
+ * Generation stages, in order of execution.
+ *
+ * Stage N of the chunk is started ONLY when all 8 neighbours of this chunk
+ * have reached stage N-1. Stage reads previous stage results of the whole 3x3
+ * neighbourhood, but writes ONLY into it's own chunk. Results of every stage
+ * are cached separately, so neighbours may still read them while this chunk
+ * goes further.
+ *
+ * This way features that cross chunk borders (trees, ore veins) are "gathered"
+ * by every chunk they touch, without any locks on pixel data, and every
+ * stage is executed exactly once per chunk.
+ */
+enum GenStage : int {
+	GEN_NONE = 0,	// nothing is generated yet
+	GEN_TERRAIN,	// base terrain : stone, dirt and air above
+	GEN_CAVES,		// caves, carved out of the terrain
+	GEN_ORES,			// ore veins in the stone
+	GEN_DECOR,		// surface decoration : grass and trees
+	GEN_DONE = GEN_DECOR
+};
+
+/** what stage function can see and touch */
+struct GenContext {
+	ChunkCoords   pos;
+	const Pixels* near[9];	// previous stage results of 3x3 neighbourhood, near[4] is this chunk. All nullptr for GEN_TERRAIN
+	Pixels*       out;			// result of this stage. Initially filled with previous stage result of this chunk (or zeroes)
+	NoiseGen*     noise;		// shared, readonly
+	uint64_t      seed;
+
+	/** previous stage pixel. x and y are relative to this chunk and may go out of it by one chunk width */
+	inline u8 prev(int x, int y) const {
+		constexpr int W = Pixels::CHUNK_WIDTH;
+		int cx = x < 0 ? 0 : (x >= W ? 2 : 1);
+		int cy = y < 0 ? 0 : (y >= W ? 2 : 1);
+		const Pixels* p = near[cy * 3 + cx];
+		return p->data[(y - (cy - 1) * W) * W + (x - (cx - 1) * W)];
+	}
+
+	/** world position of the chunk pixel */
+	inline int64_t world_x(int x) const { return int64_t(int16_t(pos.part[0])) * Pixels::CHUNK_WIDTH + x; }
+	inline int64_t world_y(int y) const { return int64_t(int16_t(pos.part[1])) * Pixels::CHUNK_WIDTH + y; }
+};
+
+using GenStageFunc = void (*)(GenContext&);
+
+/**
+ * Schedules generation stages of requested chunks across worker threads.
+ * All public methods are threadsafe, but are intended to be called from the main thread.
+ *
+ * Usage : request() chunks you want, and collect() them later, when they are ready.
+ * Call sweep() from time to time to drop cached stage results nobody needs anymore.
+ */
+class WorldGenerator : public Static {
+ protected:
+	struct Entry {
+		ChunkCoords pos;
+		int  stage  = GEN_NONE;	// last finished stage
+		int  want   = GEN_NONE;	// stage we (or our neighbours) need
+		bool queued = false;		// in job queue or running
+		bool collected = false;	// final result was taken by collect()
+		Pixels layers[GEN_DONE];	// result of every stage. layers[N-1] for stage N
+	};
+
+	NoiseGen noise = NoiseGen(0);
+	uint64_t seed  = 0;
+
+	static inline LockTag lock_tag{"Lock::WorldGen"};
+	TaggedMutex lock{lock_tag};	// protects everything below, EXCEPT pixel data of the running stages
+	std::condition_variable_any cond;
+	static inline MemoryTag entries_mem{"WorldGen entries"};
+	HashMap<ChunkCoords, Entry*, hash_obj<ChunkCoords>, HashMapEqualTo<ChunkCoords>, TaggedAllocator> entries{TaggedAllocator(entries_mem)};
+	std::deque<Entry*> jobs;
+	std::vector<std::thread> workers;
+	bool stop = false;
+
+ public:
+	WorldGenerator() = default;
+	~WorldGenerator() { uninit(); }
+
+	/** starts worker threads. threads <= 0 means hardware concurrency - 1 (at least one) */
+	void init(uint64_t seed, int threads = 0);
+
+	/** stops and joins all workers, drops all cached results */
+	void uninit();
+
+	/** request chunk to be fully generated. Also schedules everything it depends on */
+	void request(ChunkCoords pos);
+
+	/** if chunk is fully generated, copies result into dst and returns true */
+	bool collect(ChunkCoords pos, Pixels& dst);
+
+	/** drops cached stage results, that are not needed by any pending work anymore */
+	void sweep();
+
+	/** count of stages waiting for the free worker */
+	size_t pending();
+
+	/** count of chunks (complete or not) the generator keeps in memory */
+	size_t cached();
+
+ protected:
+	void worker_main();
+	void run_job(Entry* e, int stage);
+	// LOCK MUST BE HELD BY CALLER!
+	Entry* get_entry(ChunkCoords pos);
+	Entry* find_entry(ChunkCoords pos);
+	void want(ChunkCoords pos, int stage);
+	bool try_queue(Entry* e);
+};
+
+/** neighbour chunk position. World wraps around at the 16 bit coordinates boundary */
+inline ChunkCoords chunk_near(ChunkCoords pos, int dx, int dy) {
+	ChunkCoords v;
+	v.part[0] = u16(pos.part[0] + dx);
+	v.part[1] = u16(pos.part[1] + dy);
+	return v;
+}
+
+};	// namespace pb
@@ -0,0 +1,357 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * pb::HashMap benchmark : lookup speed and probe lengths on chunk coordinates
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Build with cmake (target hashmap_bench, optimized and without sanitizers), or :
+//   # g++ -std=c++20 -O2 -I. -Iengine tools/hashmap_bench.cpp -o hashmap_bench
+// Usage:
+//   hashmap_bench [pattern...]
+// Patterns: rect, diagonal, random (all by default). String keys are measured always
+//   hashmap_bench churn
+// Player walking around : millions of chunk inserts and erases, lookup speed is measured as it goes
+//   hashmap_bench batch
+// find() one by one against find_many() and insert_many(), on maps much bigger than L2 cache
+
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "engine/hashmap.hpp"
+#include "engine/world.hpp"
+
+using pb::ChunkCoords;
+
+// hash_obj before the fast hashers : murmurhash over every byte of the key
+struct MurmurHash {
+	size_t operator()(const ChunkCoords& p) const noexcept {
+		return pb::murmurhash(std::string_view((const char*)(&p), sizeof(p)));
+	}
+};
+
+static ChunkCoords make_pos(int x, int y) {
+	ChunkCoords v;
+	v.part[0] = uint16_t(x);
+	v.part[1] = uint16_t(y);
+	return v;
+}
+
+/// xorshift, to not depend on the engine RNG
+static uint64_t rng_state = 0x2545F4914F6CDD1DULL;
+static uint64_t rng() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static void shuffle(std::vector<ChunkCoords>& v) {
+	for (size_t i = v.size(); i > 1; i--) {
+		std::swap(v[i - 1], v[rng() % i]);
+	}
+}
+
+struct Pattern {
+	const char* name;
+	std::vector<ChunkCoords> keys;   // inserted into the map
+	std::vector<ChunkCoords> misses; // never inserted
+};
+
+/// chunks around the player : dense rectangle around the origin (negative coordinates wrap around)
+static Pattern pattern_rect() {
+	Pattern p = {"rect", {}, {}};
+	for (int y = -64; y < 64; y++) {
+		for (int x = -128; x < 128; x++) p.keys.push_back(make_pos(x, y));
+	}
+	for (int y = 64; y < 128; y++) {
+		for (int x = -128; x < 128; x++) p.misses.push_back(make_pos(x, y));
+	}
+	return p;
+}
+
+/// player going diagonally : a band, few chunks wide
+static Pattern pattern_diagonal() {
+	Pattern p = {"diagonal", {}, {}};
+	for (int i = 0; i < 8192; i++) {
+		for (int w = -2; w <= 1; w++) p.keys.push_back(make_pos(i + w, i));
+	}
+	for (int i = 0; i < 8192; i++) {
+		for (int w = 2; w <= 3; w++) p.misses.push_back(make_pos(i + w, i));
+	}
+	return p;
+}
+
+/// scattered chunks, for the reference
+static Pattern pattern_random() {
+	Pattern p = {"random", {}, {}};
+	pb::HashSet<uint32_t> used;
+	while (p.keys.size() < 32768) {
+		auto v = make_pos(rng(), rng());
+		if (used.insert(v.combo).second) p.keys.push_back(v);
+	}
+	while (p.misses.size() < 16384) {
+		auto v = make_pos(rng(), rng());
+		if (used.insert(v.combo).second) p.misses.push_back(v);
+	}
+	return p;
+}
+
+static double now() {
+	using namespace std::chrono;
+	return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+static constexpr int ROUNDS = 20;
+
+/// ns per lookup. Best of ROUNDS, to not depend on the scheduler that much
+template <typename MapT>
+static double time_lookups(const MapT& map, const std::vector<ChunkCoords>& keys, size_t& found) {
+	double best = 1e30;
+	for (int r = 0; r < ROUNDS; r++) {
+		size_t cnt = 0;
+		double start = now();
+		for (auto& k : keys) cnt += map.find(k) != map.end();
+		double t = now() - start;
+		if (t < best) best = t;
+		found = cnt;
+	}
+	return best * 1e9 / double(keys.size());
+}
+
+/// distance (in buckets) from the home bucket of the key to the bucket it is stored in.
+/// Lookup reads one group of control bytes per Group::WIDTH buckets of the distance
+template <typename MapT, typename HashT>
+static void probe_lengths(const MapT& map, HashT hasher) {
+	static const int bounds[] = {0, 1, 4, 16, 32, 64};
+	static const int nbounds = sizeof(bounds) / sizeof(bounds[0]);
+	size_t hist[nbounds] = {0};
+	size_t mask = map.bucket_count() - 1;
+	size_t total = 0, max = 0;
+	for (auto it = map.begin(); it != map.end(); ++it) {
+		size_t dist = (it._bucket - hasher(it->first)) & mask;
+		int i = nbounds - 1;
+		while (dist < size_t(bounds[i])) i--;
+		hist[i]++;
+		total += dist;
+		if (dist > max) max = dist;
+	}
+	printf("    probe  avg %6.2f max %4zu |", double(total) / double(map.size()), max);
+	for (int i = 0; i < nbounds; i++) {
+		if (i + 1 < nbounds) printf(" %d-%d: %5.1f%%", bounds[i], bounds[i + 1] - 1, 100.0 * double(hist[i]) / double(map.size()));
+		else printf(" %d+: %5.1f%%", bounds[i], 100.0 * double(hist[i]) / double(map.size()));
+	}
+	printf("\n");
+}
+
+template <typename HashT>
+static void run(const char* hash_name, Pattern& p) {
+	pb::HashMap<ChunkCoords, uint32_t, HashT> map;
+	double start = now();
+	for (size_t i = 0; i < p.keys.size(); i++) map.insert(p.keys[i], uint32_t(i));
+	double insert_ns = (now() - start) * 1e9 / double(p.keys.size());
+
+	auto hits = p.keys;
+	shuffle(hits);
+	size_t found_hits = 0, found_misses = 0;
+	double hit_ns = time_lookups(map, hits, found_hits);
+	double miss_ns = time_lookups(map, p.misses, found_misses);
+	if (found_hits != hits.size() || found_misses != 0) {
+		fprintf(stderr, "%s/%s : map is broken! (%zu/%zu hits, %zu misses)\n", p.name, hash_name, found_hits, hits.size(), found_misses);
+	}
+
+	printf("  %-8s %-8s keys %6zu buckets %6zu | insert %6.2f ns, hit %6.2f ns, miss %6.2f ns\n", p.name, hash_name, map.size(),
+				 map.bucket_count(), insert_ns, hit_ns, miss_ns);
+	probe_lengths(map, HashT());
+}
+
+struct StringMurmurHash {
+	size_t operator()(const std::string& s) const noexcept { return pb::murmurhash(s); }
+};
+
+/// profiler zone names and file paths : 10..60 characters
+template <typename HashT>
+static void run_strings(const char* hash_name) {
+	std::vector<std::string> keys;
+	for (int i = 0; i < 4096; i++) {
+		keys.push_back("engine/some_module.cpp:" + std::to_string(i) + std::string(rng() % 32, 'x'));
+	}
+	pb::HashSet<std::string, HashT> set;
+	for (auto& k : keys) set.insert(k);
+
+	double best = 1e30;
+	size_t cnt = 0;
+	for (int r = 0; r < ROUNDS; r++) {
+		cnt = 0;
+		double start = now();
+		for (auto& k : keys) cnt += set.contains(k);
+		double t = now() - start;
+		if (t < best) best = t;
+	}
+	if (cnt != keys.size()) fprintf(stderr, "strings/%s : set is broken!\n", hash_name);
+	printf("  %-8s %-8s keys %6zu buckets %6zu | hit %6.2f ns\n", "strings", hash_name, set.size(), set.bucket_count(),
+				 best * 1e9 / double(keys.size()));
+}
+
+/// Window of loaded chunks around the player, who walks in a big circle.
+/// Chunks that leave the window are erased, chunks that come in are inserted, as collectChunks() does.
+/// Lookup time and probe lengths must not grow with the number of the erases.
+static void run_churn() {
+	static constexpr int RADIUS = 48;
+	static constexpr size_t CYCLES = 8000000;  // inserts + erases
+	static constexpr size_t REPORT = 1000000;
+
+	pb::HashMap<ChunkCoords, uint32_t> map;
+	std::vector<ChunkCoords> loaded, probe;
+	int px = 0, py = 0;
+	auto in_window = [&](ChunkCoords p) {
+		int dx = int16_t(p.part[0] - uint16_t(px)), dy = int16_t(p.part[1] - uint16_t(py));
+		return dx >= -RADIUS && dx < RADIUS && dy >= -RADIUS && dy < RADIUS;
+	};
+
+	printf("churn : window %dx%d chunks, %zu inserts + erases\n", RADIUS * 2, RADIUS * 2, CYCLES);
+	size_t cycles = 0, next_report = 0, step = 0;
+	while (cycles < CYCLES) {
+		// walk
+		double a = double(step++) * 0.0005;
+		px = int(4000.0 * cos(a));
+		py = int(4000.0 * sin(a));
+
+		// load everything in the window
+		for (int y = py - RADIUS; y < py + RADIUS; y++) {
+			for (int x = px - RADIUS; x < px + RADIUS; x++) {
+				if (map.insert(make_pos(x, y), uint32_t(cycles)).second) cycles++;
+			}
+		}
+		// unload everything outside
+		for (auto it = map.begin(); it != map.end();) {
+			if (!in_window(it->first)) {
+				it = map.erase(it);
+				cycles++;
+			} else {
+				++it;
+			}
+		}
+
+		if (cycles >= next_report) {
+			next_report += REPORT;
+			probe.clear();
+			for (auto& p : map) probe.push_back(p.first);
+			shuffle(probe);
+			size_t found = 0;
+			double hit_ns = time_lookups(map, probe, found);
+			for (auto& p : probe) p.part[1] += RADIUS * 2; // out of the window
+			double miss_ns = time_lookups(map, probe, found);
+			printf("  %-8s %9zu cycles keys %6zu buckets %6zu | hit %6.2f ns, miss %6.2f ns\n", "churn", cycles, map.size(), map.bucket_count(),
+						 hit_ns, miss_ns);
+			probe_lengths(map, pb::Hash<ChunkCoords>());
+		}
+	}
+}
+
+/// Lookups in big maps are cache misses : find_many() starts loading up to BATCH home buckets at once
+static void run_batch() {
+	static constexpr size_t SIZES[] = {1 << 16, 1 << 20, 1 << 22};
+	static constexpr size_t CHUNK = 256; // keys per find_many() call, like a range of chunks to render
+
+	printf("batch : find() vs find_many(), insert() vs insert_many()\n");
+	for (size_t size : SIZES) {
+		std::vector<ChunkCoords> keys;
+		std::vector<uint32_t> values;
+		pb::HashSet<uint32_t> used;
+		while (keys.size() < size) {
+			auto v = make_pos(rng(), rng());
+			if (used.insert(v.combo).second) {
+				keys.push_back(v);
+				values.push_back(uint32_t(keys.size()));
+			}
+		}
+
+		pb::HashMap<ChunkCoords, uint32_t> seq, many;
+		double start = now();
+		for (size_t i = 0; i < size; i++) seq.insert(keys[i], values[i]);
+		double insert_ns = (now() - start) * 1e9 / double(size);
+		start = now();
+		many.insert_many(keys.data(), values.data(), size);
+		double insert_many_ns = (now() - start) * 1e9 / double(size);
+
+		auto hits = keys;
+		shuffle(hits);
+		size_t found = 0;
+		double find_ns = time_lookups(seq, hits, found);
+
+		std::vector<uint32_t*> out(CHUNK);
+		double best = 1e30;
+		size_t found_many = 0;
+		for (int r = 0; r < ROUNDS / 4; r++) {
+			found_many = 0;
+			start = now();
+			for (size_t i = 0; i < size; i += CHUNK) {
+				found_many += seq.find_many(hits.data() + i, std::min(CHUNK, size - i), out.data());
+			}
+			double t = now() - start;
+			if (t < best) best = t;
+		}
+		if (found != size || found_many != size || many.size() != size) {
+			fprintf(stderr, "batch : map is broken! (%zu, %zu, %zu of %zu)\n", found, found_many, many.size(), size);
+		}
+		printf("  %-8s keys %8zu (%5zu KiB) | insert %6.2f ns, insert_many %6.2f ns | find %6.2f ns, find_many %6.2f ns\n", "batch",
+					 size, seq.bucket_count() * (sizeof(std::pair<ChunkCoords, uint32_t>) + 2) / 1024, insert_ns, insert_many_ns, find_ns,
+					 best * 1e9 / double(size));
+	}
+}
+
+int main(int argc, char** argv) {
+	if (argc == 2 && strcmp(argv[1], "churn") == 0) {
+		run_churn();
+		return 0;
+	}
+	if (argc == 2 && strcmp(argv[1], "batch") == 0) {
+		run_batch();
+		return 0;
+	}
+
+	std::vector<Pattern> patterns;
+	auto wanted = [&](const char* name) {
+		if (argc < 2) return true;
+		for (int i = 1; i < argc; i++) {
+			if (strcmp(argv[i], name) == 0) return true;
+		}
+		return false;
+	};
+	if (wanted("rect")) patterns.push_back(pattern_rect());
+	if (wanted("diagonal")) patterns.push_back(pattern_diagonal());
+	if (wanted("random")) patterns.push_back(pattern_random());
+	if (patterns.empty()) {
+		fprintf(stderr, "usage: %s [rect] [diagonal] [random]\n       %s churn\n       %s batch\n", argv[0], argv[0], argv[0]);
+		return 1;
+	}
+
+	printf("pb::HashMap<ChunkCoords, u32> lookups\n");
+	for (auto& p : patterns) {
+		run<MurmurHash>("murmur", p);
+		run<pb::Hash<ChunkCoords>>("Hash", p);
+	}
+
+	printf("pb::HashSet<std::string> lookups\n");
+	run_strings<StringMurmurHash>("murmur");
+	run_strings<pb::Hash<std::string>>("Hash");
+	return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Profiler stats comparison : flags zones that became slower than in the baseline
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Build with cmake (target prof_compare), or :
+//   # g++ -std=c++20 -O2 -Iengine tools/prof_compare.cpp -o prof_compare
+// Usage:
+//   prof_compare [-t percent] [-m ms] baseline.csv current.csv
+// Both files are written by pb::prof::dump_stats() (PB_PROF_DUMP=stats.csv pixelbox).
+// Zone is a regression, if it's mean, p95 or time per frame grew by more than
+// percent (10 by default) AND by more than ms (0.01 by default) : tiny zones are noisy.
+// Exit code is 1 if there are regressions, 2 on errors.
+
+#include <algorithm>
+#include <map>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "profiler_csv.hpp"
+
+namespace {
+
+enum Metric {
+	MEAN,
+	P95,
+	FRAME,
+	METRICS
+};
+
+const char* metric_names[METRICS] = {"mean", "p95", "frame"};
+
+struct Row {
+	double v[METRICS] = {};
+	double weight = 0; // calls per frame, for merging
+};
+
+// (thread, zone). Zones with the same name in one thread are merged
+using Table = std::map<std::pair<std::string, std::string>, Row>;
+
+bool load(const char* path, Table& dst) {
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "can't open %s\n", path);
+		return false;
+	}
+
+	char line[4096];
+	std::map<std::string, int> columns;
+	if (fgets(line, sizeof(line), f)) {
+		auto header = pb::prof::csv::split_line(line);
+		for (size_t i = 0; i < header.size(); i++) columns[header[i]] = int(i);
+	}
+	static const char* need[] = {"thread", "zone", "calls_per_frame", "mean_ms", "p95_ms", "frame_ms"};
+	for (const char* c : need) if (!columns.count(c)) {
+		fprintf(stderr, "%s : no column %s, is it a dump_stats() CSV?\n", path, c);
+		fclose(f);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		auto fields = pb::prof::csv::split_line(line);
+		if (fields.size() < columns.size()) continue;
+		auto num = [&](const char* c) { return atof(fields[columns[c]].c_str()); };
+
+		Row& r = dst[{fields[columns["thread"]], fields[columns["zone"]]}];
+		double calls = num("calls_per_frame");
+		double total = r.weight + calls;
+		if (total <= 0) continue;
+		r.v[MEAN] = (r.v[MEAN] * r.weight + num("mean_ms") * calls) / total;
+		r.v[P95] = std::max(r.v[P95], num("p95_ms"));
+		r.v[FRAME] += num("frame_ms");
+		r.weight = total;
+	}
+	fclose(f);
+	return true;
+}
+
+struct Change {
+	const std::string* thread;
+	const std::string* zone;
+	int metric;
+	double from, to;
+	double rel() const { return from > 0 ? (to - from) / from : INFINITY; }
+};
+
+};
+
+int main(int argc, char** argv) {
+	double threshold = 10, min_ms = 0.01;
+	const char* files[2] = {};
+	int nfiles = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-t") && i + 1 < argc) threshold = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-m") && i + 1 < argc) min_ms = atof(argv[++i]);
+		else if (nfiles < 2 && argv[i][0] != '-') files[nfiles++] = argv[i];
+		else nfiles = 3; // usage
+	}
+	if (nfiles != 2) {
+		fprintf(stderr, "usage: %s [-t percent] [-m ms] baseline.csv current.csv\n", argv[0]);
+		return 2;
+	}
+
+	Table base, cur;
+	if (!load(files[0], base) || !load(files[1], cur)) return 2;
+
+	std::vector<Change> regressions, improvements;
+	size_t matched = 0;
+	for (auto& [key, now] : cur) {
+		auto it = base.find(key);
+		if (it == base.end()) continue;
+		matched++;
+		const Row& old = it->second;
+		for (int m = 0; m < METRICS; m++) {
+			Change c{&key.first, &key.second, m, old.v[m], now.v[m]};
+			if (fabs(c.to - c.from) <= min_ms) continue;
+			if (c.rel() * 100 > threshold) regressions.push_back(c);
+			else if (-c.rel() * 100 > threshold) improvements.push_back(c);
+		}
+	}
+
+	auto print = [](const char* title, std::vector<Change>& list) {
+		if (list.empty()) return;
+		std::sort(list.begin(), list.end(), [](const Change& a, const Change& b) {
+			return fabs(a.rel()) > fabs(b.rel());
+		});
+		printf("%s:\n", title);
+		for (auto& c : list) {
+			printf("  %-16s %-32s %-6s %10.4f -> %10.4f ms (%+.1f%%)\n", c.thread->c_str(), c.zone->c_str(),
+				metric_names[c.metric], c.from, c.to, c.rel() * 100);
+		}
+	};
+	print("Regressions", regressions);
+	print("Improvements", improvements);
+
+	for (auto& [key, _] : cur) if (!base.count(key)) printf("New zone : %s %s\n", key.first.c_str(), key.second.c_str());
+	for (auto& [key, _] : base) if (!cur.count(key)) printf("Gone zone : %s %s\n", key.first.c_str(), key.second.c_str());
+
+	printf("%zu zones compared, %zu regressions (threshold %g%%, %g ms)\n", matched, regressions.size(), threshold, min_ms);
+	return regressions.empty() ? 0 : 1;
+}
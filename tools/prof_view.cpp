@@ -0,0 +1,274 @@
+/*
+ * This file is a part of Pixelbox - Infinite 2D sandbox game
+ * Profiler stream viewer : top-like console view of the running game
+ * Copyright (C) 2024 UtoECat
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Build with cmake (target prof_view), or :
+//   # g++ -std=c++20 -O2 -Iengine tools/prof_view.cpp -o prof_view
+// Usage:
+//   prof_view [-i seconds] [-n zones] [address]
+// Game must be started with PB_PROF_STREAM=address (see pb::prof::start_stream()).
+// Address is "unix:/path", "port", "127.0.0.1:port" or "[::1]:port", 7420 by default.
+// Every interval (1 second by default) prints, for every thread : frame times,
+// top zones by the time per frame, counters (per frame) and gauges (last value).
+
+#include <algorithm>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "profiler_stream.hpp"
+
+namespace {
+
+using namespace pb::prof::stream;
+
+enum Kind { ZONE, COUNTER, GAUGE }; // pb::prof::ZoneKind
+
+struct ZoneInfo {
+	std::string name;
+	uint32_t kind = ZONE;
+};
+
+/** one zone in one thread, over the interval */
+struct ZoneAcc {
+	uint64_t calls = 0;
+	double total = 0; // ms for the zones, sum for the counters
+	double last = 0; // gauges
+	bool seen = false; // gauges : ever updated, kept between intervals
+};
+
+struct ThreadAcc {
+	std::string name;
+	uint64_t frames = 0;
+	double total_ms = 0, max_ms = 0;
+	uint64_t dropped = 0;
+	std::map<uint32_t, ZoneAcc> zones;
+};
+
+std::map<uint32_t, ZoneInfo> zones;
+std::map<uint32_t, ThreadAcc> threads;
+
+int connect_to(const char* address) {
+	int fd = -1;
+	if (strncmp(address, "unix:", 5) == 0) {
+		sockaddr_un a = {};
+		a.sun_family = AF_UNIX;
+		if (strlen(address + 5) >= sizeof(a.sun_path)) return -1;
+		strcpy(a.sun_path, address + 5);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 && connect(fd, (sockaddr*)&a, sizeof(a)) == 0) return fd;
+	} else {
+		bool ipv6 = false;
+		uint16_t port = parse_loopback(address, ipv6);
+		if (!port) {
+			errno = EINVAL; // not the loopback : the game never listens there
+			return -1;
+		}
+		sockaddr_in a4 = {};
+		sockaddr_in6 a6 = {};
+		a4.sin_family = AF_INET;
+		a4.sin_port = htons(port);
+		a4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		a6.sin6_family = AF_INET6;
+		a6.sin6_port = htons(port);
+		a6.sin6_addr = in6addr_loopback;
+		fd = socket(ipv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+		if (fd >= 0 && connect(fd, ipv6 ? (sockaddr*)&a6 : (sockaddr*)&a4, ipv6 ? sizeof(a6) : sizeof(a4)) == 0) return fd;
+	}
+	if (fd >= 0) close(fd);
+	return -1;
+}
+
+void on_record(const RecordHeader& hdr, const char* p) {
+	switch (hdr.type) {
+	case ZONE_NAME: {
+		if (hdr.size < sizeof(ZoneRecord)) return;
+		ZoneRecord z;
+		memcpy(&z, p, sizeof(z));
+		zones[z.id] = ZoneInfo{std::string(p + sizeof(z), hdr.size - sizeof(z)), z.kind};
+	} break;
+	case THREAD_NAME: {
+		if (hdr.size < sizeof(ThreadRecord)) return;
+		ThreadRecord t;
+		memcpy(&t, p, sizeof(t));
+		threads[t.index].name.assign(p + sizeof(t), hdr.size - sizeof(t));
+	} break;
+	case FRAME: {
+		if (hdr.size < sizeof(FrameRecord)) return;
+		FrameRecord f;
+		memcpy(&f, p, sizeof(f));
+		if (hdr.size < sizeof(f) + uint64_t(f.count) * sizeof(FrameEntry)) return;
+		ThreadAcc& t = threads[f.thread];
+		t.dropped += f.dropped;
+		if (f.part == 0) {
+			t.frames++;
+			t.total_ms += f.frame_ms;
+			t.max_ms = std::max(t.max_ms, f.frame_ms);
+		}
+		for (uint32_t i = 0; i < f.count; i++) {
+			FrameEntry e;
+			memcpy(&e, p + sizeof(f) + i * sizeof(e), sizeof(e));
+			ZoneAcc& z = t.zones[e.id];
+			z.calls += e.ncalls;
+			z.total += e.value;
+			z.last = e.value;
+			z.seen = true;
+		}
+	} break;
+	default: break; // newer version of the game
+	}
+}
+
+const char* zone_name(uint32_t id) {
+	auto it = zones.find(id);
+	return it != zones.end() ? it->second.name.c_str() : "?";
+}
+
+uint32_t zone_kind(uint32_t id) {
+	auto it = zones.find(id);
+	return it != zones.end() ? it->second.kind : uint32_t(ZONE);
+}
+
+void print(double seconds, size_t top) {
+	printf("\x1b[H\x1b[2J"); // clear the screen
+	for (auto& [index, t] : threads) {
+		if (t.name.empty()) printf("Thread %u", index);
+		else printf("%s", t.name.c_str());
+		double fps = t.frames / seconds;
+		printf(" : %.1f frames/s, mean %.3f ms, max %.3f ms", fps, t.frames ? t.total_ms / t.frames : 0.0, t.max_ms);
+		if (t.dropped) printf(", %llu dropped", (unsigned long long)t.dropped);
+		printf("\n");
+
+		std::vector<std::pair<double, uint32_t>> order;
+		for (auto& [id, z] : t.zones) if (zone_kind(id) == ZONE && z.calls) order.emplace_back(z.total, id);
+		std::sort(order.begin(), order.end(), [](auto& a, auto& b) { return a.first > b.first; });
+		if (order.size() > top) order.resize(top);
+		double frames = t.frames ? double(t.frames) : 1.0;
+		for (auto& [total, id] : order) {
+			const ZoneAcc& z = t.zones[id];
+			printf("  %-40s %9.3f ms/frame %8.1f calls/frame %9.4f ms/call\n", zone_name(id),
+				total / frames, z.calls / frames, total / double(z.calls));
+		}
+		for (auto& [id, z] : t.zones) {
+			uint32_t kind = zone_kind(id);
+			if (kind == COUNTER && z.calls) printf("  %-40s %12g per frame\n", zone_name(id), z.total / frames);
+			if (kind == GAUGE && z.seen) printf("  %-40s %12g\n", zone_name(id), z.last);
+		}
+		printf("\n");
+
+		// next interval : gauges keep their last value
+		t.frames = 0;
+		t.total_ms = t.max_ms = 0;
+		t.dropped = 0;
+		for (auto& [_, z] : t.zones) {
+			z.calls = 0;
+			z.total = 0;
+		}
+	}
+	fflush(stdout);
+}
+
+double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+};
+
+int main(int argc, char** argv) {
+	double interval = 1;
+	size_t top = 15;
+	const char* address = DEFAULT_ADDRESS;
+	bool has_address = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-i") && i + 1 < argc) interval = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-n") && i + 1 < argc) top = size_t(atoi(argv[++i]));
+		else if (!has_address && argv[i][0] != '-') address = argv[i], has_address = true;
+		else interval = 0; // usage
+	}
+	if (interval <= 0) {
+		fprintf(stderr, "usage: %s [-i seconds] [-n zones] [address]\n", argv[0]);
+		return 2;
+	}
+
+	int fd = connect_to(address);
+	if (fd < 0) {
+		fprintf(stderr, "can't connect to %s : %s\n", address, strerror(errno));
+		return 2;
+	}
+
+	std::vector<char> data;
+	size_t at = 0;
+	bool magic = false;
+	double last = now();
+	for (;;) {
+		pollfd pfd{fd, POLLIN, 0};
+		int left_ms = int((last + interval - now()) * 1000);
+		if (left_ms > 0 && poll(&pfd, 1, left_ms) > 0) {
+			char buff[1 << 16];
+			ssize_t n = recv(fd, buff, sizeof(buff), 0);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) {
+				printf("stream closed\n");
+				break;
+			}
+			data.insert(data.end(), buff, buff + n);
+		}
+
+		if (!magic && data.size() >= sizeof(STREAM_MAGIC)) {
+			if (memcmp(data.data(), STREAM_MAGIC, sizeof(STREAM_MAGIC)) != 0) {
+				fprintf(stderr, "%s is not a profiler stream\n", address);
+				return 2;
+			}
+			magic = true;
+			at = sizeof(STREAM_MAGIC);
+		}
+		RecordHeader hdr;
+		while (magic && data.size() - at >= sizeof(hdr)) {
+			memcpy(&hdr, data.data() + at, sizeof(hdr));
+			if (data.size() - at - sizeof(hdr) < hdr.size) break; // not whole yet
+			on_record(hdr, data.data() + at + sizeof(hdr));
+			at += sizeof(hdr) + hdr.size;
+		}
+		if (at > 0) { // consumed
+			data.erase(data.begin(), data.begin() + at);
+			at = 0;
+		}
+
+		if (now() - last >= interval) {
+			print(now() - last, top);
+			last = now();
+		}
+	}
+	close(fd);
+	return 0;
+}